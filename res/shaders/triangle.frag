@@ -2,14 +2,21 @@
 #extension GL_ARB_separate_shader_objects : enable
 
 layout(binding = 1) uniform sampler2DArray texSampler;
+// BC7 layers with alpha when the textures are block compressed, otherwise the same image as texSampler
+layout(binding = 3) uniform sampler2DArray alphaSampler;
 
 layout(location = 0) in vec3 fragNormal;
 layout(location = 1) in vec3 fragTexCoord;
+layout(location = 2) flat in uint fragImage;
 
 layout(location = 0) out vec4 outColor;
 
 void main()
 {	
 	float NdotL = clamp(dot(fragNormal, vec3(0.58)), 0, 1);
-    outColor = clamp(NdotL + 0.5, 0, 1) * texture(texSampler, fragTexCoord);
+	// Derivatives outside the branch, neighbouring pixels may take the other side
+	vec2 dx = dFdx(fragTexCoord.xy);
+	vec2 dy = dFdy(fragTexCoord.xy);
+	vec4 texel = fragImage == 0u ? textureGrad(texSampler, fragTexCoord, dx, dy) : textureGrad(alphaSampler, fragTexCoord, dx, dy);
+    outColor = clamp(NdotL + 0.5, 0, 1) * texel;
 }
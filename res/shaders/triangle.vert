@@ -8,21 +8,63 @@ layout(binding = 0) uniform UniformBufferObject
 	mat4x4 proj;
 } ubo;
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inTexCoord;
+// Block layer -> image << 15 | layer within the image, four to a vector
+layout(binding = 2) uniform LayerMap
+{
+	uvec4 layers[512];
+} layerMap;
+
+// x, y, z = chunk-local position, w = face | corner << 3 | texture layer << 5
+layout(location = 0) in uvec4 inPacked;
+
+// Per instance, the draw's firstInstance selects its chunk's origin
+layout(location = 1) in vec4 inChunkOrigin;
 
 layout(location = 0) out vec3 fragNormal;
 layout(location = 1) out vec3 fragTexCoord;
+layout(location = 2) flat out uint fragImage;
 
 out gl_PerVertex
 {
     vec4 gl_Position;
 };
 
+// Indexed by BlockFace: Top, Bottom, North, South, East, West
+const vec3 faceNormals[6] = vec3[](
+	vec3(0.0, 1.0, 0.0),
+	vec3(0.0, -1.0, 0.0),
+	vec3(0.0, 0.0, -1.0),
+	vec3(0.0, 0.0, 1.0),
+	vec3(1.0, 0.0, 0.0),
+	vec3(-1.0, 0.0, 0.0));
+
+// Position axes mapped to the texture u and v coordinates of each face, texture repeats once per block
+const vec3 faceTexU[6] = vec3[](
+	vec3(1.0, 0.0, 0.0),
+	vec3(-1.0, 0.0, 0.0),
+	vec3(-1.0, 0.0, 0.0),
+	vec3(1.0, 0.0, 0.0),
+	vec3(0.0, 0.0, -1.0),
+	vec3(0.0, 0.0, 1.0));
+
+const vec3 faceTexV[6] = vec3[](
+	vec3(0.0, 0.0, 1.0),
+	vec3(0.0, 0.0, 1.0),
+	vec3(0.0, -1.0, 0.0),
+	vec3(0.0, -1.0, 0.0),
+	vec3(0.0, -1.0, 0.0),
+	vec3(0.0, -1.0, 0.0));
+
 void main()
 {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-	fragNormal = inNormal;
-    fragTexCoord = inTexCoord;
+	vec3 position = vec3(inPacked.xyz);
+	uint face = inPacked.w & 7u;
+	uint blockLayer = inPacked.w >> 5;
+	uint mapped = layerMap.layers[blockLayer >> 2][blockLayer & 3u];
+	float layer = float(mapped & 0x7fffu);
+
+    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(position + inChunkOrigin.xyz, 1.0);
+	fragNormal = faceNormals[face];
+    fragTexCoord = vec3(dot(position, faceTexU[face]), dot(position, faceTexV[face]), layer);
+	fragImage = mapped >> 15;
 }
@@ -0,0 +1,313 @@
+#include "block_storage.h"
+
+#include <algorithm>
+
+static uint32_t bits_for_palette_size(size_t palette_size)
+{
+    if (palette_size <= 1)
+    {
+        return 0;
+    }
+
+    uint32_t bits = 1;
+
+    while ((1u << bits) < palette_size)
+    {
+        bits <<= 1;
+    }
+
+    return bits;
+}
+
+static uint32_t log2_bits(uint32_t bits)
+{
+    uint32_t result = 0;
+
+    while ((1u << result) < bits)
+    {
+        ++result;
+    }
+
+    return result;
+}
+
+PalettedBlocks::PalettedBlocks(uint32_t count)
+{
+    reset(count);
+}
+
+void PalettedBlocks::reset(uint32_t count, BlockType fill)
+{
+    _count = count;
+    _palette.assign(1, fill);
+    _data.clear();
+    _data.shrink_to_fit();
+    _bits = 0;
+    _bits_log2 = 0;
+    _indices_per_word_log2 = 0;
+    _mask = 0;
+    _last_type = 0;
+}
+
+void PalettedBlocks::set(uint32_t index, BlockType type)
+{
+    uint32_t palette_index = find_or_add(type);
+
+    if (_bits == 0)
+    {
+        return;
+    }
+
+    uint32_t word = index >> _indices_per_word_log2;
+    uint32_t shift = (index & ((1u << _indices_per_word_log2) - 1)) << _bits_log2;
+    _data[word] = (_data[word] & ~(_mask << shift)) | ((uint64_t)palette_index << shift);
+}
+
+void PalettedBlocks::compact()
+{
+    uint32_t used[256] = {};
+
+    for (uint32_t i = 0; i < _count; ++i)
+    {
+        uint32_t palette_index = 0;
+
+        if (_bits)
+        {
+            uint32_t word = i >> _indices_per_word_log2;
+            uint32_t shift = (i & ((1u << _indices_per_word_log2) - 1)) << _bits_log2;
+            palette_index = (uint32_t)((_data[word] >> shift) & _mask);
+        }
+
+        used[palette_index]++;
+    }
+
+    std::vector<BlockType> palette;
+    uint8_t remap[256] = {};
+
+    for (uint32_t i = 0; i < _palette.size(); ++i)
+    {
+        if (used[i])
+        {
+            remap[i] = (uint8_t)palette.size();
+            palette.push_back(_palette[i]);
+        }
+    }
+
+    if (palette.empty())
+    {
+        return;
+    }
+
+    // Repack reads through the old palette width, then switch over
+    uint32_t bits = bits_for_palette_size(palette.size());
+    repack(bits, remap);
+    _palette = palette;
+    _palette.shrink_to_fit();
+    _last_type = 0;
+}
+
+static void write_varint(std::vector<uint8_t>& out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+
+    out.push_back((uint8_t)value);
+}
+
+static bool read_varint(const uint8_t*& data, const uint8_t* end, uint32_t& value)
+{
+    value = 0;
+
+    for (uint32_t shift = 0; shift < 32 && data < end; shift += 7)
+    {
+        uint8_t byte = *data++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void PalettedBlocks::write(std::vector<uint8_t>& out) const
+{
+    out.push_back((uint8_t)(_palette.size() - 1));
+
+    for (BlockType type : _palette)
+    {
+        out.push_back((uint8_t)type);
+    }
+
+    out.push_back((uint8_t)_bits);
+
+    for (size_t i = 0; i < _data.size();)
+    {
+        uint64_t word = _data[i];
+        size_t run = 1;
+
+        while (i + run < _data.size() && _data[i + run] == word)
+        {
+            ++run;
+        }
+
+        write_varint(out, (uint32_t)run);
+
+        for (int b = 0; b < 8; ++b)
+        {
+            out.push_back((uint8_t)(word >> (b * 8)));
+        }
+
+        i += run;
+    }
+}
+
+bool PalettedBlocks::read(uint32_t count, const uint8_t*& data, const uint8_t* end)
+{
+    if (end - data < 1)
+    {
+        return false;
+    }
+
+    size_t palette_size = (size_t)*data++ + 1;
+
+    if ((size_t)(end - data) < palette_size + 1)
+    {
+        return false;
+    }
+
+    reset(count);
+    _palette.resize(palette_size);
+
+    for (size_t i = 0; i < palette_size; ++i)
+    {
+        if (data[i] >= block_type_count)
+        {
+            return false;
+        }
+
+        _palette[i] = (BlockType)data[i];
+    }
+
+    data += palette_size;
+    uint32_t bits = *data++;
+
+    if (bits != bits_for_palette_size(palette_size))
+    {
+        return false;
+    }
+
+    // Set up the index width for the palette, then fill the words in directly
+    repack(bits, nullptr);
+
+    for (size_t i = 0; i < _data.size();)
+    {
+        uint32_t run;
+
+        if (!read_varint(data, end, run) || run == 0 || run > _data.size() - i || end - data < 8)
+        {
+            return false;
+        }
+
+        uint64_t word = 0;
+
+        for (int b = 0; b < 8; ++b)
+        {
+            word |= (uint64_t)data[b] << (b * 8);
+        }
+
+        data += 8;
+        std::fill(_data.begin() + i, _data.begin() + i + run, word);
+        i += run;
+    }
+
+    if (bits && palette_size < (1u << bits))
+    {
+        // Corrupt data could index past the end of a palette that doesn't fill the index width
+        for (uint32_t i = 0; i < _count; ++i)
+        {
+            uint32_t word = i >> _indices_per_word_log2;
+            uint32_t shift = (i & ((1u << _indices_per_word_log2) - 1)) << _bits_log2;
+
+            if (((_data[word] >> shift) & _mask) >= palette_size)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+uint32_t PalettedBlocks::find_or_add(BlockType type)
+{
+    if (_palette[_last_type] == type)
+    {
+        return _last_type;
+    }
+
+    for (uint32_t i = 0; i < _palette.size(); ++i)
+    {
+        if (_palette[i] == type)
+        {
+            _last_type = i;
+            return i;
+        }
+    }
+
+    _palette.push_back(type);
+    uint32_t bits = bits_for_palette_size(_palette.size());
+
+    if (bits != _bits)
+    {
+        repack(bits, nullptr);
+    }
+
+    _last_type = (uint32_t)_palette.size() - 1;
+    return _last_type;
+}
+
+void PalettedBlocks::repack(uint32_t bits, const uint8_t* remap)
+{
+    std::vector<uint64_t> data;
+    uint32_t bits_log2 = log2_bits(bits);
+    uint32_t indices_per_word_log2 = 6 - bits_log2;
+    uint64_t mask = (bits == 0) ? 0 : ((bits == 64) ? ~0ull : ((1ull << bits) - 1));
+
+    if (bits)
+    {
+        data.resize(((size_t)_count + (1u << indices_per_word_log2) - 1) >> indices_per_word_log2);
+
+        for (uint32_t i = 0; i < _count; ++i)
+        {
+            uint32_t palette_index = 0;
+
+            if (_bits)
+            {
+                uint32_t word = i >> _indices_per_word_log2;
+                uint32_t shift = (i & ((1u << _indices_per_word_log2) - 1)) << _bits_log2;
+                palette_index = (uint32_t)((_data[word] >> shift) & _mask);
+            }
+
+            if (remap)
+            {
+                palette_index = remap[palette_index];
+            }
+
+            uint32_t word = i >> indices_per_word_log2;
+            uint32_t shift = (i & ((1u << indices_per_word_log2) - 1)) << bits_log2;
+            data[word] |= (uint64_t)palette_index << shift;
+        }
+    }
+
+    _data.swap(data);
+    _bits = bits;
+    _bits_log2 = bits_log2;
+    _indices_per_word_log2 = bits ? indices_per_word_log2 : 0;
+    _mask = mask;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum class BlockType : uint8_t
+{
+    Air,
+    Bedrock,
+    Brick,
+    OreCoal,
+    Cobble,
+    MossyCobble,
+    OreDiamond,
+    Dirt,
+    Grass,
+    OreIron,
+    OreGold,
+    OreLapis,
+    Leaves,
+    Log,
+    Planks,
+    Stone
+};
+
+static const uint32_t block_type_count = (uint32_t)BlockType::Stone + 1;
+
+// Palette compressed block storage. Each block stores an index into a small palette of block types; indices are packed into
+// 64-bit words using the smallest of 0, 1, 2, 4 or 8 bits that can address the palette. With a single palette entry (an all air
+// or all stone section) no index data is stored at all. The index width grows as new block types are set and is only reduced by
+// compact(), which generation calls once it has finished writing.
+class PalettedBlocks
+{
+public:
+    explicit PalettedBlocks(uint32_t count = 0);
+
+    void reset(uint32_t count, BlockType fill = BlockType::Air);
+
+    BlockType get(uint32_t index) const
+    {
+        if (_bits == 0)
+        {
+            return _palette[0];
+        }
+
+        uint32_t word = index >> _indices_per_word_log2;
+        uint32_t shift = (index & ((1u << _indices_per_word_log2) - 1)) << _bits_log2;
+        return _palette[(_data[word] >> shift) & _mask];
+    }
+
+    void set(uint32_t index, BlockType type);
+
+    // Rebuilds the palette from the blocks in use and repacks at the smallest index width
+    void compact();
+
+    // Appends the palette and packed indices to out, runs of identical index words are run length encoded. read() restores
+    // them directly, without repacking, and returns false if the data is truncated or malformed.
+    void write(std::vector<uint8_t>& out) const;
+    bool read(uint32_t count, const uint8_t*& data, const uint8_t* end);
+
+    uint32_t get_bits() const { return _bits; }
+    uint32_t get_palette_size() const { return (uint32_t)_palette.size(); }
+    BlockType get_palette_entry(uint32_t i) const { return _palette[i]; }
+    size_t get_memory_usage() const { return sizeof(*this) + _palette.capacity() * sizeof(BlockType) + _data.capacity() * sizeof(uint64_t); }
+
+private:
+    uint32_t find_or_add(BlockType type);
+    void repack(uint32_t bits, const uint8_t* remap);
+
+    std::vector<BlockType> _palette;
+    std::vector<uint64_t> _data;
+    uint32_t _count = 0;
+    uint32_t _bits = 0;
+    uint32_t _bits_log2 = 0;
+    uint32_t _indices_per_word_log2 = 0;
+    uint64_t _mask = 0;
+    uint32_t _last_type = 0; // palette index of the last type set, generation writes long runs of the same type
+};
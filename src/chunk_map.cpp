@@ -0,0 +1,164 @@
+#include "chunk_map.h"
+
+static const uint32_t initial_shard_capacity = 64;
+
+ChunkHashMap::ChunkHashMap()
+{
+    for (Shard& shard : _shards)
+    {
+        shard.keys.resize(initial_shard_capacity);
+        shard.values.resize(initial_shard_capacity, nullptr);
+    }
+}
+
+uint64_t ChunkHashMap::hash(Key key)
+{
+    // splitmix64 finaliser, neighbouring chunks differ in a few low bits of each half of the key
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+Chunk* ChunkHashMap::find(int32_t x, int32_t z) const
+{
+    Key key = world::ChunkMap::key(x, z);
+    uint64_t h = hash(key);
+    const Shard& shard = _shards[h >> 60];
+
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+    size_t mask = shard.values.size() - 1;
+
+    for (size_t i = (size_t)h & mask;; i = (i + 1) & mask)
+    {
+        if (!shard.values[i])
+        {
+            return nullptr;
+        }
+
+        if (shard.keys[i] == key)
+        {
+            return shard.values[i];
+        }
+    }
+}
+
+bool ChunkHashMap::insert(int32_t x, int32_t z, Chunk* chunk)
+{
+    Key key = world::ChunkMap::key(x, z);
+    uint64_t h = hash(key);
+    Shard& shard = _shards[h >> 60];
+
+    std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+    size_t mask = shard.values.size() - 1;
+
+    for (size_t i = (size_t)h & mask; shard.values[i]; i = (i + 1) & mask)
+    {
+        if (shard.keys[i] == key)
+        {
+            return false;
+        }
+    }
+
+    // Keep the load factor under 3/4 so probe sequences stay short
+    if ((shard.count + 1) * 4 > shard.values.size() * 3)
+    {
+        grow(shard);
+    }
+
+    insert_slot(shard, key, h, chunk);
+    shard.count++;
+    return true;
+}
+
+Chunk* ChunkHashMap::remove(int32_t x, int32_t z)
+{
+    Key key = world::ChunkMap::key(x, z);
+    uint64_t h = hash(key);
+    Shard& shard = _shards[h >> 60];
+
+    std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+    size_t mask = shard.values.size() - 1;
+    size_t i = (size_t)h & mask;
+
+    for (;; i = (i + 1) & mask)
+    {
+        if (!shard.values[i])
+        {
+            return nullptr;
+        }
+
+        if (shard.keys[i] == key)
+        {
+            break;
+        }
+    }
+
+    Chunk* chunk = shard.values[i];
+    shard.values[i] = nullptr;
+    shard.count--;
+
+    // Backward shift: move later entries of the cluster into the hole unless that would put them before their home slot
+    for (size_t j = (i + 1) & mask; shard.values[j]; j = (j + 1) & mask)
+    {
+        size_t home = (size_t)hash(shard.keys[j]) & mask;
+
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            shard.keys[i] = shard.keys[j];
+            shard.values[i] = shard.values[j];
+            shard.values[j] = nullptr;
+            i = j;
+        }
+    }
+
+    return chunk;
+}
+
+uint32_t ChunkHashMap::size() const
+{
+    uint32_t count = 0;
+
+    for (const Shard& shard : _shards)
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        count += shard.count;
+    }
+
+    return count;
+}
+
+void ChunkHashMap::grow(Shard& shard)
+{
+    std::vector<Key> keys;
+    std::vector<Chunk*> values;
+    keys.swap(shard.keys);
+    values.swap(shard.values);
+
+    shard.keys.resize(keys.size() * 2);
+    shard.values.resize(values.size() * 2, nullptr);
+
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        if (values[i])
+        {
+            insert_slot(shard, keys[i], hash(keys[i]), values[i]);
+        }
+    }
+}
+
+void ChunkHashMap::insert_slot(Shard& shard, Key key, uint64_t h, Chunk* chunk)
+{
+    size_t mask = shard.values.size() - 1;
+    size_t i = (size_t)h & mask;
+
+    while (shard.values[i])
+    {
+        i = (i + 1) & mask;
+    }
+
+    shard.keys[i] = key;
+    shard.values[i] = chunk;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "world.h"
+
+class Chunk;
+
+// Concurrent hash map from chunk coordinates to chunks, keyed on world::ChunkMap::key. The table is split into shards by hash,
+// each an open addressing table with linear probing and backward shift deletion guarded by its own reader/writer lock, so
+// lookups from worker threads only contend with writes to the same shard. The map doesn't own the chunks.
+class ChunkHashMap
+{
+public:
+    typedef world::ChunkMap::Key Key;
+
+    static const uint32_t shard_count = 16;
+
+    ChunkHashMap();
+
+    Chunk* find(int32_t x, int32_t z) const;
+    bool insert(int32_t x, int32_t z, Chunk* chunk); // false if the key is already present
+    Chunk* remove(int32_t x, int32_t z);
+
+    uint32_t size() const;
+
+    // Calls fn(Chunk*) for every chunk. Each shard is locked for reading while it is visited, so fn must not modify the map.
+    template <typename Fn>
+    void for_each(Fn fn) const
+    {
+        for (const Shard& shard : _shards)
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+            for (Chunk* chunk : shard.values)
+            {
+                if (chunk)
+                {
+                    fn(chunk);
+                }
+            }
+        }
+    }
+
+private:
+    struct Shard
+    {
+        mutable std::shared_timed_mutex mutex;
+        std::vector<Key> keys;
+        std::vector<Chunk*> values; // nullptr marks an empty slot
+        uint32_t count = 0;
+    };
+
+    static uint64_t hash(Key key);
+    static void grow(Shard& shard);
+    static void insert_slot(Shard& shard, Key key, uint64_t h, Chunk* chunk);
+
+    Shard _shards[shard_count];
+};
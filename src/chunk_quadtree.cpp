@@ -0,0 +1,319 @@
+#include "chunk_quadtree.h"
+
+#include <float.h>
+#include <glm/common.hpp>
+
+#include "world.h"
+
+static int floor_div(int value, int divisor)
+{
+    return (value >= 0) ? value / divisor : (value - divisor + 1) / divisor;
+}
+
+void ChunkQuadtree::insert(int chunk_x, int chunk_z, uint32_t id, const geometry::aabb& bounds)
+{
+    int root_x = floor_div(chunk_x, root_size);
+    int root_z = floor_div(chunk_z, root_size);
+    uint64_t key = world::ChunkMap::key(root_x, root_z);
+    auto it = _roots.find(key);
+    uint32_t index;
+
+    if (it == _roots.end())
+    {
+        index = create_node(root_x * root_size, root_z * root_size, depth);
+        _roots.emplace(key, index);
+    }
+    else
+    {
+        index = it->second;
+    }
+
+    glm::vec3 min = bounds.center - bounds.extents;
+    glm::vec3 max = bounds.center + bounds.extents;
+
+    while (true)
+    {
+        // Nodes may be reallocated by create_node, so index rather than holding a reference
+        _nodes[index].min = glm::min(_nodes[index].min, min);
+        _nodes[index].max = glm::max(_nodes[index].max, max);
+        _nodes[index].item_count++;
+
+        if (_nodes[index].level == 0)
+        {
+            break;
+        }
+
+        int child = child_index(_nodes[index], chunk_x, chunk_z);
+
+        if (_nodes[index].children[child] == invalid_index)
+        {
+            int half = leaf_size << (_nodes[index].level - 1);
+            uint32_t child_node =
+                    create_node(_nodes[index].x + ((child & 1) ? half : 0), _nodes[index].z + ((child & 2) ? half : 0), _nodes[index].level - 1);
+            _nodes[index].children[child] = child_node;
+        }
+
+        index = _nodes[index].children[child];
+    }
+
+    Leaf& leaf = _leaves[_nodes[index].leaf];
+    leaf.boxes.add(bounds);
+    leaf.ids.push_back(id);
+}
+
+void ChunkQuadtree::remove(int chunk_x, int chunk_z, uint32_t id)
+{
+    uint64_t key = world::ChunkMap::key(floor_div(chunk_x, root_size), floor_div(chunk_z, root_size));
+    auto it = _roots.find(key);
+
+    if (it == _roots.end())
+    {
+        return;
+    }
+
+    uint32_t path[depth + 1];
+    path[0] = it->second;
+
+    for (int level = 1; level <= depth; ++level)
+    {
+        const Node& node = _nodes[path[level - 1]];
+        path[level] = node.children[child_index(node, chunk_x, chunk_z)];
+
+        if (path[level] == invalid_index)
+        {
+            return;
+        }
+    }
+
+    Leaf& leaf = _leaves[_nodes[path[depth]].leaf];
+    size_t item = 0;
+
+    while (item < leaf.ids.size() && leaf.ids[item] != id)
+    {
+        item++;
+    }
+
+    if (item == leaf.ids.size())
+    {
+        return;
+    }
+
+    // AabbBatch::remove moves the last box into the removed slot, keep the ids in step
+    leaf.boxes.remove((uint32_t)item);
+    leaf.ids[item] = leaf.ids.back();
+    leaf.ids.pop_back();
+
+    for (int level = depth; level >= 0; --level)
+    {
+        Node& node = _nodes[path[level]];
+
+        if (--node.item_count)
+        {
+            update_bounds(node);
+            continue;
+        }
+
+        free_node(path[level]);
+
+        if (level > 0)
+        {
+            Node& parent = _nodes[path[level - 1]];
+            parent.children[child_index(parent, chunk_x, chunk_z)] = invalid_index;
+        }
+        else
+        {
+            _roots.erase(it);
+        }
+    }
+}
+
+void ChunkQuadtree::clear()
+{
+    _nodes.clear();
+    _free_nodes.clear();
+    _leaves.clear();
+    _free_leaves.clear();
+    _roots.clear();
+}
+
+void ChunkQuadtree::cull(const geometry::frustum& frustum, std::vector<uint32_t>& visible, std::vector<uint32_t>& inside)
+{
+    _tested_count = 0;
+
+    for (const std::pair<const uint64_t, uint32_t>& root : _roots)
+    {
+        cull_node(frustum, root.second, 0x3f, visible, inside);
+    }
+}
+
+uint32_t ChunkQuadtree::create_node(int x, int z, int level)
+{
+    uint32_t index;
+
+    if (_free_nodes.empty())
+    {
+        index = (uint32_t)_nodes.size();
+        _nodes.emplace_back();
+    }
+    else
+    {
+        index = _free_nodes.back();
+        _free_nodes.pop_back();
+    }
+
+    Node& node = _nodes[index];
+    node.min = glm::vec3(FLT_MAX);
+    node.max = glm::vec3(-FLT_MAX);
+    node.x = x;
+    node.z = z;
+    node.level = level;
+    node.children[0] = node.children[1] = node.children[2] = node.children[3] = invalid_index;
+    node.leaf = invalid_index;
+    node.item_count = 0;
+
+    if (level == 0)
+    {
+        if (_free_leaves.empty())
+        {
+            node.leaf = (uint32_t)_leaves.size();
+            _leaves.emplace_back();
+        }
+        else
+        {
+            node.leaf = _free_leaves.back();
+            _free_leaves.pop_back();
+        }
+    }
+
+    return index;
+}
+
+void ChunkQuadtree::free_node(uint32_t index)
+{
+    Node& node = _nodes[index];
+
+    if (node.leaf != invalid_index)
+    {
+        _leaves[node.leaf].boxes.clear();
+        _leaves[node.leaf].ids.clear();
+        _free_leaves.push_back(node.leaf);
+        node.leaf = invalid_index;
+    }
+
+    _free_nodes.push_back(index);
+}
+
+void ChunkQuadtree::update_bounds(Node& node)
+{
+    node.min = glm::vec3(FLT_MAX);
+    node.max = glm::vec3(-FLT_MAX);
+
+    if (node.level == 0)
+    {
+        const culling::AabbBatch& boxes = _leaves[node.leaf].boxes;
+
+        for (uint32_t i = 0; i < boxes.size(); ++i)
+        {
+            glm::vec3 center(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]);
+            glm::vec3 extents(boxes.extents_x[i], boxes.extents_y[i], boxes.extents_z[i]);
+            node.min = glm::min(node.min, center - extents);
+            node.max = glm::max(node.max, center + extents);
+        }
+
+        return;
+    }
+
+    for (uint32_t child : node.children)
+    {
+        if (child != invalid_index)
+        {
+            node.min = glm::min(node.min, _nodes[child].min);
+            node.max = glm::max(node.max, _nodes[child].max);
+        }
+    }
+}
+
+void ChunkQuadtree::cull_node(const geometry::frustum& frustum, uint32_t index, uint32_t planes, std::vector<uint32_t>& visible,
+                              std::vector<uint32_t>& inside)
+{
+    const Node& node = _nodes[index];
+    _tested_count++;
+
+    geometry::aabb bounds;
+    bounds.set_from_corners(node.min, node.max);
+
+    // Planes the node is wholly in front of can't cull anything below it
+    for (int p = 0; p < 6; ++p)
+    {
+        if (planes & (1 << p))
+        {
+            int side = geometry::testAabbPlane(bounds, frustum.planes[p]);
+
+            if (side < 0)
+            {
+                return;
+            }
+
+            if (side > 0)
+            {
+                planes &= ~(1 << p);
+            }
+        }
+    }
+
+    if (planes == 0)
+    {
+        gather(index, inside);
+        return;
+    }
+
+    if (node.level == 0)
+    {
+        const Leaf& leaf = _leaves[node.leaf];
+        culling::cull_batch(frustum, leaf.boxes, _visibility);
+
+        for (uint32_t i = 0; i < leaf.boxes.size(); ++i)
+        {
+            if (_visibility[i >> 6] & (1ull << (i & 63)))
+            {
+                visible.push_back(leaf.ids[i]);
+            }
+        }
+
+        return;
+    }
+
+    for (uint32_t child : node.children)
+    {
+        if (child != invalid_index)
+        {
+            cull_node(frustum, child, planes, visible, inside);
+        }
+    }
+}
+
+void ChunkQuadtree::gather(uint32_t index, std::vector<uint32_t>& ids) const
+{
+    const Node& node = _nodes[index];
+
+    if (node.level == 0)
+    {
+        const Leaf& leaf = _leaves[node.leaf];
+        ids.insert(ids.end(), leaf.ids.begin(), leaf.ids.end());
+        return;
+    }
+
+    for (uint32_t child : node.children)
+    {
+        if (child != invalid_index)
+        {
+            gather(child, ids);
+        }
+    }
+}
+
+int ChunkQuadtree::child_index(const Node& node, int chunk_x, int chunk_z)
+{
+    int half = leaf_size << (node.level - 1);
+    return ((chunk_x - node.x >= half) ? 1 : 0) | ((chunk_z - node.z >= half) ? 2 : 0);
+}
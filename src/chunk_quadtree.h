@@ -0,0 +1,68 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "culling.h"
+
+// Quadtree over chunk columns for hierarchical frustum culling. Each node bounds the union of its items' AABBs, which are tight to
+// the meshed voxels, so a subtree is rejected or accepted with a single test. Leaves keep their items in an AabbBatch and test
+// them with cull_batch. Roots are created on demand so the tree covers an unbounded world.
+class ChunkQuadtree
+{
+public:
+    static const int leaf_size = 8; // chunk columns along each side of a leaf
+    static const int depth = 3;     // levels above the leaves
+    static const int root_size = leaf_size << depth;
+
+    void insert(int chunk_x, int chunk_z, uint32_t id, const geometry::aabb& bounds);
+    void remove(int chunk_x, int chunk_z, uint32_t id);
+    void clear();
+
+    // Appends the ids of the items that intersect the frustum to visible, and those of subtrees wholly inside the frustum to
+    // inside, their contents need no further testing
+    void cull(const geometry::frustum& frustum, std::vector<uint32_t>& visible, std::vector<uint32_t>& inside);
+
+    uint32_t get_node_count() const { return (uint32_t)(_nodes.size() - _free_nodes.size()); }
+    uint32_t get_tested_count() const { return _tested_count; } // nodes tested by the last cull
+
+private:
+    static const uint32_t invalid_index = UINT32_MAX;
+
+    struct Node
+    {
+        glm::vec3 min;
+        glm::vec3 max;
+        int x; // first chunk column covered
+        int z;
+        int level; // 0 for leaves
+        uint32_t children[4]; // x then z halves, invalid_index if empty
+        uint32_t leaf;        // index into _leaves for leaves
+        uint32_t item_count;
+    };
+
+    struct Leaf
+    {
+        culling::AabbBatch boxes;
+        std::vector<uint32_t> ids;
+    };
+
+    uint32_t create_node(int x, int z, int level);
+    void free_node(uint32_t index);
+    void update_bounds(Node& node);
+    void cull_node(const geometry::frustum& frustum, uint32_t index, uint32_t planes, std::vector<uint32_t>& visible,
+                   std::vector<uint32_t>& inside);
+    void gather(uint32_t index, std::vector<uint32_t>& ids) const;
+    static int child_index(const Node& node, int chunk_x, int chunk_z);
+
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _free_nodes;
+    std::vector<Leaf> _leaves;
+    std::vector<uint32_t> _free_leaves;
+    std::unordered_map<uint64_t, uint32_t> _roots; // keyed by world::ChunkMap::key of the root's position in root_size units
+    std::vector<uint64_t> _visibility;             // cull_batch scratch
+    uint32_t _tested_count = 0;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "texture_mips.h"
+
+// Block compressed texture array blob written offline by tools/bc_encoder and loaded by TextureArray when the device can sample
+// BC1 and BC7. Opaque layers are encoded as BC1 and layers with alpha as BC7, each group in its own array as an image has a single
+// format. The blob is:
+//
+//   Header
+//   uint32_t layer_map[layer_count]  source layer -> array << 15 | layer within the array (array 0 = BC1, 1 = BC7)
+//   BC1 array data                   each mip level in turn, all the array's layers of a level contiguous
+//   BC7 array data                   likewise
+namespace compressed_texture
+{
+
+static const uint32_t magic = 0x43424356; // "VCBC"
+static const uint32_t version = 1;
+static const uint32_t array_count = 2;
+static const uint32_t bc1_array = 0;
+static const uint32_t bc7_array = 1;
+static const uint32_t bc1_block_size = 8;
+static const uint32_t bc7_block_size = 16;
+static const uint32_t array_shift = 15;
+static const uint32_t max_layers = 2048; // the layer bits of ChunkVertex::attributes
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash; // see hash_source
+    uint32_t width;
+    uint32_t height;
+    uint32_t layer_count;
+    uint32_t mip_levels;
+    uint32_t array_layers[array_count];
+    uint64_t array_sizes[array_count];
+};
+
+inline uint32_t block_size(uint32_t array)
+{
+    return array == bc1_array ? bc1_block_size : bc7_block_size;
+}
+
+// Levels smaller than a block still take a whole block
+inline uint64_t level_size(uint32_t width, uint32_t height, uint32_t layer_count, uint32_t level, uint32_t block_size)
+{
+    uint64_t blocks_x = (texture_mips::level_extent(width, level) + 3) / 4;
+    uint64_t blocks_y = (texture_mips::level_extent(height, level) + 3) / 4;
+    return blocks_x * blocks_y * block_size * layer_count;
+}
+
+// FNV-1a over each source's file name and size in layer order. The encoder and loader list the sources on different platforms,
+// so write times aren't comparable; the hash catches added, removed, renamed, reordered and resized sources.
+inline uint64_t hash_source(uint64_t hash, const char* name, size_t name_length, uint64_t file_size)
+{
+    for (size_t i = 0; i < name_length; ++i)
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    }
+
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+        hash = (hash ^ (uint8_t)(file_size >> (i * 8))) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static const uint64_t source_hash_seed = 0xcbf29ce484222325ull;
+
+} // namespace compressed_texture
@@ -1,8 +1,15 @@
 #include "culling.h"
 
+#include <Windows.h>
+
 #include <glm/common.hpp>
 #include <glm/geometric.hpp>
 
+#include <chrono>
+#include <immintrin.h>
+#include <intrin.h>
+#include <sstream>
+
 namespace geometry
 {
 void aabb::set_from_corners(const glm::vec3& a, const glm::vec3& b)
@@ -36,4 +43,267 @@ bool cull(const geometry::frustum& frustum, const geometry::aabb& b)
 
     return false;
 }
+
+uint32_t AabbBatch::add(const geometry::aabb& b)
+{
+    uint32_t index = _count++;
+    uint32_t padded = (_count + batch_width - 1) & ~(batch_width - 1);
+
+    if (padded > center_x.size())
+    {
+        center_x.resize(padded, 0.0f);
+        center_y.resize(padded, 0.0f);
+        center_z.resize(padded, 0.0f);
+        extents_x.resize(padded, 0.0f);
+        extents_y.resize(padded, 0.0f);
+        extents_z.resize(padded, 0.0f);
+    }
+
+    set(index, b);
+    return index;
+}
+
+void AabbBatch::set(uint32_t index, const geometry::aabb& b)
+{
+    center_x[index] = b.center.x;
+    center_y[index] = b.center.y;
+    center_z[index] = b.center.z;
+    extents_x[index] = b.extents.x;
+    extents_y[index] = b.extents.y;
+    extents_z[index] = b.extents.z;
+}
+
+uint32_t AabbBatch::remove(uint32_t index)
+{
+    uint32_t last = --_count;
+
+    if (index != last)
+    {
+        center_x[index] = center_x[last];
+        center_y[index] = center_y[last];
+        center_z[index] = center_z[last];
+        extents_x[index] = extents_x[last];
+        extents_y[index] = extents_y[last];
+        extents_z[index] = extents_z[last];
+    }
+
+    return last;
+}
+
+void AabbBatch::clear()
+{
+    _count = 0;
+    center_x.clear();
+    center_y.clear();
+    center_z.clear();
+    extents_x.clear();
+    extents_y.clear();
+    extents_z.clear();
+}
+
+static void cull_batch_scalar(const geometry::frustum& frustum, const AabbBatch& boxes, uint64_t* visible)
+{
+    for (uint32_t i = 0; i < boxes.size(); ++i)
+    {
+        geometry::aabb b;
+        b.center = glm::vec3(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]);
+        b.extents = glm::vec3(boxes.extents_x[i], boxes.extents_y[i], boxes.extents_z[i]);
+
+        if (!cull(frustum, b))
+        {
+            visible[i >> 6] |= 1ull << (i & 63);
+        }
+    }
+}
+
+// The SIMD paths evaluate testAabbPlane with the same operations in the same order, so their results match the scalar path exactly
+static void cull_batch_sse(const geometry::frustum& frustum, const AabbBatch& boxes, uint64_t* visible)
+{
+    __m128 n[6][3];
+    __m128 abs_n[6][3];
+    __m128 d[6];
+
+    for (int p = 0; p < 6; ++p)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            n[p][axis] = _mm_set1_ps(frustum.planes[p].n[axis]);
+            abs_n[p][axis] = _mm_set1_ps(fabs(frustum.planes[p].n[axis]));
+        }
+
+        d[p] = _mm_set1_ps(frustum.planes[p].d);
+    }
+
+    __m128 sign = _mm_set1_ps(-0.0f);
+
+    for (uint32_t i = 0; i < boxes.size(); i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&boxes.center_x[i]);
+        __m128 cy = _mm_loadu_ps(&boxes.center_y[i]);
+        __m128 cz = _mm_loadu_ps(&boxes.center_z[i]);
+        __m128 ex = _mm_loadu_ps(&boxes.extents_x[i]);
+        __m128 ey = _mm_loadu_ps(&boxes.extents_y[i]);
+        __m128 ez = _mm_loadu_ps(&boxes.extents_z[i]);
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, abs_n[p][0]), _mm_mul_ps(ey, abs_n[p][1])), _mm_mul_ps(ez, abs_n[p][2]));
+            __m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[p][0], cx), _mm_mul_ps(n[p][1], cy)), _mm_mul_ps(n[p][2], cz));
+            s = _mm_sub_ps(s, d[p]);
+            inside = _mm_andnot_ps(_mm_cmplt_ps(s, _mm_xor_ps(r, sign)), inside);
+        }
+
+        visible[i >> 6] |= (uint64_t)_mm_movemask_ps(inside) << (i & 63);
+    }
+}
+
+static void cull_batch_avx(const geometry::frustum& frustum, const AabbBatch& boxes, uint64_t* visible)
+{
+    __m256 n[6][3];
+    __m256 abs_n[6][3];
+    __m256 d[6];
+
+    for (int p = 0; p < 6; ++p)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            n[p][axis] = _mm256_set1_ps(frustum.planes[p].n[axis]);
+            abs_n[p][axis] = _mm256_set1_ps(fabs(frustum.planes[p].n[axis]));
+        }
+
+        d[p] = _mm256_set1_ps(frustum.planes[p].d);
+    }
+
+    __m256 sign = _mm256_set1_ps(-0.0f);
+
+    for (uint32_t i = 0; i < boxes.size(); i += 8)
+    {
+        __m256 cx = _mm256_loadu_ps(&boxes.center_x[i]);
+        __m256 cy = _mm256_loadu_ps(&boxes.center_y[i]);
+        __m256 cz = _mm256_loadu_ps(&boxes.center_z[i]);
+        __m256 ex = _mm256_loadu_ps(&boxes.extents_x[i]);
+        __m256 ey = _mm256_loadu_ps(&boxes.extents_y[i]);
+        __m256 ez = _mm256_loadu_ps(&boxes.extents_z[i]);
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+        for (int p = 0; p < 6; ++p)
+        {
+            __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, abs_n[p][0]), _mm256_mul_ps(ey, abs_n[p][1])), _mm256_mul_ps(ez, abs_n[p][2]));
+            __m256 s = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n[p][0], cx), _mm256_mul_ps(n[p][1], cy)), _mm256_mul_ps(n[p][2], cz));
+            s = _mm256_sub_ps(s, d[p]);
+            inside = _mm256_andnot_ps(_mm256_cmp_ps(s, _mm256_xor_ps(r, sign), _CMP_LT_OQ), inside);
+        }
+
+        visible[i >> 6] |= (uint64_t)_mm256_movemask_ps(inside) << (i & 63);
+    }
+
+    // Avoid the AVX to SSE transition penalty in the caller
+    _mm256_zeroupper();
+}
+
+static bool cpu_supports_avx()
+{
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+
+    // The OS must also preserve the YMM registers across context switches
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+}
+
+CullPath get_best_cull_path()
+{
+    // x64 always has SSE2
+    static const CullPath best = cpu_supports_avx() ? CullPath::AVX : CullPath::SSE;
+    return best;
+}
+
+void cull_batch(const geometry::frustum& frustum, const AabbBatch& boxes, std::vector<uint64_t>& visible, CullPath path)
+{
+    visible.assign((boxes.size() + 63) / 64, 0);
+
+    if (path == CullPath::Best)
+    {
+        path = get_best_cull_path();
+    }
+
+    switch (path)
+    {
+        case CullPath::Scalar:
+            cull_batch_scalar(frustum, boxes, visible.data());
+            break;
+
+        case CullPath::SSE:
+            cull_batch_sse(frustum, boxes, visible.data());
+            break;
+
+        default:
+            cull_batch_avx(frustum, boxes, visible.data());
+            break;
+    }
+
+    // The SIMD paths also test the padding after the last box
+    if (boxes.size() & 63)
+    {
+        visible.back() &= (1ull << (boxes.size() & 63)) - 1;
+    }
+}
+
+void benchmark_cull_batch(const geometry::frustum& frustum, const AabbBatch& boxes)
+{
+    if (boxes.size() == 0)
+    {
+        return;
+    }
+
+    // Enough iterations to make the timer resolution irrelevant
+    uint32_t iterations = max(1000000u / boxes.size(), 10u);
+    std::vector<uint64_t> expected((boxes.size() + 63) / 64, 0);
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (uint32_t iteration = 0; iteration < iterations; ++iteration)
+    {
+        // The same loop the renderer ran before cull_batch, an aabb per box
+        for (uint32_t i = 0; i < boxes.size(); ++i)
+        {
+            geometry::aabb b;
+            b.center = glm::vec3(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]);
+            b.extents = glm::vec3(boxes.extents_x[i], boxes.extents_y[i], boxes.extents_z[i]);
+
+            if (!cull(frustum, b))
+            {
+                expected[i >> 6] |= 1ull << (i & 63);
+            }
+        }
+    }
+
+    double cull_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+
+    std::stringstream ss;
+    ss << "cull benchmark: " << boxes.size() << " boxes, " << iterations << " iterations" << std::endl;
+    ss << "  cull: " << cull_ns / ((double)iterations * boxes.size()) << " ns/box" << std::endl;
+
+    static const char* path_names[] = { "scalar", "sse", "avx" };
+    int path_count = get_best_cull_path() == CullPath::AVX ? 3 : 2;
+    std::vector<uint64_t> visible;
+
+    for (int path = 0; path < path_count; ++path)
+    {
+        start = std::chrono::high_resolution_clock::now();
+
+        for (uint32_t iteration = 0; iteration < iterations; ++iteration)
+        {
+            cull_batch(frustum, boxes, visible, (CullPath)path);
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+        ss << "  cull_batch " << path_names[path] << ": " << ns / ((double)iterations * boxes.size()) << " ns/box, " << cull_ns / ns << "x, ";
+        ss << (visible == expected ? "results match" : "RESULTS DIFFER") << std::endl;
+    }
+
+    OutputDebugStringA(ss.str().c_str());
+}
 }
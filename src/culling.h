@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <vector>
 
 #include <glm/mat4x4.hpp>
@@ -42,4 +43,45 @@ inline int testAabbPlane(const aabb& b, const plane& p)
 namespace culling
 {
 bool cull(const geometry::frustum& frustum, const geometry::aabb& b); // return true if the aabb is culled
-}
+
+// AABBs stored as structure of arrays for cull_batch. Arrays are padded to a multiple of batch_width boxes so the SIMD paths never
+// read past the end, indices are stable until the box is removed.
+class AabbBatch
+{
+public:
+    static const uint32_t batch_width = 8;
+
+    uint32_t add(const geometry::aabb& b);
+    void set(uint32_t index, const geometry::aabb& b);
+    // Moves the last box into index and returns the index it was moved from
+    uint32_t remove(uint32_t index);
+    void clear();
+
+    uint32_t size() const { return _count; }
+
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> extents_x;
+    std::vector<float> extents_y;
+    std::vector<float> extents_z;
+
+private:
+    uint32_t _count = 0;
+};
+
+enum class CullPath : uint8_t
+{
+    Scalar,
+    SSE, // 4 boxes per instruction
+    AVX, // 8 boxes per instruction
+    Best // widest path the CPU supports
+};
+
+// Bit i % 64 of visible[i / 64] is set if box i is not culled, the same result as !cull for each box
+void cull_batch(const geometry::frustum& frustum, const AabbBatch& boxes, std::vector<uint64_t>& visible, CullPath path = CullPath::Best);
+CullPath get_best_cull_path();
+
+// Times cull against each cull_batch path over boxes and logs the results and whether they match
+void benchmark_cull_batch(const geometry::frustum& frustum, const AabbBatch& boxes);
+} // namespace culling
@@ -42,3 +42,11 @@ void DepthBuffer::invalidate()
 
     _image.destroy();
 }
+
+void DepthBuffer::retire(VulkanImage& image, VkImageView& image_view)
+{
+    image = _image;
+    image_view = _image_view;
+    _image = VulkanImage();
+    _image_view = VK_NULL_HANDLE;
+}
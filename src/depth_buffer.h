@@ -14,6 +14,8 @@ public:
     void destroy();
 
     void invalidate();
+    // Hands the image and view over to be destroyed later, frames in flight may still be using them
+    void retire(VulkanImage& image, VkImageView& image_view);
 
     VkImageView get_image_view() const { return _image_view; }
 
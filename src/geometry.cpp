@@ -1,7 +1,16 @@
 #include "geometry.h"
 
+#include <Windows.h>
+
+#include <glm/common.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <float.h>
 #include <noise.h>
+#include <sstream>
 
+#include "job_system.h"
 #include "renderer.h"
 
 static int block_texture_layers[][6] = {
@@ -23,75 +32,70 @@ static int block_texture_layers[][6] = {
     { 29, 29, 29, 29, 29, 29 }, // Stone
 };
 
-static void add_polygon(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, Mesh& mesh)
+static void add_polygon(const std::vector<ChunkVertex>& vertices, const std::vector<uint32_t>& indices, SectionGeometry& out)
 {
-    uint32_t base_index = (uint32_t)mesh.vertices.size();
+    uint32_t base_index = (uint32_t)out.vertices.size();
 
     for (uint32_t i : indices)
     {
-        mesh.indices.push_back(base_index + i);
+        out.indices.push_back(base_index + i);
     }
 
-    for (const Vertex& v : vertices)
+    for (const ChunkVertex& v : vertices)
     {
-        mesh.vertices.push_back(v);
+        out.vertices.push_back(v);
     }
 }
 
 // Unit cube vertices, counter-clockwise winding
-static glm::vec3 unit_cube_face_verts[6][4] = {
+static int unit_cube_face_verts[6][4][3] = {
     // Top face (Y = 1)
-    { { 0.0f, 1.0f, 0.0f }, { 0.0f, 1.0f, 1.0f }, { 1.0f, 1.0f, 1.0f }, { 1.0f, 1.0f, 0.0f } },
+    { { 0, 1, 0 }, { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 } },
 
     // Bottom face (Y = 0)
-    { { 1.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f } },
+    { { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 }, { 0, 0, 0 } },
 
     // North face (Z = 0)
-    { { 1.0f, 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f } },
+    { { 1, 1, 0 }, { 1, 0, 0 }, { 0, 0, 0 }, { 0, 1, 0 } },
 
     // South face (Z = 1)
-    { { 0.0f, 1.0f, 1.0f }, { 0.0f, 0.0f, 1.0f }, { 1.0f, 0.0f, 1.0f }, { 1.0f, 1.0f, 1.0f } },
+    { { 0, 1, 1 }, { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 } },
 
     // East face (X = 1)
-    { { 1.0f, 1.0f, 1.0f }, { 1.0f, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 0.0f } },
+    { { 1, 1, 1 }, { 1, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 } },
 
     // West face (X = 0)
-    { { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 1.0f, 1.0f } }
+    { { 0, 1, 0 }, { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 } }
 };
 
-// Unit cube face normals
-static glm::vec3 unit_cube_face_normals[6] = {
-    // Top face (Y = 1)
-    { 0.0f, 1.0f, 0.0f },
-
-    // Bottom face (Y = 0)
-    { 0.0f, -1.0f, 0.0f },
-
-    // North face (Z = 0)
-    { 0.0f, 0.0f, -1.0f },
-
-    // South face (Z = 1)
-    { 0.0f, 0.0f, 1.0f },
-
-    // East face (X = 1)
-    { 1.0f, 0.0f, 0.0f },
+static inline ChunkVertex pack_vertex(int bx, int by, int bz, const int (&size)[3], BlockFace face, int corner, int texture_layer)
+{
+    const int(&c)[3] = unit_cube_face_verts[(int)face][corner];
 
-    // West face (X = 0)
-    { 0.0f, 1.0f, 0.0f },
-};
+    ChunkVertex v;
+    v.x = (uint16_t)(bx + c[0] * size[0]);
+    v.y = (uint16_t)(by + c[1] * size[1]);
+    v.z = (uint16_t)(bz + c[2] * size[2]);
+    v.attributes = (uint16_t)((int)face | (corner << 3) | (texture_layer << 5));
+    return v;
+}
 
-static void add_face(int cx, int cz, int bx, int by, int bz, BlockType type, BlockFace face, Mesh& mesh)
+// Emits a quad covering size[0] x size[1] x size[2] blocks from block (bx, by, bz). The quad is flat along the face normal so the size
+// on that axis must be 1. The vertex shader derives texture coordinates from the chunk-local position so the texture repeats once per
+// block across merged quads.
+static void add_quad(int bx, int by, int bz, const int (&size)[3], int texture_layer, BlockFace face, SectionGeometry& out)
 {
-    double dox, doz;
-    chunk_to_world(cx, cz, bx, bz, dox, doz);
-    glm::vec3 origin((float)dox, (float)by, (float)doz);
-    float texture_layer = (float)block_texture_layers[(int)type][(int)face];
+    add_polygon({ pack_vertex(bx, by, bz, size, face, 0, texture_layer),
+                  pack_vertex(bx, by, bz, size, face, 1, texture_layer),
+                  pack_vertex(bx, by, bz, size, face, 2, texture_layer),
+                  pack_vertex(bx, by, bz, size, face, 3, texture_layer) },
+                { 0, 1, 2, 0, 2, 3 }, out);
+}
 
-    add_polygon({ { origin + unit_cube_face_verts[(int)face][0], unit_cube_face_normals[(int)face], { 0.0f, 0.0f, texture_layer } },
-                  { origin + unit_cube_face_verts[(int)face][1], unit_cube_face_normals[(int)face], { 0.0f, 1.0f, texture_layer } },
-                  { origin + unit_cube_face_verts[(int)face][2], unit_cube_face_normals[(int)face], { 1.0f, 1.0f, texture_layer } },
-                  { origin + unit_cube_face_verts[(int)face][3], unit_cube_face_normals[(int)face], { 1.0f, 0.0f, texture_layer } } },
-                { 0, 1, 2, 0, 2, 3 }, mesh);
+static void add_face(int bx, int by, int bz, BlockType type, BlockFace face, SectionGeometry& out)
+{
+    static const int unit_size[3] = { 1, 1, 1 };
+    add_quad(bx, by, bz, unit_size, block_texture_layers[(int)type][(int)face], face, out);
 }
 
 static inline bool is_transparent(BlockType block_type)
@@ -99,161 +103,1704 @@ static inline bool is_transparent(BlockType block_type)
     return block_type == BlockType::Air;
 }
 
-void Chunk::create_mesh()
+void Chunk::create_mesh_naive(int section, SectionGeometry& out)
 {
-    mesh.vertices.resize(0);
-    mesh.indices.resize(0);
+    const int y0 = section * section_height;
+    const int y1 = y0 + section_height;
+    const bool uniform = (get_section_state(section) == SectionState::Uniform);
 
-    for (int by = 0; by < max_height; by++)
+    for (int by = y0; by < y1; by++)
     {
         for (int bz = 0; bz < chunk_size; bz++)
         {
-            for (int bx = 0; bx < chunk_size; bx++)
+            // Inside a uniform section only the blocks on its shell can have a transparent neighbour
+            bool shell = !uniform || by == y0 || by == y1 - 1 || bz == 0 || bz == chunk_size - 1;
+
+            for (int bx = 0; bx < chunk_size; bx += shell ? 1 : chunk_size - 1)
             {
                 BlockType block_type = block(bx, by, bz);
                 if (block_type != BlockType::Air)
                 {
-                    if (is_transparent(block(bx, by + 1, bz)))
+                    if (is_transparent(block_or_neighbour(bx, by + 1, bz)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::Top, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::Top, out);
                     }
-                    if (is_transparent(block(bx, by - 1, bz)))
+                    if (is_transparent(block_or_neighbour(bx, by - 1, bz)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::Bottom, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::Bottom, out);
                     }
-                    if (is_transparent(block(bx, by, bz - 1)))
+                    if (is_transparent(block_or_neighbour(bx, by, bz - 1)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::North, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::North, out);
                     }
-                    if (is_transparent(block(bx, by, bz + 1)))
+                    if (is_transparent(block_or_neighbour(bx, by, bz + 1)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::South, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::South, out);
                     }
-                    if (is_transparent(block(bx + 1, by, bz)))
+                    if (is_transparent(block_or_neighbour(bx + 1, by, bz)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::East, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::East, out);
                     }
-                    if (is_transparent(block(bx - 1, by, bz)))
+                    if (is_transparent(block_or_neighbour(bx - 1, by, bz)))
                     {
-                        add_face(origin_x, origin_z, bx, by, bz, block_type, BlockFace::West, mesh);
+                        add_face(bx, by, bz, block_type, BlockFace::West, out);
                     }
                 }
             }
         }
     }
-
-    double dox, doz;
-    chunk_to_world(origin_x, origin_z, 0, 0, dox, doz);
-    glm::vec3 a = glm::vec3((float)dox, 0.0f, (float)doz);
-    glm::vec3 b = a + glm::vec3((float)chunk_size, (float)max_height, (float)chunk_size);
-    mesh.aabb.set_from_corners(a, b);
 }
 
-void Chunk::clear()
+// Reorders the section's quads into BlockFace order so the renderer can skip whole directions. The greedy mesher already emits
+// them in order, the naive mesher interleaves them.
+void Chunk::sort_section_faces(MeshSection& section, SectionGeometry& geometry)
 {
-    memset(blocks, 0, sizeof(blocks));
+    // Both meshers emit four vertices and six indices per quad, the face is in the low bits of the attributes
+    uint32_t quad_count = (uint32_t)geometry.vertices.size() / 4;
+    uint32_t quad_counts[6] = {};
+    bool sorted = true;
+    int last_face = 0;
+
+    for (uint32_t q = 0; q < quad_count; ++q)
+    {
+        int face = geometry.vertices[q * 4].attributes & 7;
+        sorted = sorted && face >= last_face;
+        last_face = face;
+        quad_counts[face]++;
+    }
+
+    for (int face = 0; face < 6; ++face)
+    {
+        section.face_index_counts[face] = quad_counts[face] * 6;
+    }
+
+    if (sorted)
+    {
+        return;
+    }
+
+    uint32_t next_quad[6];
+
+    for (int face = 0, quad = 0; face < 6; ++face)
+    {
+        next_quad[face] = quad;
+        quad += quad_counts[face];
+    }
+
+    std::vector<ChunkVertex> vertices(geometry.vertices);
+    std::vector<uint32_t> indices(geometry.indices);
+
+    for (uint32_t q = 0; q < quad_count; ++q)
+    {
+        uint32_t to = next_quad[vertices[q * 4].attributes & 7]++;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            geometry.vertices[to * 4 + i] = vertices[q * 4 + i];
+        }
+
+        for (int i = 0; i < 6; ++i)
+        {
+            geometry.indices[to * 6 + i] = indices[q * 6 + i] - q * 4 + to * 4;
+        }
+    }
 }
 
-float Chunk::get_height(int x, int z)
+uint16_t Chunk::find_connectivity(int section) const
 {
-    if (in_bounds(x, 0, z))
+    const PalettedBlocks& blocks = sections[section];
+
+    if (get_section_state(section) != SectionState::Mixed)
     {
-        for (int y = max_height; y > 0; --y)
+        return (blocks.get_palette_entry(0) == BlockType::Air) ? all_faces_connected : 0;
+    }
+
+    // Flood fill each region of transparent blocks, the faces a region touches can all see each other
+    const uint32_t block_count = chunk_size * chunk_size * section_height;
+    const uint32_t y_step = chunk_size * chunk_size;
+    std::vector<bool> open(block_count);
+    std::vector<uint32_t> stack;
+    uint16_t connectivity = 0;
+
+    for (uint32_t i = 0; i < block_count; ++i)
+    {
+        open[i] = is_transparent(blocks.get(i));
+    }
+
+    for (uint32_t seed = 0; seed < block_count && connectivity != all_faces_connected; ++seed)
+    {
+        if (!open[seed])
+        {
+            continue;
+        }
+
+        uint32_t faces = 0;
+        open[seed] = false;
+        stack.push_back(seed);
+
+        while (!stack.empty())
+        {
+            uint32_t i = stack.back();
+            stack.pop_back();
+
+            uint32_t x = i % chunk_size;
+            uint32_t z = (i / chunk_size) % chunk_size;
+            uint32_t y = i / y_step;
+
+            faces |= (x == 0) ? 1 << (int)BlockFace::West : (x == chunk_size - 1) ? 1 << (int)BlockFace::East : 0;
+            faces |= (z == 0) ? 1 << (int)BlockFace::North : (z == chunk_size - 1) ? 1 << (int)BlockFace::South : 0;
+            faces |= (y == 0) ? 1 << (int)BlockFace::Bottom : (y == section_height - 1) ? 1 << (int)BlockFace::Top : 0;
+
+            uint32_t next[6] = { i - 1, i + 1, i - chunk_size, i + chunk_size, i - y_step, i + y_step };
+            bool valid[6] = { x > 0, x < chunk_size - 1, z > 0, z < chunk_size - 1, y > 0, y < section_height - 1 };
+
+            for (int n = 0; n < 6; ++n)
+            {
+                if (valid[n] && open[next[n]])
+                {
+                    open[next[n]] = false;
+                    stack.push_back(next[n]);
+                }
+            }
+        }
+
+        for (int a = 0; a < 6; ++a)
         {
-            if (block(x, y - 1, z) != BlockType::Air)
+            for (int b = a + 1; b < 6; ++b)
             {
-                return (float)y;
+                if ((faces & (1 << a)) && (faces & (1 << b)))
+                {
+                    connectivity |= face_pair_bit((BlockFace)a, (BlockFace)b);
+                }
             }
         }
     }
 
-    return 0.0f;
-}
-
-WorldGen::WorldGen(Renderer& renderer)
-    : _renderer(renderer)
-{
-    _perlin.SetFrequency(0.005);
-    _perlin.SetOctaveCount(3);
+    return connectivity;
 }
 
-float WorldGen::get_height(double x, double z)
+void Chunk::find_occluders(const glm::vec3& origin)
 {
-    int cx, cz, bx, bz;
-    world_to_chunk(x, z, cx, cz, bx, bz);
-    return get_chunk(cx, cz).get_height(bx, bz);
-}
+    // One box per 16x16 column of blocks, from the bottom of the chunk up to the lowest block of air in the column
+    static const int occluder_size = 16;
+    mesh.occluders.clear();
 
-Chunk& WorldGen::get_chunk(int chunk_x, int chunk_z)
-{
-    IntCoord pos = { chunk_x, chunk_z };
-    ChunkMap::iterator it = _chunks.find(pos);
+    // Sections without air in their palette are solid throughout and needn't be scanned
+    int solid_height = 0;
 
-    if (it == _chunks.end())
+    while (solid_height < max_height)
     {
-        generate_chunk(pos.x, pos.z);
+        const PalettedBlocks& blocks = sections[solid_height / section_height];
+        bool solid = true;
+
+        for (uint32_t i = 0; i < blocks.get_palette_size(); ++i)
+        {
+            solid = solid && !is_transparent(blocks.get_palette_entry(i));
+        }
+
+        if (!solid)
+        {
+            break;
+        }
+
+        solid_height += section_height;
     }
 
-    return _chunks[pos];
+    for (int z0 = 0; z0 < chunk_size; z0 += occluder_size)
+    {
+        for (int x0 = 0; x0 < chunk_size; x0 += occluder_size)
+        {
+            int height = max_height;
+
+            for (int z = z0; z < z0 + occluder_size && height > 0; ++z)
+            {
+                for (int x = x0; x < x0 + occluder_size && height > 0; ++x)
+                {
+                    int y = solid_height;
+
+                    while (y < height && !is_transparent(block(x, y, z)))
+                    {
+                        y++;
+                    }
+
+                    height = y;
+                }
+            }
+
+            if (height > 0)
+            {
+                geometry::aabb occluder;
+                occluder.set_from_corners(origin + glm::vec3((float)x0, 0.0f, (float)z0),
+                                          origin + glm::vec3((float)(x0 + occluder_size), (float)height, (float)(z0 + occluder_size)));
+                mesh.occluders.push_back(occluder);
+            }
+        }
+    }
 }
 
-void WorldGen::generate_chunk(int chunk_x, int chunk_z)
+// Normal axis, followed by the two axes spanning the face plane, for each face
+static int face_axes[6][3] = {
+    { 1, 0, 2 }, // Top
+    { 1, 0, 2 }, // Bottom
+    { 2, 0, 1 }, // North
+    { 2, 0, 1 }, // South
+    { 0, 2, 1 }, // East
+    { 0, 2, 1 }, // West
+};
+
+// Direction along the normal axis to the neighbouring block a face looks into
+static int face_normal_step[6] = { 1, -1, -1, 1, 1, -1 };
+
+// Greedy meshes one section of cells, each scale blocks on a side. Cells provides cell(x, y, z) and cell_or_neighbour(x, y, z) in
+// chunk space cell coordinates, the latter looking across the chunk's x/z borders. If uniform is set every cell in the section
+// is solid and of one type. slices, if given, limits each face to the section-local slices [begin, end) along its normal.
+template <typename Cells>
+static void mesh_greedy(const Cells& cells, int section, int scale, bool uniform, SectionGeometry& out, const int (*slices)[2] = nullptr)
 {
-    IntCoord pos = { chunk_x, chunk_z };
-    Chunk& chunk = _chunks[pos];
-    chunk.clear();
-    chunk.origin_x = chunk_x;
-    chunk.origin_z = chunk_z;
+    // Works in section-local coordinates, y0 converts back to chunk space
+    const int y0 = section * Chunk::section_height / scale;
+    const int dims[3] = { Chunk::chunk_size / scale, Chunk::section_height / scale, Chunk::chunk_size / scale };
 
-    for (int bz = 0; bz < Chunk::chunk_size; bz++)
+    // Texture layer + 1 of the exposed face at each position in the current slice, 0 if there is no face
+    std::vector<int16_t> mask;
+
+    for (int f = 0; f < 6; ++f)
     {
-        for (int bx = 0; bx < Chunk::chunk_size; bx++)
+        const int n = face_axes[f][0];
+        const int u = face_axes[f][1];
+        const int v = face_axes[f][2];
+        const int du = dims[u];
+        const int dv = dims[v];
+
+        mask.resize(du * dv);
+
+        int d_begin = 0;
+        int d_end = dims[n];
+
+        if (uniform)
         {
-            double x, z;
-            chunk_to_world(chunk_x, chunk_z, bx, bz, x, z);
-            float noise = (float)_perlin.GetValue(x, 1.0, z);
-            int height = 64 + (int)(noise * 31.0f);
+            // Only the outermost slice facing along the normal can be exposed
+            d_begin = (face_normal_step[f] > 0) ? dims[n] - 1 : 0;
+            d_end = d_begin + 1;
+        }
 
-            for (int by = 0; by < height; ++by)
+        if (slices)
+        {
+            d_begin = max(d_begin, slices[f][0]);
+            d_end = min(d_end, slices[f][1]);
+        }
+
+        for (int d = d_begin; d < d_end; ++d)
+        {
+            uint32_t slice_faces = 0;
+            int p[3];
+            p[n] = d;
+
+            for (int j = 0; j < dv; ++j)
             {
-                BlockType block_type;
+                p[v] = j;
 
-                if (by == 0)
-                {
-                    block_type = BlockType::Bedrock;
-                }
-                else if (by == height - 1)
+                for (int i = 0; i < du; ++i)
                 {
-                    block_type = BlockType::Grass;
+                    p[u] = i;
+
+                    int16_t& m = mask[i + j * du];
+                    m = 0;
+
+                    BlockType block_type = cells.cell(p[0], p[1] + y0, p[2]);
+
+                    if (block_type == BlockType::Air)
+                    {
+                        continue;
+                    }
+
+                    int q[3] = { p[0], p[1] + y0, p[2] };
+                    q[n] += face_normal_step[f];
+
+                    if (is_transparent(cells.cell_or_neighbour(q[0], q[1], q[2])))
+                    {
+                        m = (int16_t)(block_texture_layers[(int)block_type][f] + 1);
+                        slice_faces++;
+                    }
                 }
-                else if (by > height - 8)
+            }
+
+            if (slice_faces == 0)
+            {
+                continue;
+            }
+
+            for (int j = 0; j < dv; ++j)
+            {
+                for (int i = 0; i < du;)
                 {
-                    block_type = BlockType::Dirt;
+                    int16_t m = mask[i + j * du];
+
+                    if (m == 0)
+                    {
+                        ++i;
+                        continue;
+                    }
+
+                    int w = 1;
+
+                    while (i + w < du && mask[i + w + j * du] == m)
+                    {
+                        ++w;
+                    }
+
+                    int h = 1;
+
+                    for (; j + h < dv; ++h)
+                    {
+                        int k = 0;
+
+                        while (k < w && mask[i + k + (j + h) * du] == m)
+                        {
+                            ++k;
+                        }
+
+                        if (k < w)
+                        {
+                            break;
+                        }
+                    }
+
+                    for (int y = 0; y < h; ++y)
+                    {
+                        for (int x = 0; x < w; ++x)
+                        {
+                            mask[i + x + (j + y) * du] = 0;
+                        }
+                    }
+
+                    int b[3];
+                    b[n] = d;
+                    b[u] = i;
+                    b[v] = j;
+
+                    int size[3];
+                    size[n] = scale;
+                    size[u] = w * scale;
+                    size[v] = h * scale;
+
+                    add_quad(b[0] * scale, (b[1] + y0) * scale, b[2] * scale, size, m - 1, (BlockFace)f, out);
+
+                    i += w;
                 }
-                else
+            }
+        }
+    }
+}
+
+// Appends quad q of from to to
+static void copy_quad(const SectionGeometry& from, uint32_t q, SectionGeometry& to)
+{
+    uint32_t base = (uint32_t)to.vertices.size();
+    to.vertices.insert(to.vertices.end(), from.vertices.begin() + q * 4, from.vertices.begin() + q * 4 + 4);
+
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+        to.indices.push_back(from.indices[q * 6 + i] - q * 4 + base);
+    }
+}
+
+// Full resolution blocks for mesh_greedy
+struct ChunkCells
+{
+    const Chunk& chunk;
+
+    BlockType cell(int x, int y, int z) const { return chunk.block(x, y, z); }
+    BlockType cell_or_neighbour(int x, int y, int z) const { return chunk.block_or_neighbour(x, y, z); }
+};
+
+// A chunk's blocks downsampled for mesh_greedy, each level halves the resolution of the one below. A cell is solid if at least
+// half of the 2x2x2 cells below it are, and takes the type of the highest of those so grass stays on top. Nothing outside the
+// chunk is visible, so every border is closed off with a skirt of side faces. The skirts cover the cracks where a neighbour is
+// meshed at another level; the finer chunk is the one nearer the camera, so the faces it omits along the border face away.
+class LodCells
+{
+public:
+    void create(const Chunk& chunk, int lod)
+    {
+        downsample(ChunkCells{ chunk }, &chunk);
+
+        while (--lod > 0)
+        {
+            LodCells source = *this;
+            downsample(source, nullptr);
+        }
+    }
+
+    BlockType cell(int x, int y, int z) const
+    {
+        if (x >= 0 && x < _size && z >= 0 && z < _size && y >= 0 && y < _height)
+        {
+            return _cells[x + (z + y * _size) * _size];
+        }
+
+        return BlockType::Air;
+    }
+
+    BlockType cell_or_neighbour(int x, int y, int z) const { return cell(x, y, z); }
+
+private:
+    // chunk is only passed when downsampling its blocks, to skip empty sections
+    template <typename Source>
+    void downsample(const Source& source, const Chunk* chunk)
+    {
+        _scale *= 2;
+        _size = Chunk::chunk_size / _scale;
+        _height = Chunk::max_height / _scale;
+        _cells.assign(_size * _size * _height, BlockType::Air);
+
+        for (int y = 0; y < _height; ++y)
+        {
+            if (chunk && chunk->get_section_state(y * _scale / Chunk::section_height) == SectionState::Empty)
+            {
+                continue;
+            }
+
+            for (int z = 0; z < _size; ++z)
+            {
+                for (int x = 0; x < _size; ++x)
                 {
-                    block_type = BlockType::Stone;
-                }
+                    int solid = 0;
+                    BlockType top = BlockType::Air;
+
+                    for (int i = 0; i < 8; ++i)
+                    {
+                        BlockType b = source.cell(x * 2 + (i & 1), y * 2 + (i >> 2), z * 2 + ((i >> 1) & 1));
 
-                chunk.set_block(bx, by, bz, block_type);
+                        if (b != BlockType::Air)
+                        {
+                            solid++;
+                            top = b;
+                        }
+                    }
+
+                    _cells[x + (z + y * _size) * _size] = (solid >= 4) ? top : BlockType::Air;
+                }
             }
         }
     }
 
-    chunk.create_mesh();
-    _renderer.add_mesh(chunk.mesh);
+    std::vector<BlockType> _cells;
+    int _scale = 1;
+    int _size = Chunk::chunk_size;
+    int _height = Chunk::max_height;
+};
+
+void Chunk::create_mesh_greedy(int section, SectionGeometry& out, const int (*slices)[2])
+{
+    mesh_greedy(ChunkCells{ *this }, section, 1, get_section_state(section) == SectionState::Uniform, out, slices);
 }
 
-void WorldGen::generate_around(double x, double z, int radius)
+void Chunk::create_mesh(MeshMode mode, int lod)
 {
-    int cx, cz;
-    world_to_chunk(x, z, cx, cz);
+    mesh.sections.resize(0);
+    mesh.geometry.resize(0);
+    mesh.connectivity.assign(section_count, all_faces_connected);
+    mesh.face_count = 0;
+    mesh.lod = lod;
+
+    double dox, doz;
+    chunk_to_world(origin_x, origin_z, 0, 0, dox, doz);
+    glm::vec3 origin = glm::vec3((float)dox, 0.0f, (float)doz);
+    LodCells lod_cells;
+
+    if (lod > 0)
+    {
+        lod_cells.create(*this, lod);
+    }
 
-    for (int z = -radius; z <= radius; ++z)
+    for (int section = 0; section < section_count; ++section)
     {
-        for (int x = -radius; x <= radius; ++x)
+        if (get_section_state(section) == SectionState::Empty)
+        {
+            continue;
+        }
+
+        mesh.connectivity[section] = find_connectivity(section);
+        SectionGeometry geometry;
+
+        if (lod > 0)
+        {
+            // Distant chunks are always merged, the naive mode is only there for comparing against full resolution meshes
+            mesh_greedy(lod_cells, section, 1 << lod, get_section_state(section) == SectionState::Uniform, geometry);
+        }
+        else if (mode == MeshMode::Greedy)
         {
-            get_chunk(cx + x, cz + z);
+            create_mesh_greedy(section, geometry);
         }
+        else
+        {
+            create_mesh_naive(section, geometry);
+        }
+
+        set_section(section, origin, geometry);
+    }
+
+    set_mesh_totals(origin);
+    mesh.origin = glm::vec4(origin, 0.0f);
+
+    // Downsampled cells can lie below the blocks, so only full resolution meshes have occluders
+    if (lod == 0)
+    {
+        find_occluders(origin);
+    }
+    else
+    {
+        mesh.occluders.clear();
+    }
+}
+
+uint16_t Chunk::remesh_dirty_sections(MeshMode mode)
+{
+    uint16_t remeshed = dirty_sections;
+    dirty_sections = 0;
+
+    if (!remeshed)
+    {
+        return 0;
     }
+
+    glm::vec3 origin = glm::vec3(mesh.origin);
+
+    for (int section = 0; section < section_count; ++section)
+    {
+        if (!(remeshed & (1 << section)))
+        {
+            continue;
+        }
+
+        const int y0 = section * section_height;
+        const DirtyBounds& bounds = _dirty_bounds[section];
+        SectionState section_state = get_section_state(section);
+
+        // Flood filling a section costs more than meshing a few slices of it, so only edits that leave it empty or solid get
+        // exact connectivity. Sections dirtied by an edit next door keep their blocks and connectivity.
+        if (bounds.max[1] >= y0 && bounds.min[1] < y0 + section_height && bounds.max[0] >= 0 && bounds.min[0] < chunk_size &&
+            bounds.max[2] >= 0 && bounds.min[2] < chunk_size)
+        {
+            mesh.connectivity[section] = (section_state == SectionState::Mixed) ? all_faces_connected : find_connectivity(section);
+        }
+
+        SectionGeometry updated;
+
+        if (section_state == SectionState::Empty)
+        {
+            // Drops the old section
+            set_section(section, origin, updated);
+            continue;
+        }
+
+        if (mode == MeshMode::Greedy)
+        {
+            // A face in slice d depends only on the blocks in slices d and d + step, so an edit changes its own slice and the one
+            // behind it. Quads in the others are copied from the old section.
+            const int dims[3] = { chunk_size, section_height, chunk_size };
+            const int offset[3] = { 0, y0, 0 };
+            int slices[6][2];
+
+            for (int f = 0; f < 6; ++f)
+            {
+                const int n = face_axes[f][0];
+                const int step = face_normal_step[f];
+                slices[f][0] = max(bounds.min[n] - offset[n] - max(step, 0), 0);
+                slices[f][1] = max(min(bounds.max[n] - offset[n] + 1 + max(-step, 0), dims[n]), slices[f][0]);
+            }
+
+            SectionGeometry fresh;
+            create_mesh_greedy(section, fresh, slices);
+            const size_t old_index = find_section(section);
+            const bool has_old = old_index < mesh.sections.size() && (int)mesh.sections[old_index].section == section;
+            const SectionGeometry* old = has_old ? &mesh.geometry[old_index] : nullptr;
+            const uint32_t old_quads = has_old ? (uint32_t)old->vertices.size() / 4 : 0;
+            const uint32_t fresh_quads = (uint32_t)fresh.vertices.size() / 4;
+            updated.vertices.reserve((old_quads + fresh_quads) * 4);
+            updated.indices.reserve((old_quads + fresh_quads) * 6);
+
+            // Both lists are sorted by face, so merging them face by face saves sorting the section again
+            for (uint32_t f = 0, old_quad = 0, fresh_quad = 0; f < 6; ++f)
+            {
+                const int n = face_axes[f][0];
+                const int plane_offset = offset[n] + ((face_normal_step[f] > 0) ? 1 : 0);
+
+                for (; old_quad < old_quads && (old->vertices[old_quad * 4].attributes & 7) == f; ++old_quad)
+                {
+                    const ChunkVertex& corner = old->vertices[old_quad * 4];
+                    const int position[3] = { corner.x, corner.y, corner.z };
+                    const int d = position[n] - plane_offset;
+
+                    if (d < slices[f][0] || d >= slices[f][1])
+                    {
+                        copy_quad(*old, old_quad, updated);
+                    }
+                }
+
+                for (; fresh_quad < fresh_quads && (fresh.vertices[fresh_quad * 4].attributes & 7) == f; ++fresh_quad)
+                {
+                    copy_quad(fresh, fresh_quad, updated);
+                }
+            }
+        }
+        else
+        {
+            create_mesh_naive(section, updated);
+        }
+
+        // Only this section's geometry is replaced, the others stay where they are
+        set_section(section, origin, updated);
+    }
+
+    set_mesh_totals(origin);
+
+    return remeshed;
+}
+
+// Index of the mesh's first section at or above section
+size_t Chunk::find_section(int section) const
+{
+    size_t i = 0;
+
+    while (i < mesh.sections.size() && (int)mesh.sections[i].section < section)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+// Fits the section to its quads, counts the block faces they cover, sorts them by face and puts it in the mesh in place of any
+// earlier copy, keeping the sections bottom to top. geometry is moved into the mesh; without faces the section is removed.
+void Chunk::set_section(int section, const glm::vec3& origin, SectionGeometry& geometry)
+{
+    size_t i = find_section(section);
+    bool replace = i < mesh.sections.size() && (int)mesh.sections[i].section == section;
+
+    if (geometry.vertices.empty())
+    {
+        if (replace)
+        {
+            mesh.sections.erase(mesh.sections.begin() + i);
+            mesh.geometry.erase(mesh.geometry.begin() + i);
+        }
+
+        return;
+    }
+
+    glm::vec3 section_min(FLT_MAX);
+    glm::vec3 section_max(-FLT_MAX);
+    uint32_t face_count = 0;
+
+    for (size_t v = 0; v < geometry.vertices.size(); v += 4)
+    {
+        // Each quad is flat along its normal, so its area is the product of its two non-zero extents
+        glm::vec3 quad_min(FLT_MAX);
+        glm::vec3 quad_max(-FLT_MAX);
+
+        for (size_t corner = v; corner < v + 4; ++corner)
+        {
+            glm::vec3 p((float)geometry.vertices[corner].x, (float)geometry.vertices[corner].y, (float)geometry.vertices[corner].z);
+            quad_min = glm::min(quad_min, p);
+            quad_max = glm::max(quad_max, p);
+        }
+
+        section_min = glm::min(section_min, quad_min);
+        section_max = glm::max(section_max, quad_max);
+
+        if (mesh.lod > 0)
+        {
+            continue;
+        }
+
+        glm::vec3 size = quad_max - quad_min;
+        uint32_t area = 1;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            area *= (size[axis] > 0.0f) ? (uint32_t)size[axis] : 1;
+        }
+
+        face_count += area;
+    }
+
+    MeshSection mesh_section;
+    mesh_section.aabb.set_from_corners(origin + section_min, origin + section_max);
+    mesh_section.vertex_count = (uint32_t)geometry.vertices.size();
+    mesh_section.index_count = (uint32_t)geometry.indices.size();
+    mesh_section.face_count = face_count;
+    mesh_section.section = (uint32_t)section;
+    sort_section_faces(mesh_section, geometry);
+
+    if (replace)
+    {
+        mesh.sections[i] = mesh_section;
+        mesh.geometry[i] = std::move(geometry);
+    }
+    else
+    {
+        mesh.sections.insert(mesh.sections.begin() + i, mesh_section);
+        mesh.geometry.insert(mesh.geometry.begin() + i, std::move(geometry));
+    }
+}
+
+// Sets the mesh's bounds and face count from its sections
+void Chunk::set_mesh_totals(const glm::vec3& origin)
+{
+    mesh.face_count = 0;
+
+    if (mesh.sections.empty())
+    {
+        mesh.aabb.set_from_corners(origin, origin);
+        return;
+    }
+
+    glm::vec3 mesh_min(FLT_MAX);
+    glm::vec3 mesh_max(-FLT_MAX);
+
+    for (const MeshSection& section : mesh.sections)
+    {
+        mesh_min = glm::min(mesh_min, section.aabb.center - section.aabb.extents);
+        mesh_max = glm::max(mesh_max, section.aabb.center + section.aabb.extents);
+        mesh.face_count += section.face_count;
+    }
+
+    mesh.aabb.set_from_corners(mesh_min, mesh_max);
+}
+
+void Chunk::set_block(int x, int y, int z, BlockType block_type)
+{
+    if (!in_bounds(x, y, z))
+    {
+        return;
+    }
+
+    int section = y / section_height;
+    sections[section].set(block_index(x, y, z), block_type);
+    dirty = true;
+
+    // Faces of the blocks above and below look at this one across a section boundary
+    int section_y = y & (section_height - 1);
+    mark_dirty(section, x, y, z);
+
+    if (section_y == 0 && section > 0)
+    {
+        mark_dirty(section - 1, x, y, z);
+    }
+    else if (section_y == section_height - 1 && section < section_count - 1)
+    {
+        mark_dirty(section + 1, x, y, z);
+    }
+
+    // As do the neighbouring chunks' border faces across an x/z border, which see the block just outside them
+    Chunk* neighbour;
+
+    if (z == 0 && (neighbour = neighbours[neighbour_index(BlockFace::North)]) != nullptr)
+    {
+        neighbour->mark_dirty(section, x, y, z + chunk_size);
+    }
+    else if (z == chunk_size - 1 && (neighbour = neighbours[neighbour_index(BlockFace::South)]) != nullptr)
+    {
+        neighbour->mark_dirty(section, x, y, z - chunk_size);
+    }
+
+    if (x == 0 && (neighbour = neighbours[neighbour_index(BlockFace::West)]) != nullptr)
+    {
+        neighbour->mark_dirty(section, x + chunk_size, y, z);
+    }
+    else if (x == chunk_size - 1 && (neighbour = neighbours[neighbour_index(BlockFace::East)]) != nullptr)
+    {
+        neighbour->mark_dirty(section, x - chunk_size, y, z);
+    }
+
+    // Occluders have to stay inside solid blocks, so clip any that the new air cuts into. A new solid block leaves them as they
+    // are until the chunk is next meshed whole.
+    if (is_transparent(block_type))
+    {
+        glm::vec3 p = glm::vec3(mesh.origin) + glm::vec3((float)x + 0.5f, (float)y, (float)z + 0.5f);
+
+        for (geometry::aabb& occluder : mesh.occluders)
+        {
+            glm::vec3 lo = occluder.center - occluder.extents;
+            glm::vec3 hi = occluder.center + occluder.extents;
+
+            if (p.x > lo.x && p.x < hi.x && p.z > lo.z && p.z < hi.z && p.y < hi.y)
+            {
+                occluder.set_from_corners(lo, glm::vec3(hi.x, p.y, hi.z));
+            }
+        }
+    }
+}
+
+void Chunk::mark_dirty(int section, int x, int y, int z)
+{
+    DirtyBounds& bounds = _dirty_bounds[section];
+    const int p[3] = { x, y, z };
+    const bool first = !(dirty_sections & (1 << section));
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        bounds.min[axis] = (int16_t)(first ? p[axis] : min((int)bounds.min[axis], p[axis]));
+        bounds.max[axis] = (int16_t)(first ? p[axis] : max((int)bounds.max[axis], p[axis]));
+    }
+
+    dirty_sections |= 1 << section;
+}
+
+void Chunk::clear()
+{
+    for (PalettedBlocks& section : sections)
+    {
+        section.reset(chunk_size * chunk_size * section_height);
+    }
+}
+
+void Chunk::compact()
+{
+    for (PalettedBlocks& section : sections)
+    {
+        section.compact();
+    }
+}
+
+size_t Chunk::get_memory_usage() const
+{
+    size_t usage = sizeof(Chunk) - sizeof(sections);
+
+    for (const PalettedBlocks& section : sections)
+    {
+        usage += section.get_memory_usage();
+    }
+
+    return usage;
+}
+
+static const uint8_t chunk_payload_version = 1;
+
+void Chunk::serialise(std::vector<uint8_t>& payload) const
+{
+    payload.clear();
+    payload.push_back(chunk_payload_version);
+
+    for (const PalettedBlocks& section : sections)
+    {
+        section.write(payload);
+    }
+}
+
+bool Chunk::deserialise(const std::vector<uint8_t>& payload)
+{
+    const uint8_t* data = payload.data();
+    const uint8_t* end = data + payload.size();
+
+    if (payload.empty() || *data++ != chunk_payload_version)
+    {
+        return false;
+    }
+
+    for (PalettedBlocks& section : sections)
+    {
+        if (!section.read(chunk_size * chunk_size * section_height, data, end))
+        {
+            return false;
+        }
+    }
+
+    return data == end;
+}
+
+float Chunk::get_height(int x, int z) const
+{
+    if (in_bounds(x, 0, z))
+    {
+        for (int section = section_count - 1; section >= 0; --section)
+        {
+            SectionState state = get_section_state(section);
+
+            if (state == SectionState::Empty)
+            {
+                continue;
+            }
+
+            int y0 = section * section_height;
+
+            if (state == SectionState::Uniform)
+            {
+                return (float)(y0 + section_height);
+            }
+
+            for (int y = y0 + section_height; y > y0; --y)
+            {
+                if (block(x, y - 1, z) != BlockType::Air)
+                {
+                    return (float)y;
+                }
+            }
+        }
+    }
+
+    return 0.0f;
+}
+
+static double elapsed_ms(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+WorldGen::WorldGen(Renderer& renderer, JobSystem& jobs)
+    : _renderer(renderer)
+    , _jobs(jobs)
+{
+    _perlin.SetFrequency(0.005);
+    _perlin.SetOctaveCount(3);
+}
+
+void WorldGen::shutdown()
+{
+    drain();
+
+    std::vector<Chunk*> chunks;
+    _chunks.for_each([&chunks](Chunk* chunk) { chunks.push_back(chunk); });
+
+    for (Chunk* chunk : chunks)
+    {
+        evict(chunk);
+    }
+
+    drain();
+}
+
+WorldGen::~WorldGen()
+{
+    _jobs.wait_idle();
+
+    std::vector<Chunk*> chunks;
+    _chunks.for_each([&chunks](Chunk* chunk) { chunks.push_back(chunk); });
+
+    for (Chunk* chunk : chunks)
+    {
+        _chunks.remove(chunk->origin_x, chunk->origin_z);
+        delete chunk;
+    }
+}
+
+float WorldGen::get_height(double x, double z)
+{
+    int cx, cz, bx, bz;
+    world_to_chunk(x, z, cx, cz, bx, bz);
+    Chunk* chunk = get_chunk(cx, cz);
+    return chunk ? chunk->get_height(bx, bz) : 0.0f;
+}
+
+Chunk* WorldGen::get_chunk(int chunk_x, int chunk_z)
+{
+    Chunk* chunk = _chunks.find(chunk_x, chunk_z);
+
+    if (!chunk)
+    {
+        if (_saving.count(world::ChunkMap::key(chunk_x, chunk_z)))
+        {
+            // Evicted moments ago, load it back once the save has landed
+            return nullptr;
+        }
+
+        chunk = new Chunk();
+        chunk->origin_x = chunk_x;
+        chunk->origin_z = chunk_z;
+        _chunks.insert(chunk_x, chunk_z, chunk);
+        link_neighbours(*chunk);
+        queue_load(*chunk);
+        return nullptr;
+    }
+
+    // Blocks are valid from the end of generation on, including while a mesh job is in flight
+    return (chunk->state != ChunkState::Generating) ? chunk : nullptr;
+}
+
+void WorldGen::queue_load(Chunk& chunk)
+{
+    Chunk* target = &chunk;
+    chunk.state = ChunkState::Generating;
+    begin_job();
+
+    _jobs.submit([this, target]() {
+        ChunkJob job = { JobType::Load, target, target->origin_x, target->origin_z, 0.0 };
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        std::vector<uint8_t> payload;
+
+        if (_store.load(target->origin_x, target->origin_z, payload) && target->deserialise(payload))
+        {
+            target->dirty = false;
+        }
+        else
+        {
+            // Never saved, or the stored copy is unreadable
+            job.type = JobType::Generate;
+            generate_chunk(*target);
+            target->dirty = true;
+        }
+
+        job.ms = elapsed_ms(start);
+
+        std::lock_guard<std::mutex> lock(_completed_mutex);
+        _completed.push_back(job);
+    });
+}
+
+void WorldGen::queue_mesh(Chunk& chunk)
+{
+    Chunk* target = &chunk;
+    MeshMode mode = _mesh_mode;
+    int lod = get_lod(chunk);
+    chunk.state = ChunkState::Meshing;
+    chunk.dirty_sections = 0;
+    begin_job();
+
+    _jobs.submit([this, target, mode, lod]() {
+        ChunkJob job = { JobType::Mesh, target, target->origin_x, target->origin_z, 0.0 };
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        target->create_mesh(mode, lod);
+        job.ms = elapsed_ms(start);
+
+        std::lock_guard<std::mutex> lock(_completed_mutex);
+        _completed.push_back(job);
+    });
+}
+
+void WorldGen::queue_save(Chunk* chunk)
+{
+    _saving[world::ChunkMap::key(chunk->origin_x, chunk->origin_z)]++;
+    begin_job();
+
+    // The chunk is already out of the map, so the job owns it
+    _jobs.submit([this, chunk]() {
+        ChunkJob job = { JobType::Save, nullptr, chunk->origin_x, chunk->origin_z, 0.0 };
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        std::vector<uint8_t> payload;
+        chunk->serialise(payload);
+
+        if (!_store.save(chunk->origin_x, chunk->origin_z, payload))
+        {
+            std::stringstream ss;
+            ss << "chunk (" << chunk->origin_x << ", " << chunk->origin_z << "): save failed" << std::endl;
+            OutputDebugStringA(ss.str().c_str());
+        }
+
+        delete chunk;
+        job.ms = elapsed_ms(start);
+
+        std::lock_guard<std::mutex> lock(_completed_mutex);
+        _completed.push_back(job);
+    });
+}
+
+void WorldGen::begin_job()
+{
+    if (_jobs_in_flight++ == 0)
+    {
+        _stats = JobStats();
+        _stats.start = std::chrono::high_resolution_clock::now();
+        _jobs.reset_stats();
+    }
+}
+
+void WorldGen::generate_chunk(Chunk& chunk) const
+{
+    chunk.clear();
+
+    for (int bz = 0; bz < Chunk::chunk_size; bz++)
+    {
+        for (int bx = 0; bx < Chunk::chunk_size; bx++)
+        {
+            double x, z;
+            chunk_to_world(chunk.origin_x, chunk.origin_z, bx, bz, x, z);
+            float noise = (float)_perlin.GetValue(x, 1.0, z);
+            int height = 64 + (int)(noise * 31.0f);
+
+            for (int by = 0; by < height; ++by)
+            {
+                BlockType block_type;
+
+                if (by == 0)
+                {
+                    block_type = BlockType::Bedrock;
+                }
+                else if (by == height - 1)
+                {
+                    block_type = BlockType::Grass;
+                }
+                else if (by > height - 8)
+                {
+                    block_type = BlockType::Dirt;
+                }
+                else
+                {
+                    block_type = BlockType::Stone;
+                }
+
+                chunk.write_block(bx, by, bz, block_type);
+            }
+        }
+    }
+
+    chunk.compact();
+}
+
+void WorldGen::set_zones(int render_radius, int load_radius, int unload_radius)
+{
+    _render_radius = render_radius;
+    _load_radius = max(load_radius, render_radius);
+    _unload_radius = max(unload_radius, _load_radius);
+    _zones_dirty = true;
+}
+
+void WorldGen::set_lod_radius(int lod_radius)
+{
+    _lod_radius = max(lod_radius, 1);
+    _zones_dirty = true;
+}
+
+void WorldGen::update(double x, double z)
+{
+    int cx, cz;
+    world_to_chunk(x, z, cx, cz);
+
+    if (cx != _centre_x || cz != _centre_z)
+    {
+        _centre_x = cx;
+        _centre_z = cz;
+        _zones_dirty = true;
+    }
+
+    drain_completed();
+    remesh_dirty_chunks();
+
+    if (_zones_dirty)
+    {
+        update_zones();
+    }
+}
+
+void WorldGen::drain()
+{
+    // Completing a job never queues another, so this leaves nothing in flight
+    while (_jobs_in_flight > 0)
+    {
+        _jobs.wait_idle();
+        drain_completed();
+    }
+}
+
+void WorldGen::wait()
+{
+    drain();
+    remesh_dirty_chunks();
+    update_zones();
+}
+
+bool WorldGen::set_block(int x, int y, int z, BlockType block_type)
+{
+    int cx, cz, bx, bz;
+    world_to_chunk((double)x, (double)z, cx, cz, bx, bz);
+    Chunk* chunk = _chunks.find(cx, cz);
+
+    if (!chunk || !can_edit(*chunk))
+    {
+        return false;
+    }
+
+    chunk->set_block(bx, y, bz, block_type);
+
+    // The edit may have marked sections of the neighbours too
+    Chunk* marked[5] = { chunk, chunk->neighbours[0], chunk->neighbours[1], chunk->neighbours[2], chunk->neighbours[3] };
+
+    for (Chunk* target : marked)
+    {
+        if (target && target->dirty_sections && std::find(_dirty_chunks.begin(), _dirty_chunks.end(), target) == _dirty_chunks.end())
+        {
+            _dirty_chunks.push_back(target);
+        }
+    }
+
+    return true;
+}
+
+void WorldGen::remesh_dirty_chunks()
+{
+    if (_dirty_chunks.empty())
+    {
+        return;
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    uint32_t chunk_count = 0;
+    uint32_t section_count = 0;
+    size_t kept = 0;
+
+    for (Chunk* chunk : _dirty_chunks)
+    {
+        if (!chunk->dirty_sections)
+        {
+            continue;
+        }
+
+        if (chunk->state != ChunkState::Ready)
+        {
+            // Generated chunks are meshed whole by update_zones anyway, which clears the dirty sections
+            continue;
+        }
+
+        // A neighbour may still be generating, with a worker writing the blocks along the border
+        if (!can_mesh(*chunk))
+        {
+            _dirty_chunks[kept++] = chunk;
+            continue;
+        }
+
+        if (chunk->mesh.lod > 0 || get_lod(*chunk) > 0)
+        {
+            // Downsampled cells span sections, so distant chunks are remeshed whole. can_mesh doesn't check the neighbours of a
+            // chunk due to be downsampled, so it isn't remeshed at full resolution either.
+            queue_mesh(*chunk);
+            continue;
+        }
+
+        uint16_t remeshed = chunk->remesh_dirty_sections(_mesh_mode);
+        chunk_count++;
+
+        for (uint16_t bits = remeshed; bits; bits &= bits - 1)
+        {
+            section_count++;
+        }
+
+        // The renderer swaps in the new sections once they've uploaded, a chunk without a mesh yet gets a whole one
+        if (chunk->mesh_id != 0 && !_renderer.update_mesh(chunk->mesh_id, chunk->mesh, remeshed))
+        {
+            hide_chunk(*chunk);
+        }
+
+        if (in_zone(*chunk, _render_radius))
+        {
+            show_chunk(*chunk);
+        }
+    }
+
+    _dirty_chunks.resize(kept);
+
+    if (chunk_count)
+    {
+        std::stringstream ss;
+        ss << "remesh: " << section_count << " sections in " << chunk_count << " chunks in " << elapsed_ms(start) * 1000.0 << " us" << std::endl;
+        OutputDebugStringA(ss.str().c_str());
+    }
+}
+
+void WorldGen::drain_completed()
+{
+    std::vector<ChunkJob> completed;
+
+    {
+        std::lock_guard<std::mutex> lock(_completed_mutex);
+        completed.swap(_completed);
+    }
+
+    for (const ChunkJob& job : completed)
+    {
+        complete(job);
+    }
+
+    if (!completed.empty())
+    {
+        // Chunks that were busy when the player moved may need evicting now
+        _zones_dirty = true;
+
+        if (_jobs_in_flight == 0)
+        {
+            log_stats();
+        }
+    }
+}
+
+void WorldGen::complete(const ChunkJob& job)
+{
+    _jobs_in_flight--;
+
+    switch (job.type)
+    {
+        case JobType::Save:
+        {
+            world::ChunkMap::Key key = world::ChunkMap::key(job.origin_x, job.origin_z);
+
+            if (--_saving[key] == 0)
+            {
+                _saving.erase(key);
+            }
+
+            _stats.saved++;
+            _stats.save_ms += job.ms;
+            return;
+        }
+
+        case JobType::Generate:
+        case JobType::Load:
+        {
+            // update_zones meshes it once all four neighbours have their blocks too
+            job.chunk->state = ChunkState::Generated;
+
+            if (job.type == JobType::Generate)
+            {
+                _stats.generated++;
+                _stats.generate_ms += job.ms;
+            }
+            else
+            {
+                _stats.loaded++;
+                _stats.load_ms += job.ms;
+            }
+
+            return;
+        }
+
+        case JobType::Mesh:
+            break;
+    }
+
+    Chunk& chunk = *job.chunk;
+    chunk.state = ChunkState::Ready;
+    _stats.meshed++;
+    _stats.mesh_ms += job.ms;
+
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+
+    for (const MeshSection& section : chunk.mesh.sections)
+    {
+        vertex_count += section.vertex_count;
+        index_count += section.index_count;
+    }
+
+    uint32_t naive_vertex_count = chunk.mesh.face_count * 4;
+    uint32_t naive_index_count = chunk.mesh.face_count * 6;
+
+    // Downsampled meshes don't count block faces, so they have nothing to compare against
+    if (naive_vertex_count)
+    {
+        std::stringstream ss;
+        ss << "chunk (" << chunk.origin_x << ", " << chunk.origin_z << "): " << vertex_count << " vertices, " << index_count << " indices";
+        ss << " (naive " << naive_vertex_count << " / " << naive_index_count << ", ";
+        ss << (100 - (uint64_t)vertex_count * 100 / naive_vertex_count) << "% reduction)" << std::endl;
+        OutputDebugStringA(ss.str().c_str());
+    }
+
+    if (!in_zone(chunk, _render_radius))
+    {
+        hide_chunk(chunk);
+    }
+    else if (chunk.mesh_id != 0)
+    {
+        // A remesh, e.g. at a new level of detail; the old mesh is drawn until the new one has been uploaded
+        _renderer.replace_mesh(chunk.mesh_id, chunk.mesh, chunk.mesh_id);
+    }
+    else
+    {
+        show_chunk(chunk);
+    }
+}
+
+static bool within_radius(int dx, int dz, int radius)
+{
+    // The extra radius rounds the circle out a little, matching the zones in docs/ChunkManagement.png
+    return dx * dx + dz * dz <= radius * radius + radius;
+}
+
+bool WorldGen::in_zone(const Chunk& chunk, int radius) const
+{
+    return within_radius(chunk.origin_x - _centre_x, chunk.origin_z - _centre_z, radius);
+}
+
+// Neighbour offsets in BlockFace order (North, South, East, West); i ^ 1 is the opposite direction
+static const int neighbour_offsets[4][2] = { { 0, -1 }, { 0, 1 }, { 1, 0 }, { -1, 0 } };
+
+int WorldGen::get_lod(const Chunk& chunk) const
+{
+    int lod = 0;
+
+    while (lod < Chunk::max_lod && !in_zone(chunk, (lod + 1) * _lod_radius))
+    {
+        lod++;
+    }
+
+    return lod;
+}
+
+bool WorldGen::is_lod_stale(const Chunk& chunk) const
+{
+    // A ring of hysteresis either side of each boundary, so chunks aren't remeshed as the player moves back and forth across one
+    int lod = chunk.mesh.lod;
+    bool too_coarse = lod > 0 && in_zone(chunk, lod * _lod_radius - 1);
+    bool too_fine = lod < Chunk::max_lod && !in_zone(chunk, (lod + 1) * _lod_radius + 1);
+    return too_coarse || too_fine;
+}
+
+bool WorldGen::can_mesh(const Chunk& chunk) const
+{
+    // Downsampled meshes are skirted rather than looking into the neighbours
+    if (get_lod(chunk) > 0)
+    {
+        return true;
+    }
+
+    // The border faces depend on the neighbouring blocks
+    for (const Chunk* neighbour : chunk.neighbours)
+    {
+        if (!neighbour || neighbour->state == ChunkState::Generating)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool WorldGen::can_edit(const Chunk& chunk) const
+{
+    // Like eviction, no job may be reading the blocks. Mesh jobs read their neighbours' border blocks too.
+    return can_evict(chunk);
+}
+
+bool WorldGen::can_evict(const Chunk& chunk) const
+{
+    // Jobs in flight hold a pointer to the chunk, mesh jobs also read their neighbours
+    if (chunk.state == ChunkState::Generating || chunk.state == ChunkState::Meshing)
+    {
+        return false;
+    }
+
+    for (const Chunk* neighbour : chunk.neighbours)
+    {
+        if (neighbour && neighbour->state == ChunkState::Meshing)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void WorldGen::link_neighbours(Chunk& chunk)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        Chunk* neighbour = _chunks.find(chunk.origin_x + neighbour_offsets[i][0], chunk.origin_z + neighbour_offsets[i][1]);
+        chunk.neighbours[i] = neighbour;
+
+        if (neighbour)
+        {
+            neighbour->neighbours[i ^ 1] = &chunk;
+        }
+    }
+}
+
+void WorldGen::unlink_neighbours(Chunk& chunk)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        if (chunk.neighbours[i])
+        {
+            chunk.neighbours[i]->neighbours[i ^ 1] = nullptr;
+            chunk.neighbours[i] = nullptr;
+        }
+    }
+}
+
+void WorldGen::update_zones()
+{
+    _zones_dirty = false;
+    std::vector<Chunk*> evictions;
+
+    _chunks.for_each([this, &evictions](Chunk* chunk) {
+        if (!in_zone(*chunk, _unload_radius))
+        {
+            if (can_evict(*chunk))
+            {
+                evictions.push_back(chunk);
+            }
+        }
+        else if (!in_zone(*chunk, _render_radius))
+        {
+            hide_chunk(*chunk);
+        }
+        else if (chunk->state == ChunkState::Generated)
+        {
+            if (can_mesh(*chunk))
+            {
+                queue_mesh(*chunk);
+            }
+        }
+        else if (chunk->state == ChunkState::Ready)
+        {
+            // The old mesh is drawn until the one at the new level of detail replaces it
+            if (is_lod_stale(*chunk) && can_mesh(*chunk))
+            {
+                queue_mesh(*chunk);
+            }
+            else
+            {
+                show_chunk(*chunk);
+            }
+        }
+    });
+
+    // The map can't be modified from inside for_each
+    for (Chunk* chunk : evictions)
+    {
+        evict(chunk);
+    }
+
+    uint32_t evicted = (uint32_t)evictions.size();
+
+    for (int z = -_load_radius; z <= _load_radius; ++z)
+    {
+        for (int x = -_load_radius; x <= _load_radius; ++x)
+        {
+            if (within_radius(x, z, _load_radius))
+            {
+                get_chunk(_centre_x + x, _centre_z + z);
+            }
+        }
+    }
+
+    if (evicted)
+    {
+        std::stringstream ss;
+        ss << "zones: evicted " << evicted << " chunks, " << _chunks.size() << " resident, " << _renderer.get_mesh_count() << " meshes" << std::endl;
+        OutputDebugStringA(ss.str().c_str());
+    }
+}
+
+void WorldGen::evict(Chunk* chunk)
+{
+    hide_chunk(*chunk);
+    unlink_neighbours(*chunk);
+    _dirty_chunks.erase(std::remove(_dirty_chunks.begin(), _dirty_chunks.end(), chunk), _dirty_chunks.end());
+    _chunks.remove(chunk->origin_x, chunk->origin_z);
+
+    if (chunk->dirty)
+    {
+        queue_save(chunk);
+    }
+    else
+    {
+        delete chunk;
+    }
+}
+
+void WorldGen::show_chunk(Chunk& chunk)
+{
+    if (chunk.mesh_id == 0)
+    {
+        _renderer.add_mesh(chunk.mesh, chunk.mesh_id);
+    }
+}
+
+void WorldGen::hide_chunk(Chunk& chunk)
+{
+    if (chunk.mesh_id != 0)
+    {
+        _renderer.remove_mesh(chunk.mesh_id);
+        chunk.mesh_id = 0;
+    }
+}
+
+// Logs throughput for the batch of jobs that just drained, e.g. compare "-threads 1" against the default to see the scaling
+void WorldGen::log_stats()
+{
+    double wall_ms = elapsed_ms(_stats.start);
+    double busy_ms = _stats.generate_ms + _stats.load_ms + _stats.mesh_ms + _stats.save_ms;
+    uint32_t thread_count = _jobs.get_thread_count();
+
+    std::stringstream ss;
+    ss << "chunk jobs: " << _stats.generated << " generated, " << _stats.loaded << " loaded, " << _stats.meshed << " meshed, " << _stats.saved << " saved in " << wall_ms << " ms on " << thread_count << " threads";
+    ss << " (" << (wall_ms > 0.0 ? _stats.meshed * 1000.0 / wall_ms : 0.0) << " chunks/s, speedup " << (wall_ms > 0.0 ? busy_ms / wall_ms : 0.0) << "x)" << std::endl;
+
+    if (_stats.generated)
+    {
+        ss << "    generate avg " << _stats.generate_ms / _stats.generated << " ms";
+    }
+
+    if (_stats.loaded)
+    {
+        ss << "    load avg " << _stats.load_ms / _stats.loaded << " ms";
+    }
+
+    if (_stats.meshed)
+    {
+        ss << "    mesh avg " << _stats.mesh_ms / _stats.meshed << " ms";
+    }
+
+    if (_stats.saved)
+    {
+        ss << "    save avg " << _stats.save_ms / _stats.saved << " ms";
+    }
+
+    ss << std::endl;
+
+    size_t voxel_bytes = 0;
+    size_t flat_bytes = 0;
+
+    _chunks.for_each([&voxel_bytes, &flat_bytes](const Chunk* chunk) {
+        if (chunk->state != ChunkState::Generating)
+        {
+            voxel_bytes += chunk->get_memory_usage();
+            flat_bytes += Chunk::chunk_size * Chunk::chunk_size * Chunk::max_height * sizeof(BlockType);
+        }
+    });
+
+    if (voxel_bytes)
+    {
+        ss << "    voxels: " << _chunks.size() << " chunks in " << (voxel_bytes >> 10) << " KB (flat arrays " << (flat_bytes >> 10) << " KB, ";
+        ss << (double)flat_bytes / (double)voxel_bytes << "x smaller)" << std::endl;
+    }
+
+    std::vector<JobSystem::WorkerStats> workers;
+    _jobs.get_stats(workers);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        ss << "    worker " << i << ": " << workers[i].jobs << " jobs, " << workers[i].steals << " stolen, " << workers[i].busy_ms << " ms busy";
+        ss << " (" << (wall_ms > 0.0 ? workers[i].busy_ms * 100.0 / wall_ms : 0.0) << "%)" << std::endl;
+    }
+
+    OutputDebugStringA(ss.str().c_str());
+}
+
+void WorldGen::set_mesh_mode(MeshMode mode)
+{
+    if (mode == _mesh_mode)
+    {
+        return;
+    }
+
+    // Let in-flight jobs finish with the old mode so no stale meshes reach the renderer after the clear
+    drain();
+
+    _mesh_mode = mode;
+    _renderer.clear_meshes();
+
+    // update_zones remeshes the render zone with the new mode, the rest are remeshed if they come back into it
+    _chunks.for_each([](Chunk* chunk) {
+        chunk->mesh_id = 0;
+
+        if (chunk->state == ChunkState::Ready)
+        {
+            chunk->state = ChunkState::Generated;
+        }
+    });
+
+    _zones_dirty = true;
 }
@@ -2,24 +2,65 @@
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 #include <noise.h>
-#include <map>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#include "block_storage.h"
+#include "chunk_map.h"
 #include "culling.h"
+#include "region_file.h"
 
-struct Vertex
+// Packed chunk vertex, decoded by triangle.vert. The position is relative to the chunk origin, which is supplied per draw, and runs
+// from 0 to chunk_size (max_height for y) inclusive. The normal and texture coordinates are derived from the face in the shader.
+struct ChunkVertex
 {
-    glm::vec3 position;
-    glm::vec3 normal;
-    glm::vec3 tex_coord;
+    uint16_t x;
+    uint16_t y;
+    uint16_t z;
+    uint16_t attributes; // face (bits 0-2), quad corner (bits 3-4), texture layer (bits 5-15)
 };
 
-struct Mesh
+static_assert(sizeof(ChunkVertex) == 8, "ChunkVertex should pack into 8 bytes");
+
+// Vertex and index ranges of one vertical section within a chunk mesh, drawn, culled and remeshed on its own
+struct MeshSection
+{
+    geometry::aabb aabb; // world space, fitted to the section's vertices
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t face_index_counts[6]; // indices per BlockFace, the faces are stored in BlockFace order
+    uint32_t face_count;           // exposed block faces, see Mesh::face_count
+    uint32_t section;              // vertical section index within the chunk
+};
+
+// One section's quads, four vertices and six indices each. The indices are relative to the section's first vertex.
+struct SectionGeometry
 {
-    std::vector<Vertex> vertices;
+    std::vector<ChunkVertex> vertices;
     std::vector<uint32_t> indices;
-    geometry::aabb aabb;
+};
+
+struct Mesh
+{
+    std::vector<MeshSection> sections; // sections that produced faces, bottom to top
+    std::vector<SectionGeometry> geometry; // per entry in sections, so remeshing a section only replaces its own
+    std::vector<uint16_t> connectivity; // every vertical section's face_pair_bit set, including those without faces
+    std::vector<geometry::aabb> occluders; // world space, boxes wholly inside opaque blocks for the occlusion buffer
+    geometry::aabb aabb; // world space, union of the section bounds
+    glm::vec4 origin; // world space position of the chunk origin, w unused
+    uint32_t face_count = 0; // exposed block faces, i.e. quads the naive mesher would emit, summed over the sections. Only full
+                             // resolution meshes count them, downsampled cells don't map onto block faces.
+    int lod = 0; // level of detail, the mesh's cells are 1 << lod blocks on a side
+};
+
+enum class MeshMode : uint8_t
+{
+    Naive,  // one quad per exposed block face
+    Greedy  // coplanar faces with the same texture layer merged into larger quads
 };
 
 enum class BlockFace : uint8_t
@@ -32,24 +73,37 @@ enum class BlockFace : uint8_t
     West
 };
 
-enum class BlockType : uint8_t
+inline BlockFace opposite_face(BlockFace face)
+{
+    return (BlockFace)((int)face ^ 1);
+}
+
+// Bit for an unordered pair of distinct faces, a section's connectivity has the bit set if the two faces can see each other
+// through transparent blocks. 15 pairs, so all_faces_connected covers every pair.
+inline uint16_t face_pair_bit(BlockFace a, BlockFace b)
+{
+    int lo = (int)a < (int)b ? (int)a : (int)b;
+    int hi = (int)a < (int)b ? (int)b : (int)a;
+    return (uint16_t)(1 << (lo * (11 - lo) / 2 + hi - lo - 1));
+}
+
+static const uint16_t all_faces_connected = 0x7fff;
+
+// Chunk lifecycle, owned by the main thread. Blocks may only be read once generation has completed and the mesh may only be
+// uploaded once the chunk is Ready; worker jobs hand chunks back to the main thread through WorldGen::update.
+enum class ChunkState : uint8_t
+{
+    Generating, // generation job in flight
+    Generated,  // blocks are valid, the mesh is missing or stale
+    Meshing,    // mesh job in flight, blocks are valid
+    Ready       // blocks and mesh are valid
+};
+
+enum class SectionState : uint8_t
 {
-    Air,
-    Bedrock,
-    Brick,
-    OreCoal,
-    Cobble,
-    MossyCobble,
-    OreDiamond,
-    Dirt,
-    Grass,
-    OreIron,
-    OreGold,
-    OreLapis,
-    Leaves,
-    Log,
-    Planks,
-    Stone
+    Empty,   // all air, nothing to mesh
+    Uniform, // a single solid type, only faces on the section's outer shell can be exposed
+    Mixed
 };
 
 class Chunk
@@ -57,80 +111,274 @@ class Chunk
 public:
     static const int chunk_size = 64;
     static const int max_height = 256;
+    static const int section_height = 16;
+    static const int section_count = max_height / section_height;
+    static const int max_lod = 3; // 8 block cells, two to a section
 
-    BlockType blocks[chunk_size * chunk_size * max_height];
+    // Blocks are stored per 16 high section so each section's palette only covers the handful of types in that height band
+    PalettedBlocks sections[section_count];
 
     static inline bool in_bounds(int x, int y, int z)
     {
         return (x >= 0 && x < chunk_size && z >= 0 && z < chunk_size && y >= 0 && y < max_height);
     }
 
-    static inline int block_index(int x, int y, int z)
+    // Index of the block within its section
+    static inline uint32_t block_index(int x, int y, int z)
     {
-        return x + (z * chunk_size) + (y * chunk_size * chunk_size);
+        return x + (z * chunk_size) + ((y & (section_height - 1)) * chunk_size * chunk_size);
     }
 
-    BlockType block(int x, int y, int z)
+    BlockType block(int x, int y, int z) const
     {
         if (in_bounds(x, y, z))
         {
-            return blocks[block_index(x, y, z)];
+            return sections[y / section_height].get(block_index(x, y, z));
         }
 
         return BlockType::Air;
     }
 
-    void set_block(int x, int y, int z, BlockType block_type)
+    // Writes the block without marking anything, for generation which fills the chunk before it has been meshed
+    void write_block(int x, int y, int z, BlockType block_type)
     {
         if (in_bounds(x, y, z))
         {
-            blocks[block_index(x, y, z)] = block_type;
+            sections[y / section_height].set(block_index(x, y, z), block_type);
+        }
+    }
+
+    // Edits a block and marks the sections whose faces it can change dirty: its own, the one above or below when it is on a section
+    // boundary and the neighbouring chunk's section when it is on an x/z border. Only call while no job is reading the blocks.
+    void set_block(int x, int y, int z, BlockType block_type);
+
+    // Like block(), but looks across the x/z borders into the neighbouring chunks. Air where there is no neighbour.
+    BlockType block_or_neighbour(int x, int y, int z) const
+    {
+        const Chunk* neighbour = nullptr;
+
+        if (z < 0)
+        {
+            neighbour = neighbours[neighbour_index(BlockFace::North)];
+            z += chunk_size;
+        }
+        else if (z >= chunk_size)
+        {
+            neighbour = neighbours[neighbour_index(BlockFace::South)];
+            z -= chunk_size;
+        }
+        else if (x >= chunk_size)
+        {
+            neighbour = neighbours[neighbour_index(BlockFace::East)];
+            x -= chunk_size;
+        }
+        else if (x < 0)
+        {
+            neighbour = neighbours[neighbour_index(BlockFace::West)];
+            x += chunk_size;
         }
+        else
+        {
+            return block(x, y, z);
+        }
+
+        return neighbour ? neighbour->block(x, y, z) : BlockType::Air;
+    }
+
+    static inline int neighbour_index(BlockFace face)
+    {
+        return (int)face - (int)BlockFace::North;
+    }
+
+    SectionState get_section_state(int section) const
+    {
+        const PalettedBlocks& blocks = sections[section];
+
+        if (blocks.get_palette_size() > 1)
+        {
+            return SectionState::Mixed;
+        }
+
+        return (blocks.get_palette_entry(0) == BlockType::Air) ? SectionState::Empty : SectionState::Uniform;
     }
 
     void clear();
-    void create_mesh();
+    void compact();
+    size_t get_memory_usage() const;
 
-    float get_height(int x, int z);
+    // Block data as stored in the region files. deserialise() returns false if the payload is truncated or malformed.
+    void serialise(std::vector<uint8_t>& payload) const;
+    bool deserialise(const std::vector<uint8_t>& payload);
+    // lod > 0 meshes the blocks downsampled lod times, up to max_lod
+    void create_mesh(MeshMode mode = MeshMode::Greedy, int lod = 0);
+    // Remeshes just the dirty sections of a full resolution mesh in place and returns them, see Renderer::update_mesh. Greedy
+    // sections only remesh the slices next to the edits and keep their other quads. An edited section's connectivity is left
+    // fully connected, which is always safe, until the chunk is next meshed whole.
+    uint16_t remesh_dirty_sections(MeshMode mode);
+
+    float get_height(int x, int z) const;
 
     Mesh mesh;
     int origin_x = 0;
     int origin_z = 0;
+    ChunkState state = ChunkState::Generating;
+    uint32_t mesh_id = 0; // renderer mesh, 0 while outside the render zone
+    bool dirty = false;   // blocks differ from the copy on disk, saved when the chunk is evicted
+    uint16_t dirty_sections = 0; // vertical sections edited since the mesh was built, one bit each
+
+    // Resident neighbours in BlockFace order (North, South, East, West), maintained by WorldGen on the main thread. A chunk is
+    // only meshed once all four are generated and a chunk isn't evicted while a neighbour is meshing, so mesh jobs can follow
+    // these without locking.
+    Chunk* neighbours[4] = {};
+
+private:
+    // Inclusive chunk space bounds of the blocks edited since a dirty section was meshed. Edits seen across a border lie just
+    // outside the chunk.
+    struct DirtyBounds
+    {
+        int16_t min[3];
+        int16_t max[3];
+    };
+
+    void mark_dirty(int section, int x, int y, int z);
+    void create_mesh_naive(int section, SectionGeometry& out);
+    void create_mesh_greedy(int section, SectionGeometry& out, const int (*slices)[2] = nullptr);
+    size_t find_section(int section) const;
+    void set_section(int section, const glm::vec3& origin, SectionGeometry& geometry);
+    uint16_t find_connectivity(int section) const;
+    void sort_section_faces(MeshSection& section, SectionGeometry& geometry);
+    void set_mesh_totals(const glm::vec3& origin);
+    void find_occluders(const glm::vec3& origin);
+
+    DirtyBounds _dirty_bounds[section_count];
 };
 
+class JobSystem;
 class Renderer;
 
 class WorldGen
 {
 public:
-    WorldGen(Renderer& renderer);
+    WorldGen(Renderer& renderer, JobSystem& jobs);
+    ~WorldGen();
 
+    // Returns 0 while the chunk under (x, z) is still being generated
     float get_height(double x, double z);
 
-    Chunk& get_chunk(int chunk_x, int chunk_z);
-    void generate_around(double x, double z, int radius);
+    // Returns nullptr (and queues loading or generation if necessary) until the chunk's blocks are ready
+    Chunk* get_chunk(int chunk_x, int chunk_z);
+
+    // Zone radii in chunks around the player, see docs/world.md. Chunks within render_radius are drawn and chunks within
+    // load_radius are generated. Chunks are kept until they are further than unload_radius, the hysteresis ring stops chunks
+    // being evicted and regenerated as the player moves back and forth across a chunk boundary.
+    void set_zones(int render_radius, int load_radius, int unload_radius);
+
+    // Chunks within lod_radius are meshed at full resolution, each further ring lod_radius wide halves the resolution down to
+    // Chunk::max_lod
+    void set_lod_radius(int lod_radius);
+
+    // Call once per frame from the main thread. Hands chunks completed by the job system to the renderer, remeshes edited sections,
+    // then queues, shows, hides and evicts chunks around (x, z).
+    void update(double x, double z);
+
+    // Edits the block at world block coordinates (x, y, z), the sections it affects are remeshed by the next update. Returns false
+    // if the chunk isn't resident or a job is reading its blocks, try again on a later frame.
+    bool set_block(int x, int y, int z, BlockType block_type);
+
+    // Blocks until every job in flight has completed and been handed to the renderer, without queuing any more
+    void drain();
+
+    // Drains, then remeshes edited sections and queues the next round of work around the last update position like update() does.
+    // Jobs may be in flight again when it returns, use drain() when nothing may be.
+    void wait();
+
+    // Saves modified chunks and releases every chunk. Call before shutting down the job system.
+    void shutdown();
+
+    // Region files are written under this directory, relative to the working directory by default
+    void set_save_directory(const std::wstring& directory) { _store.set_directory(directory); }
+
+    uint32_t get_chunk_count() const { return (uint32_t)_chunks.size(); }
+
+    MeshMode get_mesh_mode() const { return _mesh_mode; }
+    void set_mesh_mode(MeshMode mode);
 
 private:
-    void generate_chunk(int chunk_x, int chunk_z);
+    enum class JobType : uint8_t
+    {
+        Generate,
+        Load,
+        Mesh,
+        Save
+    };
+
+    struct ChunkJob
+    {
+        JobType type;
+        Chunk* chunk; // nullptr for saves, the job releases the chunk
+        int origin_x;
+        int origin_z;
+        double ms;
+    };
+
+    void begin_job();
+    void queue_load(Chunk& chunk);
+    void queue_mesh(Chunk& chunk);
+    void queue_save(Chunk* chunk);
+    void evict(Chunk* chunk);
+    void generate_chunk(Chunk& chunk) const;
+    void complete(const ChunkJob& job);
+    void drain_completed();
+    void update_zones();
+    bool in_zone(const Chunk& chunk, int radius) const;
+    bool can_mesh(const Chunk& chunk) const;
+    int get_lod(const Chunk& chunk) const;
+    bool is_lod_stale(const Chunk& chunk) const;
+    bool can_evict(const Chunk& chunk) const;
+    bool can_edit(const Chunk& chunk) const;
+    void remesh_dirty_chunks();
+    void link_neighbours(Chunk& chunk);
+    void unlink_neighbours(Chunk& chunk);
+    void show_chunk(Chunk& chunk);
+    void hide_chunk(Chunk& chunk);
+    void log_stats();
 
     noise::module::Perlin _perlin;
     Renderer& _renderer;
+    JobSystem& _jobs;
+
+    std::mutex _completed_mutex;
+    std::vector<ChunkJob> _completed;
+    uint32_t _jobs_in_flight = 0;
 
-    struct IntCoord
+    struct JobStats
     {
-        int x, z;
-    };
-    
-    struct IntCoordCompare
-    {
-        bool operator()(const IntCoord& a, const IntCoord& b) const
-        {
-            return (a.x != b.x) ? (a.x < b.x) : (a.z < b.z);
-        }
+        uint32_t generated = 0;
+        uint32_t loaded = 0;
+        uint32_t meshed = 0;
+        uint32_t saved = 0;
+        double generate_ms = 0.0;
+        double load_ms = 0.0;
+        double mesh_ms = 0.0;
+        double save_ms = 0.0;
+        std::chrono::high_resolution_clock::time_point start;
     };
 
-    typedef std::map<IntCoord, Chunk, IntCoordCompare> ChunkMap;
-    ChunkMap _chunks;
+    JobStats _stats;
+
+    ChunkHashMap _chunks;
+    ChunkStore _store;
+    std::unordered_map<world::ChunkMap::Key, uint32_t> _saving; // chunks with a save in flight aren't reloaded until it completes
+    std::vector<Chunk*> _dirty_chunks; // chunks with dirty sections, remeshed by update
+    MeshMode _mesh_mode = MeshMode::Greedy;
+
+    int _render_radius = 4;
+    int _load_radius = 5;
+    int _unload_radius = 7;
+    int _lod_radius = 3;
+    int _centre_x = 0;
+    int _centre_z = 0;
+    bool _zones_dirty = true;
 };
 
 inline void world_to_chunk(double world_x, double world_z, int& chunk_x, int& chunk_z)
@@ -0,0 +1,411 @@
+#include "gpu_culling.h"
+
+#include <Windows.h>
+
+#include <glm/geometric.hpp>
+
+#include <float.h>
+#include <set>
+#include <sstream>
+
+#include "vulkan.h"
+#include "vulkan_device.h"
+
+static_assert(sizeof(GpuCuller::Candidate) == 64, "GpuCuller::Candidate should match the std430 layout in cull.comp");
+static_assert(sizeof(geometry::plane) == 16, "geometry::plane should pack into a vec4 for cull.comp");
+
+// Layout matches PushConstants in cull.comp
+struct CullConstants
+{
+    geometry::plane planes[6];
+    uint32_t candidate_count;
+    uint32_t compact;
+};
+
+static const uint32_t cull_group_size = 64;
+
+bool GpuCuller::create(VulkanDevice& device, VkShaderModule shader, VkPipelineCache pipeline_cache)
+{
+    _device = &device;
+
+    VkDescriptorSetLayoutBinding bindings[3];
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        bindings[i] = {};
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 3;
+    layout_info.pBindings = bindings;
+    VK_CHECK_RESULT(vkCreateDescriptorSetLayout((VkDevice)device, &layout_info, nullptr, &_descriptor_set_layout));
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(CullConstants);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &_descriptor_set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+    VK_CHECK_RESULT(vkCreatePipelineLayout((VkDevice)device, &pipeline_layout_info, nullptr, &_pipeline_layout));
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = shader;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = _pipeline_layout;
+    VK_CHECK_RESULT(vkCreateComputePipelines((VkDevice)device, pipeline_cache, 1, &pipeline_info, nullptr, &_pipeline));
+
+    if (device.supports_draw_indirect_count())
+    {
+        _draw_indexed_indirect_count =
+                (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr((VkDevice)device, "vkCmdDrawIndexedIndirectCountKHR");
+    }
+
+    return true;
+}
+
+void GpuCuller::destroy()
+{
+    if (!_device)
+    {
+        return;
+    }
+
+    invalidate();
+
+    if (_pipeline)
+    {
+        vkDestroyPipeline((VkDevice)*_device, _pipeline, nullptr);
+        _pipeline = VK_NULL_HANDLE;
+    }
+
+    if (_pipeline_layout)
+    {
+        vkDestroyPipelineLayout((VkDevice)*_device, _pipeline_layout, nullptr);
+        _pipeline_layout = VK_NULL_HANDLE;
+    }
+
+    if (_descriptor_set_layout)
+    {
+        vkDestroyDescriptorSetLayout((VkDevice)*_device, _descriptor_set_layout, nullptr);
+        _descriptor_set_layout = VK_NULL_HANDLE;
+    }
+
+    _device = nullptr;
+}
+
+bool GpuCuller::create_frames(uint32_t count)
+{
+    VkDescriptorPoolSize pool_size = {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = count * 3;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = count;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    VK_CHECK_RESULT(vkCreateDescriptorPool((VkDevice)*_device, &pool_info, nullptr, &_descriptor_pool));
+
+    _frames.resize(count);
+
+    for (Frame& frame : _frames)
+    {
+        VkDescriptorSetAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = _descriptor_pool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &_descriptor_set_layout;
+        VK_CHECK_RESULT(vkAllocateDescriptorSets((VkDevice)*_device, &alloc_info, &frame.descriptor_set));
+    }
+
+    return true;
+}
+
+void GpuCuller::invalidate()
+{
+    _frames.clear();
+
+    if (_descriptor_pool)
+    {
+        vkDestroyDescriptorPool((VkDevice)*_device, _descriptor_pool, nullptr);
+        _descriptor_pool = VK_NULL_HANDLE;
+    }
+}
+
+bool GpuCuller::reserve(Frame& frame, uint32_t candidate_count, uint32_t pool_count)
+{
+    if (frame.capacity && candidate_count <= frame.capacity && pool_count <= frame.pool_capacity)
+    {
+        return true;
+    }
+
+    uint32_t capacity = max(max(candidate_count, frame.capacity * 2), 1024u);
+    uint32_t pool_capacity = max(pool_count, 16u);
+    frame.candidates.destroy();
+    frame.commands.destroy();
+    frame.counts.destroy();
+    frame.readback.destroy();
+    frame.capacity = 0;
+
+    // The candidates are written by the CPU every frame, the results are only ever read by the GPU outside of verify
+    VkMemoryPropertyFlags host_properties = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    VkBufferUsageFlags result_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+    if (!frame.candidates.create(*_device, capacity * sizeof(Candidate), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_properties) ||
+        !frame.commands.create(*_device, capacity * sizeof(VkDrawIndexedIndirectCommand), result_usage,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ||
+        !frame.counts.create(*_device, pool_capacity * sizeof(uint32_t), result_usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+    {
+        return false;
+    }
+
+    frame.capacity = capacity;
+    frame.pool_capacity = pool_capacity;
+
+    // The frame's fence has signalled, so no pending command buffer uses the set
+    VkDescriptorBufferInfo buffer_infos[3] = { frame.candidates.get_descriptor_info(), frame.commands.get_descriptor_info(),
+                                               frame.counts.get_descriptor_info() };
+    VkWriteDescriptorSet writes[3];
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        writes[i] = {};
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = frame.descriptor_set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].pBufferInfo = &buffer_infos[i];
+    }
+
+    vkUpdateDescriptorSets((VkDevice)*_device, 3, writes, 0, nullptr);
+
+    return true;
+}
+
+bool GpuCuller::reserve_readback(Frame& frame)
+{
+    VkDeviceSize size = frame.pool_capacity * sizeof(uint32_t) + frame.capacity * sizeof(VkDrawIndexedIndirectCommand);
+
+    if (frame.readback.get_device_size() >= size)
+    {
+        return true;
+    }
+
+    frame.readback.destroy();
+    return frame.readback.create(*_device, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+GpuCuller::Candidate* GpuCuller::begin_frame(uint32_t frame_index, uint32_t candidate_count, uint32_t pool_count)
+{
+    Frame& frame = _frames[frame_index];
+    frame.candidate_count = 0;
+    frame.pool_count = 0;
+
+    if (!reserve(frame, candidate_count, pool_count))
+    {
+        return nullptr;
+    }
+
+    Candidate* candidates;
+
+    if (!frame.candidates.map((void**)&candidates))
+    {
+        return nullptr;
+    }
+
+    frame.candidate_count = candidate_count;
+    frame.pool_count = pool_count;
+    return candidates;
+}
+
+void GpuCuller::record(VkCommandBuffer command_buffer, uint32_t frame_index, const geometry::frustum& frustum)
+{
+    Frame& frame = _frames[frame_index];
+    frame.frustum = frustum;
+    frame.verify = false;
+    bool verify = _verify_requested;
+    _verify_requested = false;
+
+    if (frame.candidate_count == 0)
+    {
+        return;
+    }
+
+    vkCmdFillBuffer(command_buffer, frame.counts, 0, frame.pool_count * sizeof(uint32_t), 0);
+
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0,
+                         nullptr);
+
+    CullConstants constants;
+    memcpy(constants.planes, frustum.planes, sizeof(constants.planes));
+    constants.candidate_count = frame.candidate_count;
+    constants.compact = _draw_indexed_indirect_count ? 1 : 0;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline_layout, 0, 1, &frame.descriptor_set, 0, nullptr);
+    vkCmdPushConstants(command_buffer, _pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(command_buffer, (frame.candidate_count + cull_group_size - 1) / cull_group_size, 1, 1);
+
+    frame.verify = verify && reserve_readback(frame);
+    VkPipelineStageFlags dst_stages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+
+    if (frame.verify)
+    {
+        dst_stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+        barrier.dstAccessMask |= VK_ACCESS_TRANSFER_READ_BIT;
+    }
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dst_stages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    if (!frame.verify)
+    {
+        return;
+    }
+
+    VkBufferCopy counts_copy = {};
+    counts_copy.size = frame.pool_count * sizeof(uint32_t);
+    VkBufferCopy commands_copy = {};
+    commands_copy.dstOffset = frame.pool_capacity * sizeof(uint32_t);
+    commands_copy.size = frame.candidate_count * sizeof(VkDrawIndexedIndirectCommand);
+
+    if (counts_copy.size)
+    {
+        vkCmdCopyBuffer(command_buffer, frame.counts, frame.readback, 1, &counts_copy);
+    }
+
+    vkCmdCopyBuffer(command_buffer, frame.commands, frame.readback, 1, &commands_copy);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void GpuCuller::draw(VkCommandBuffer command_buffer, uint32_t frame_index, uint32_t pool, uint32_t first, uint32_t count)
+{
+    Frame& frame = _frames[frame_index];
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+    if (_draw_indexed_indirect_count)
+    {
+        _draw_indexed_indirect_count(command_buffer, frame.commands, first * stride, frame.counts, pool * sizeof(uint32_t), count, stride);
+        return;
+    }
+
+    uint32_t max_draw_count = _device->get_properties().limits.maxDrawIndirectCount;
+
+    for (uint32_t i = 0; i < count; i += max_draw_count)
+    {
+        vkCmdDrawIndexedIndirect(command_buffer, frame.commands, (first + i) * stride, min(count - i, max_draw_count), stride);
+    }
+}
+
+void GpuCuller::verify(uint32_t frame_index)
+{
+    if (frame_index >= _frames.size() || !_frames[frame_index].verify)
+    {
+        return;
+    }
+
+    Frame& frame = _frames[frame_index];
+    frame.verify = false;
+
+    Candidate* candidates;
+    uint8_t* readback;
+
+    if (!frame.candidates.map((void**)&candidates) || !frame.readback.map((void**)&readback))
+    {
+        return;
+    }
+
+    const uint32_t* counts = (const uint32_t*)readback;
+    const VkDrawIndexedIndirectCommand* commands = (const VkDrawIndexedIndirectCommand*)(readback + frame.pool_capacity * sizeof(uint32_t));
+
+    std::set<uint32_t> gpu_visible;
+    uint32_t gpu_count = 0;
+
+    if (_draw_indexed_indirect_count)
+    {
+        // Survivors are packed at the start of each pool's range
+        for (uint32_t i = 0; i < frame.candidate_count; ++i)
+        {
+            if (candidates[i].pool_first == i)
+            {
+                for (uint32_t j = 0; j < counts[candidates[i].pool]; ++j)
+                {
+                    gpu_visible.insert(commands[i + j].firstInstance);
+                }
+            }
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < frame.candidate_count; ++i)
+        {
+            if (commands[i].instanceCount)
+            {
+                gpu_visible.insert(i);
+            }
+        }
+    }
+
+    for (uint32_t pool = 0; pool < frame.pool_count; ++pool)
+    {
+        gpu_count += counts[pool];
+    }
+
+    uint32_t cpu_count = 0;
+    uint32_t mismatches = 0;
+    uint32_t borderline = 0;
+
+    for (uint32_t i = 0; i < frame.candidate_count; ++i)
+    {
+        geometry::aabb aabb;
+        aabb.center = glm::vec3(candidates[i].center);
+        aabb.extents = glm::vec3(candidates[i].extents);
+        bool cpu_visible = !culling::cull(frame.frustum, aabb);
+        cpu_count += cpu_visible ? 1 : 0;
+
+        if (cpu_visible != (gpu_visible.count(i) != 0))
+        {
+            mismatches++;
+
+            // Rounding differences are expected for boxes that just touch a plane
+            float margin = FLT_MAX;
+
+            for (const geometry::plane& p : frame.frustum.planes)
+            {
+                float r = aabb.extents[0] * fabs(p.n[0]) + aabb.extents[1] * fabs(p.n[1]) + aabb.extents[2] * fabs(p.n[2]);
+                margin = min(margin, (float)fabs(glm::dot(p.n, aabb.center) - p.d + r));
+            }
+
+            borderline += (margin < 1e-3f * (1.0f + glm::length(aabb.center))) ? 1 : 0;
+        }
+    }
+
+    std::stringstream ss;
+    ss << "gpu culling: " << frame.candidate_count << " sections, " << gpu_count << " visible on the gpu (" << gpu_visible.size() << " commands), ";
+    ss << cpu_count << " on the cpu, " << mismatches << " mismatches (" << borderline << " on a plane boundary)" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+}
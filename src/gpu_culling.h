@@ -0,0 +1,82 @@
+#pragma once
+
+#include <glm/vec4.hpp>
+
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "culling.h"
+#include "vulkan_buffer.h"
+
+class VulkanDevice;
+
+// Frustum culls chunk sections in a compute pass (res/shaders/cull.comp). The renderer writes every drawable section as a
+// candidate, the pass writes the surviving draw commands plus a draw count per mesh cache pool and the render pass consumes them
+// with one indirect draw per pool. With VK_KHR_draw_indirect_count the survivors are compacted and drawn with the GPU written
+// count, otherwise culled commands stay in place with an instance count of zero.
+class GpuCuller
+{
+public:
+    // Layout matches Candidate in cull.comp (std430)
+    struct Candidate
+    {
+        glm::vec4 center;
+        glm::vec4 extents;
+        VkDrawIndexedIndirectCommand command; // firstInstance is the candidate's index, it selects the draw's chunk origin
+        uint32_t pool_first;                  // first candidate of the pool, candidates are grouped by pool
+        uint32_t pool;
+        uint32_t pad;
+    };
+
+    ~GpuCuller() { destroy(); }
+
+    bool create(VulkanDevice& device, VkShaderModule shader, VkPipelineCache pipeline_cache);
+    void destroy();
+
+    // Buffers and descriptor sets per frame in flight
+    bool create_frames(uint32_t count);
+    void invalidate();
+
+    // Returns the frame's mapped candidate storage, grown to fit if necessary. Only call once the frame's fence has signalled.
+    Candidate* begin_frame(uint32_t frame, uint32_t candidate_count, uint32_t pool_count);
+
+    // Records the culling dispatch for the candidates written since begin_frame, outside the render pass
+    void record(VkCommandBuffer command_buffer, uint32_t frame, const geometry::frustum& frustum);
+
+    // Records the draws for one pool's candidates, inside the render pass
+    void draw(VkCommandBuffer command_buffer, uint32_t frame, uint32_t pool, uint32_t first, uint32_t count);
+
+    // The next dispatch's results are copied back and checked against culling::cull on the CPU once it has completed, see verify
+    void request_verify() { _verify_requested = true; }
+
+    // Logs any difference between the frame's last dispatch and the CPU result. Only call once the frame's fence has signalled.
+    void verify(uint32_t frame);
+
+private:
+    struct Frame
+    {
+        VulkanBuffer candidates;
+        VulkanBuffer commands;
+        VulkanBuffer counts;
+        VulkanBuffer readback; // host visible copy of counts followed by commands, only created once verify is requested
+        VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+        uint32_t capacity = 0;
+        uint32_t pool_capacity = 0;
+        uint32_t candidate_count = 0;
+        uint32_t pool_count = 0;
+        geometry::frustum frustum;
+        bool verify = false; // last dispatch should be verified once it completes
+    };
+
+    bool reserve(Frame& frame, uint32_t candidate_count, uint32_t pool_count);
+    bool reserve_readback(Frame& frame);
+
+    VulkanDevice* _device = nullptr;
+    VkDescriptorSetLayout _descriptor_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout _pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline _pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool _descriptor_pool = VK_NULL_HANDLE;
+    PFN_vkCmdDrawIndexedIndirectCountKHR _draw_indexed_indirect_count = nullptr;
+    std::vector<Frame> _frames;
+    bool _verify_requested = false;
+};
@@ -1,16 +1,47 @@
 #include "graphics_pipeline.h"
 
+#include <Windows.h>
+
+#include <chrono>
+#include <sstream>
+
+#include "file.h"
 #include "render_pass.h"
 #include "vulkan.h"
 #include "vulkan_device.h"
 #include "vulkan_swapchain.h"
 
-bool GraphicsPipeline::initialise(VulkanDevice& device, Swapchain& swapchain, RenderPass& render_pass,
+// Written ahead of the pipeline cache data on disk. The driver's own header identifies the device but not the driver, and a new
+// driver may reject or misread an old cache, so the driver version is checked as well.
+struct PipelineCacheFileHeader
+{
+    uint32_t magic;
+    uint32_t data_size;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t uuid[VK_UUID_SIZE];
+};
+
+// Layout of VK_PIPELINE_CACHE_HEADER_VERSION_ONE at the start of the cache data
+struct PipelineCacheDataHeader
+{
+    uint32_t header_size;
+    uint32_t header_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint8_t uuid[VK_UUID_SIZE];
+};
+
+static const uint32_t pipeline_cache_magic = 0x31435056; // "VPC1"
+
+bool GraphicsPipeline::initialise(VulkanDevice& device, Swapchain& swapchain, RenderPass& render_pass, VkPipelineCache pipeline_cache,
                                   VkGraphicsPipelineCreateInfo& pipeline_create_info, VkPipelineLayoutCreateInfo& layout_create_info)
 {
     _device = &device;
     _render_pass = &render_pass;
     _swapchain = &swapchain;
+    _pipeline_cache = pipeline_cache;
 
     VK_CHECK_RESULT(vkCreatePipelineLayout((VkDevice)*_device, &layout_create_info, nullptr, &_layout));
 
@@ -81,30 +112,31 @@ void GraphicsPipeline::destroy()
 
 bool GraphicsPipeline::create()
 {
-    VkViewport viewport = {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)_swapchain->get_extent().width;
-    viewport.height = (float)_swapchain->get_extent().height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor = {};
-    scissor.offset = { 0, 0 };
-    scissor.extent = _swapchain->get_extent();
-
+    // Viewport and scissor are set when recording so the pipeline doesn't depend on the swapchain extent
     VkPipelineViewportStateCreateInfo viewport_state = {};
     viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewport_state.viewportCount = 1;
-    viewport_state.pViewports = &viewport;
     viewport_state.scissorCount = 1;
-    viewport_state.pScissors = &scissor;
+
+    VkDynamicState dynamic_states[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamic_state = {};
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = 2;
+    dynamic_state.pDynamicStates = dynamic_states;
 
     _pipeline_create_info.pViewportState = &viewport_state;
+    _pipeline_create_info.pDynamicState = &dynamic_state;
     _pipeline_create_info.layout = _layout;
     _pipeline_create_info.renderPass = (VkRenderPass)*_render_pass;
 
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines((VkDevice)*_device, nullptr, 1, &_pipeline_create_info, nullptr, &_pipeline));
+    // Only recreated when the render pass is, e.g. moving to a display with another surface format
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    VK_CHECK_RESULT(vkCreateGraphicsPipelines((VkDevice)*_device, _pipeline_cache, 1, &_pipeline_create_info, nullptr, &_pipeline));
+
+    std::stringstream ss;
+    ss << "graphics pipeline: created in " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+       << " ms" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
 
     return true;
 }
@@ -126,6 +158,138 @@ void GraphicsPipelineFactory::initialise(VulkanDevice& device, Swapchain& swapch
     _subpass = subpass;
 }
 
+void GraphicsPipelineFactory::destroy()
+{
+    if (_pipeline_cache)
+    {
+        vkDestroyPipelineCache((VkDevice)*_device, _pipeline_cache, nullptr);
+        _pipeline_cache = VK_NULL_HANDLE;
+    }
+}
+
+// Returns why the cache data can't be used on this device, or nullptr if it can
+static const char* check_pipeline_cache(const PipelineCacheFileHeader& file_header, const std::vector<uint8_t>& data,
+                                        const VkPhysicalDeviceProperties& properties)
+{
+    if (file_header.magic != pipeline_cache_magic || file_header.data_size != data.size() || data.size() < sizeof(PipelineCacheDataHeader))
+    {
+        return "unrecognised or truncated";
+    }
+
+    if (file_header.vendor_id != properties.vendorID || file_header.device_id != properties.deviceID ||
+        memcmp(file_header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+    {
+        return "saved on another device";
+    }
+
+    if (file_header.driver_version != properties.driverVersion)
+    {
+        return "saved with another driver version";
+    }
+
+    // The driver validates its own header too, but would only say the data is unusable by returning an empty cache
+    const PipelineCacheDataHeader* data_header = (const PipelineCacheDataHeader*)data.data();
+
+    if (data_header->header_size < sizeof(PipelineCacheDataHeader) || data_header->header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+        data_header->vendor_id != properties.vendorID || data_header->device_id != properties.deviceID ||
+        memcmp(data_header->uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+    {
+        return "driver header doesn't match the device";
+    }
+
+    return nullptr;
+}
+
+bool GraphicsPipelineFactory::load_pipeline_cache(const std::wstring& path)
+{
+    const VkPhysicalDeviceProperties& properties = _device->get_properties();
+    std::vector<uint8_t> data;
+    const char* error = "not found";
+    File file;
+
+    if (file.open(path))
+    {
+        PipelineCacheFileHeader file_header = {};
+        error = "unrecognised or truncated";
+
+        if (file.get_length() >= sizeof(file_header) && file.read(&file_header, sizeof(file_header)) == sizeof(file_header))
+        {
+            data.resize(file.get_length() - sizeof(file_header));
+
+            if (file.read(data.data(), (uint32_t)data.size()) == data.size())
+            {
+                error = check_pipeline_cache(file_header, data, properties);
+            }
+        }
+
+        file.close();
+    }
+
+    if (error)
+    {
+        data.clear();
+    }
+
+    std::stringstream ss;
+    ss << "pipeline cache: ";
+
+    if (error)
+    {
+        ss << error << ", starting cold" << std::endl;
+    }
+    else
+    {
+        ss << "loaded " << data.size() << " bytes" << std::endl;
+    }
+
+    OutputDebugStringA(ss.str().c_str());
+
+    VkPipelineCacheCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    create_info.initialDataSize = data.size();
+    create_info.pInitialData = data.empty() ? nullptr : data.data();
+    VK_CHECK_RESULT(vkCreatePipelineCache((VkDevice)*_device, &create_info, nullptr, &_pipeline_cache));
+
+    return true;
+}
+
+bool GraphicsPipelineFactory::save_pipeline_cache(const std::wstring& path) const
+{
+    if (!_pipeline_cache)
+    {
+        return false;
+    }
+
+    size_t size = 0;
+    VK_CHECK_RESULT(vkGetPipelineCacheData((VkDevice)*_device, _pipeline_cache, &size, nullptr));
+
+    std::vector<uint8_t> data(size);
+    VK_CHECK_RESULT(vkGetPipelineCacheData((VkDevice)*_device, _pipeline_cache, &size, data.data()));
+    data.resize(size);
+
+    const VkPhysicalDeviceProperties& properties = _device->get_properties();
+    PipelineCacheFileHeader file_header = {};
+    file_header.magic = pipeline_cache_magic;
+    file_header.data_size = (uint32_t)data.size();
+    file_header.vendor_id = properties.vendorID;
+    file_header.device_id = properties.deviceID;
+    file_header.driver_version = properties.driverVersion;
+    memcpy(file_header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+    FILE* fp = nullptr;
+    _wfopen_s(&fp, path.c_str(), L"wb");
+
+    if (!fp)
+    {
+        return false;
+    }
+
+    bool written = fwrite(&file_header, sizeof(file_header), 1, fp) == 1 && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+
+    return written;
+}
+
 void GraphicsPipelineFactory::set_shader(VkShaderStageFlagBits stage, VkShaderModule shader, const char* name)
 {
     if (shader && name)
@@ -156,14 +320,14 @@ static uint32_t get_vertex_size(const VertexDecl& decl)
     return vertex_size;
 }
 
-static void create_input_state(const VertexDecl& vertex_decl, std::vector<VkVertexInputBindingDescription>& bindings,
+static void create_input_state(const VertexDecl& vertex_decl, VkVertexInputRate input_rate, std::vector<VkVertexInputBindingDescription>& bindings,
                                std::vector<VkVertexInputAttributeDescription>& attributes)
 {
     uint32_t binding = (uint32_t)bindings.size();
 
     VkVertexInputBindingDescription binding_description;
     binding_description.binding = binding;
-    binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    binding_description.inputRate = input_rate;
     binding_description.stride = get_vertex_size(vertex_decl);
     bindings.push_back(binding_description);
 
@@ -178,9 +342,9 @@ static void create_input_state(const VertexDecl& vertex_decl, std::vector<VkVert
     }
 }
 
-void GraphicsPipelineFactory::set_vertex_decl(const VertexDecl& vertex_decl)
+void GraphicsPipelineFactory::set_vertex_decl(const VertexDecl& vertex_decl, VkVertexInputRate input_rate)
 {
-    create_input_state(vertex_decl, _vertex_bindings, _vertex_attributes);
+    create_input_state(vertex_decl, input_rate, _vertex_bindings, _vertex_attributes);
 }
 
 void GraphicsPipelineFactory::add_descriptor_set_layout(VkDescriptorSetLayout layout)
@@ -188,6 +352,15 @@ void GraphicsPipelineFactory::add_descriptor_set_layout(VkDescriptorSetLayout la
     _descriptor_set_layouts.push_back(layout);
 }
 
+void GraphicsPipelineFactory::add_push_constant_range(VkShaderStageFlags stages, uint32_t offset, uint32_t size)
+{
+    VkPushConstantRange range = {};
+    range.stageFlags = stages;
+    range.offset = offset;
+    range.size = size;
+    _push_constant_ranges.push_back(range);
+}
+
 bool GraphicsPipelineFactory::create_pipeline(GraphicsPipeline& pipeline)
 {
     std::vector<VkPipelineShaderStageCreateInfo> shader_stages;
@@ -250,6 +423,12 @@ bool GraphicsPipelineFactory::create_pipeline(GraphicsPipeline& pipeline)
         layout_create_info.pSetLayouts = _descriptor_set_layouts.data();
     }
 
+    if (!_push_constant_ranges.empty())
+    {
+        layout_create_info.pushConstantRangeCount = (uint32_t)_push_constant_ranges.size();
+        layout_create_info.pPushConstantRanges = _push_constant_ranges.data();
+    }
+
     VkGraphicsPipelineCreateInfo pipeline_create_info = {};
     pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipeline_create_info.stageCount = (uint32_t)shader_stages.size();
@@ -262,5 +441,5 @@ bool GraphicsPipelineFactory::create_pipeline(GraphicsPipeline& pipeline)
     pipeline_create_info.pColorBlendState = &colour_blend_state_create_info;
     pipeline_create_info.subpass = _subpass;
 
-    return pipeline.initialise(*_device, *_swapchain, *_render_pass, pipeline_create_info, layout_create_info);
+    return pipeline.initialise(*_device, *_swapchain, *_render_pass, _pipeline_cache, pipeline_create_info, layout_create_info);
 }
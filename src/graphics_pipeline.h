@@ -14,8 +14,8 @@ class Swapchain;
 class GraphicsPipeline
 {
 public:
-    bool initialise(VulkanDevice& device, Swapchain& swapchain, RenderPass& render_pass, VkGraphicsPipelineCreateInfo& pipeline_create_info,
-                    VkPipelineLayoutCreateInfo& layout_create_info);
+    bool initialise(VulkanDevice& device, Swapchain& swapchain, RenderPass& render_pass, VkPipelineCache pipeline_cache,
+                    VkGraphicsPipelineCreateInfo& pipeline_create_info, VkPipelineLayoutCreateInfo& layout_create_info);
     void destroy();
 
     bool create();
@@ -39,6 +39,7 @@ private:
     VulkanDevice* _device;
     RenderPass* _render_pass;
     Swapchain* _swapchain;
+    VkPipelineCache _pipeline_cache = VK_NULL_HANDLE;
     VkPipelineLayout _layout = VK_NULL_HANDLE;
     VkPipeline _pipeline = VK_NULL_HANDLE;
 };
@@ -47,12 +48,20 @@ class GraphicsPipelineFactory
 {
 public:
     void initialise(VulkanDevice& device, Swapchain& swapchain, RenderPass& render_pass, uint32_t subpass);
+    void destroy();
+
+    // Creates the pipeline cache, seeded from path if the file there was saved for this device and driver version
+    bool load_pipeline_cache(const std::wstring& path);
+    bool save_pipeline_cache(const std::wstring& path) const;
+    VkPipelineCache get_pipeline_cache() const { return _pipeline_cache; }
 
     void set_shader(VkShaderStageFlagBits stage, VkShaderModule shader, const char* name);
     void set_input_assembly_state(VkPrimitiveTopology topology, bool primtive_restart);
-    void set_vertex_decl(const VertexDecl& vertex_decl);
+    // Each call adds the next vertex binding
+    void set_vertex_decl(const VertexDecl& vertex_decl, VkVertexInputRate input_rate = VK_VERTEX_INPUT_RATE_VERTEX);
 
     void add_descriptor_set_layout(VkDescriptorSetLayout layout);
+    void add_push_constant_range(VkShaderStageFlags stages, uint32_t offset, uint32_t size);
 
     bool create_pipeline(GraphicsPipeline& pipeline);
 
@@ -63,9 +72,11 @@ private:
     std::vector<VkVertexInputBindingDescription> _vertex_bindings;
     std::vector<VkVertexInputAttributeDescription> _vertex_attributes;
     std::vector<VkDescriptorSetLayout> _descriptor_set_layouts;
+    std::vector<VkPushConstantRange> _push_constant_ranges;
     VulkanDevice* _device = nullptr;
     Swapchain* _swapchain = nullptr;
     RenderPass* _render_pass = nullptr;
+    VkPipelineCache _pipeline_cache = VK_NULL_HANDLE;
     uint32_t _subpass = 0;
     VkPrimitiveTopology _primitive_topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     bool _primitive_restart = false;
@@ -0,0 +1,234 @@
+#include "job_system.h"
+
+#include <chrono>
+
+static thread_local uint32_t worker_index = UINT32_MAX;
+
+bool JobSystem::initialise(uint32_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::thread::hardware_concurrency();
+    }
+
+    if (thread_count == 0)
+    {
+        thread_count = 1;
+    }
+
+    _quit = false;
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        _workers.emplace_back(new Worker());
+    }
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        _workers[i]->thread = std::thread(&JobSystem::worker_main, this, i);
+    }
+
+    return true;
+}
+
+void JobSystem::shutdown()
+{
+    if (_workers.empty())
+    {
+        return;
+    }
+
+    wait_idle();
+
+    {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+        _quit = true;
+    }
+
+    _wake.notify_all();
+
+    for (std::unique_ptr<Worker>& worker : _workers)
+    {
+        worker->thread.join();
+    }
+
+    _workers.clear();
+}
+
+void JobSystem::submit(Job job)
+{
+    uint32_t index = worker_index;
+
+    if (index == UINT32_MAX)
+    {
+        index = _next_worker++ % (uint32_t)_workers.size();
+    }
+
+    _pending++;
+
+    {
+        std::lock_guard<std::mutex> lock(_workers[index]->mutex);
+        _workers[index]->jobs.push_back(std::move(job));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+    }
+
+    _wake.notify_one();
+}
+
+void JobSystem::wait_idle()
+{
+    uint32_t count = (uint32_t)_workers.size();
+    uint32_t start = _next_worker % (count ? count : 1);
+
+    while (_pending > 0)
+    {
+        Job job;
+        bool found = false;
+
+        for (uint32_t i = 0; i < count && !found; ++i)
+        {
+            Worker& victim = *_workers[(start + i) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+
+            if (!victim.jobs.empty())
+            {
+                job = std::move(victim.jobs.front());
+                victim.jobs.pop_front();
+                found = true;
+            }
+        }
+
+        if (found)
+        {
+            job();
+
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+            if (--_pending == 0)
+            {
+                _idle.notify_all();
+            }
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(_wake_mutex);
+            _idle.wait_for(lock, std::chrono::milliseconds(1), [this] { return _pending == 0; });
+        }
+    }
+}
+
+void JobSystem::get_stats(std::vector<WorkerStats>& stats)
+{
+    stats.clear();
+
+    for (std::unique_ptr<Worker>& worker : _workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        stats.push_back(worker->stats);
+    }
+}
+
+void JobSystem::reset_stats()
+{
+    for (std::unique_ptr<Worker>& worker : _workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->stats = WorkerStats();
+    }
+}
+
+void JobSystem::worker_main(uint32_t index)
+{
+    worker_index = index;
+
+    while (true)
+    {
+        Job job;
+
+        if (pop(index, job))
+        {
+            run(index, job, false);
+            continue;
+        }
+
+        if (steal(index, job))
+        {
+            run(index, job, true);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+
+        if (_quit)
+        {
+            break;
+        }
+
+        // Jobs can be pushed between the failed steal and taking the lock, so only sleep briefly before looking again
+        _wake.wait_for(lock, std::chrono::milliseconds(2));
+
+        if (_quit)
+        {
+            break;
+        }
+    }
+}
+
+bool JobSystem::pop(uint32_t index, Job& job)
+{
+    Worker& worker = *_workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+
+    if (worker.jobs.empty())
+    {
+        return false;
+    }
+
+    job = std::move(worker.jobs.back());
+    worker.jobs.pop_back();
+    return true;
+}
+
+bool JobSystem::steal(uint32_t index, Job& job)
+{
+    uint32_t count = (uint32_t)_workers.size();
+
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        Worker& victim = *_workers[(index + i) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (!victim.jobs.empty())
+        {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void JobSystem::run(uint32_t index, Job& job, bool stolen)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    job();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    Worker& worker = *_workers[index];
+
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.stats.jobs++;
+        worker.stats.steals += stolen ? 1 : 0;
+        worker.stats.busy_ms += elapsed.count();
+    }
+
+    std::lock_guard<std::mutex> lock(_wake_mutex);
+    if (--_pending == 0)
+    {
+        _idle.notify_all();
+    }
+}
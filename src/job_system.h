@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Each worker owns a deque: it pushes and pops its own jobs at the back and steals from the front of the
+// other workers' deques when it runs dry. Jobs submitted from outside the pool are spread round-robin over the workers.
+class JobSystem
+{
+public:
+    typedef std::function<void()> Job;
+
+    struct WorkerStats
+    {
+        uint64_t jobs = 0;
+        uint64_t steals = 0;
+        double busy_ms = 0.0;
+    };
+
+    ~JobSystem() { shutdown(); }
+
+    bool initialise(uint32_t thread_count = 0); // 0 = one worker per hardware thread
+    void shutdown();
+
+    void submit(Job job);
+
+    // Runs jobs on the calling thread until every submitted job has completed
+    void wait_idle();
+
+    uint32_t get_thread_count() const { return (uint32_t)_workers.size(); }
+    void get_stats(std::vector<WorkerStats>& stats);
+    void reset_stats();
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+        std::thread thread;
+        WorkerStats stats;
+    };
+
+    void worker_main(uint32_t index);
+    bool pop(uint32_t index, Job& job);
+    bool steal(uint32_t index, Job& job);
+    void run(uint32_t index, Job& job, bool stolen);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::mutex _wake_mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    std::atomic<uint32_t> _pending{ 0 };
+    std::atomic<uint32_t> _next_worker{ 0 };
+    std::atomic<bool> _quit{ false };
+};
@@ -0,0 +1,329 @@
+#include "memory_allocator.h"
+
+#include <Windows.h>
+
+#include <iterator>
+#include <sstream>
+
+void MemoryAllocator::initialise(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties, VkDeviceSize block_size)
+{
+    _device = device;
+    _memory_properties = memory_properties;
+    _block_size = block_size;
+}
+
+void MemoryAllocator::destroy()
+{
+    for (std::unique_ptr<Block>& block : _blocks)
+    {
+        if (block->mapped)
+        {
+            vkUnmapMemory(_device, block->memory);
+        }
+
+        vkFreeMemory(_device, block->memory, nullptr);
+    }
+
+    _blocks.clear();
+    _block_lookup.clear();
+}
+
+bool MemoryAllocator::allocate(uint32_t memory_type_index, const VkMemoryRequirements& requirements, bool linear, VkDeviceMemory& memory,
+                               VkDeviceSize& offset)
+{
+    VkDeviceSize heap_size = _memory_properties.memoryHeaps[_memory_properties.memoryTypes[memory_type_index].heapIndex].size;
+    VkDeviceSize block_size = min(_block_size, heap_size / 8);
+
+    // Big resources (render targets, the texture array) get a block of their own rather than eating most of a shared one
+    if (requirements.size > block_size / 2)
+    {
+        Block* block = create_block(memory_type_index, requirements.size, linear, true);
+
+        if (!block || !block->allocate(requirements.size, requirements.alignment, offset))
+        {
+            return false;
+        }
+
+        memory = block->memory;
+        return true;
+    }
+
+    for (std::unique_ptr<Block>& block : _blocks)
+    {
+        if (block->memory_type_index == memory_type_index && block->linear == linear && !block->dedicated &&
+            block->allocate(requirements.size, requirements.alignment, offset))
+        {
+            memory = block->memory;
+            return true;
+        }
+    }
+
+    Block* block = create_block(memory_type_index, block_size, linear, false);
+
+    if (!block || !block->allocate(requirements.size, requirements.alignment, offset))
+    {
+        return false;
+    }
+
+    memory = block->memory;
+    return true;
+}
+
+void MemoryAllocator::free(VkDeviceMemory memory, VkDeviceSize offset)
+{
+    std::map<VkDeviceMemory, Block*>::iterator it = _block_lookup.find(memory);
+
+    if (it == _block_lookup.end())
+    {
+        return;
+    }
+
+    Block* block = it->second;
+    block->free(offset);
+
+    if (!block->allocations.empty())
+    {
+        return;
+    }
+
+    // Keep one empty shared block per pool around so a chunk boundary crossing doesn't free and reallocate a block
+    if (!block->dedicated)
+    {
+        for (std::unique_ptr<Block>& other : _blocks)
+        {
+            if (other.get() != block && other->memory_type_index == block->memory_type_index && other->linear == block->linear &&
+                !other->dedicated && other->allocations.empty())
+            {
+                destroy_block(block);
+                return;
+            }
+        }
+
+        return;
+    }
+
+    destroy_block(block);
+}
+
+void* MemoryAllocator::get_mapped_pointer(VkDeviceMemory memory, VkDeviceSize offset) const
+{
+    std::map<VkDeviceMemory, Block*>::const_iterator it = _block_lookup.find(memory);
+
+    if (it == _block_lookup.end() || !it->second->mapped)
+    {
+        return nullptr;
+    }
+
+    return it->second->mapped + offset;
+}
+
+void MemoryAllocator::get_stats(uint32_t memory_type_index, Stats& stats) const
+{
+    stats = Stats();
+    VkDeviceSize total_free = 0;
+
+    for (const std::unique_ptr<Block>& block : _blocks)
+    {
+        if (block->memory_type_index != memory_type_index)
+        {
+            continue;
+        }
+
+        stats.block_count++;
+        stats.allocation_count += (uint32_t)block->allocations.size();
+        stats.free_range_count += (uint32_t)block->free_ranges.size();
+        stats.reserved += block->size;
+
+        for (const std::pair<const VkDeviceSize, VkDeviceSize>& range : block->free_ranges)
+        {
+            total_free += range.second;
+            stats.largest_free = max(stats.largest_free, range.second);
+        }
+    }
+
+    stats.used = stats.reserved - total_free;
+    stats.fragmentation = total_free ? 1.0f - (float)((double)stats.largest_free / (double)total_free) : 0.0f;
+}
+
+void MemoryAllocator::log_stats() const
+{
+    std::stringstream ss;
+    ss << "gpu memory: " << _blocks.size() << " device allocations" << std::endl;
+
+    for (uint32_t i = 0; i < _memory_properties.memoryTypeCount; ++i)
+    {
+        Stats stats;
+        get_stats(i, stats);
+
+        if (stats.block_count == 0)
+        {
+            continue;
+        }
+
+        ss << "    type " << i << " (flags 0x" << std::hex << _memory_properties.memoryTypes[i].propertyFlags << std::dec << "): ";
+        ss << stats.allocation_count << " allocations in " << stats.block_count << " blocks, ";
+        ss << (stats.used >> 10) << " / " << (stats.reserved >> 10) << " KB used, ";
+        ss << stats.free_range_count << " free ranges, largest " << (stats.largest_free >> 10) << " KB, ";
+        ss << "fragmentation " << (int)(stats.fragmentation * 100.0f) << "%" << std::endl;
+    }
+
+    OutputDebugStringA(ss.str().c_str());
+}
+
+MemoryAllocator::Block* MemoryAllocator::create_block(uint32_t memory_type_index, VkDeviceSize size, bool linear, bool dedicated)
+{
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+
+    VkDeviceMemory memory;
+
+    if (vkAllocateMemory(_device, &alloc_info, nullptr, &memory) != VK_SUCCESS)
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<Block> block(new Block());
+    block->memory = memory;
+    block->size = size;
+    block->memory_type_index = memory_type_index;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    block->add_free_range(0, size);
+
+    if (_memory_properties.memoryTypes[memory_type_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        if (vkMapMemory(_device, memory, 0, VK_WHOLE_SIZE, 0, (void**)&block->mapped) != VK_SUCCESS)
+        {
+            vkFreeMemory(_device, memory, nullptr);
+            return nullptr;
+        }
+    }
+
+    Block* result = block.get();
+    _block_lookup[memory] = result;
+    _blocks.push_back(std::move(block));
+    return result;
+}
+
+void MemoryAllocator::destroy_block(Block* block)
+{
+    if (block->mapped)
+    {
+        vkUnmapMemory(_device, block->memory);
+    }
+
+    vkFreeMemory(_device, block->memory, nullptr);
+    _block_lookup.erase(block->memory);
+
+    for (std::vector<std::unique_ptr<Block>>::iterator it = _blocks.begin(); it != _blocks.end(); ++it)
+    {
+        if (it->get() == block)
+        {
+            _blocks.erase(it);
+            break;
+        }
+    }
+}
+
+bool MemoryAllocator::Block::allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+{
+    if (alignment == 0)
+    {
+        alignment = 1;
+    }
+
+    // Smallest range that fits once aligned
+    for (std::multimap<VkDeviceSize, VkDeviceSize>::iterator it = free_by_size.lower_bound(size); it != free_by_size.end(); ++it)
+    {
+        VkDeviceSize range_offset = it->second;
+        VkDeviceSize range_size = it->first;
+        VkDeviceSize aligned = (range_offset + alignment - 1) & ~(alignment - 1);
+
+        if (aligned + size > range_offset + range_size)
+        {
+            continue;
+        }
+
+        remove_free_range(range_offset, range_size);
+
+        if (aligned > range_offset)
+        {
+            add_free_range(range_offset, aligned - range_offset);
+        }
+
+        if (aligned + size < range_offset + range_size)
+        {
+            add_free_range(aligned + size, range_offset + range_size - (aligned + size));
+        }
+
+        allocations[aligned] = size;
+        offset = aligned;
+        return true;
+    }
+
+    return false;
+}
+
+void MemoryAllocator::Block::free(VkDeviceSize offset)
+{
+    std::map<VkDeviceSize, VkDeviceSize>::iterator allocation = allocations.find(offset);
+
+    if (allocation == allocations.end())
+    {
+        return;
+    }
+
+    VkDeviceSize size = allocation->second;
+    allocations.erase(allocation);
+
+    // Coalesce with the free ranges either side
+    std::map<VkDeviceSize, VkDeviceSize>::iterator next = free_ranges.lower_bound(offset);
+
+    if (next != free_ranges.begin())
+    {
+        std::map<VkDeviceSize, VkDeviceSize>::iterator prev = std::prev(next);
+
+        if (prev->first + prev->second == offset)
+        {
+            VkDeviceSize prev_offset = prev->first;
+            offset = prev_offset;
+            size += prev->second;
+            remove_free_range(prev_offset, prev->second);
+        }
+    }
+
+    next = free_ranges.lower_bound(offset + size);
+
+    if (next != free_ranges.end() && next->first == offset + size)
+    {
+        size += next->second;
+        remove_free_range(next->first, next->second);
+    }
+
+    add_free_range(offset, size);
+}
+
+void MemoryAllocator::Block::add_free_range(VkDeviceSize offset, VkDeviceSize size)
+{
+    free_ranges[offset] = size;
+    free_by_size.insert(std::make_pair(size, offset));
+}
+
+void MemoryAllocator::Block::remove_free_range(VkDeviceSize offset, VkDeviceSize size)
+{
+    free_ranges.erase(offset);
+
+    std::pair<std::multimap<VkDeviceSize, VkDeviceSize>::iterator, std::multimap<VkDeviceSize, VkDeviceSize>::iterator> range =
+            free_by_size.equal_range(size);
+
+    for (std::multimap<VkDeviceSize, VkDeviceSize>::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == offset)
+        {
+            free_by_size.erase(it);
+            break;
+        }
+    }
+}
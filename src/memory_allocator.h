@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Sub-allocates buffers and images out of large VkDeviceMemory blocks. Each memory type has its own list of blocks, split again
+// into linear (buffers) and optimal (images) pools so neighbouring resources never violate bufferImageGranularity. Free space in a
+// block is tracked as ranges that coalesce on free; allocation is best fit. Host visible blocks are mapped once, for their lifetime.
+class MemoryAllocator
+{
+public:
+    struct Stats
+    {
+        uint32_t block_count = 0;
+        uint32_t allocation_count = 0;
+        uint32_t free_range_count = 0;
+        VkDeviceSize reserved = 0;     // bytes of VkDeviceMemory allocated from the driver
+        VkDeviceSize used = 0;         // bytes handed out, including alignment padding
+        VkDeviceSize largest_free = 0;
+        float fragmentation = 0.0f;    // 1 - largest free range / total free, 0 when all free space is contiguous
+    };
+
+    void initialise(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties, VkDeviceSize block_size);
+    void destroy();
+
+    bool allocate(uint32_t memory_type_index, const VkMemoryRequirements& requirements, bool linear, VkDeviceMemory& memory,
+                  VkDeviceSize& offset);
+    void free(VkDeviceMemory memory, VkDeviceSize offset);
+
+    // Returns nullptr if the memory isn't host visible
+    void* get_mapped_pointer(VkDeviceMemory memory, VkDeviceSize offset) const;
+
+    void get_stats(uint32_t memory_type_index, Stats& stats) const;
+    uint32_t get_device_allocation_count() const { return (uint32_t)_blocks.size(); }
+    void log_stats() const;
+
+private:
+    struct Block
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        uint32_t memory_type_index = 0;
+        bool linear = true;
+        bool dedicated = false;
+        uint8_t* mapped = nullptr;
+
+        std::map<VkDeviceSize, VkDeviceSize> free_ranges;        // offset -> size
+        std::multimap<VkDeviceSize, VkDeviceSize> free_by_size; // size -> offset, for best fit
+        std::map<VkDeviceSize, VkDeviceSize> allocations;        // offset -> size
+
+        bool allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+        void free(VkDeviceSize offset);
+        void add_free_range(VkDeviceSize offset, VkDeviceSize size);
+        void remove_free_range(VkDeviceSize offset, VkDeviceSize size);
+    };
+
+    Block* create_block(uint32_t memory_type_index, VkDeviceSize size, bool linear, bool dedicated);
+    void destroy_block(Block* block);
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties _memory_properties = {};
+    VkDeviceSize _block_size = 0;
+    std::vector<std::unique_ptr<Block>> _blocks;
+    std::map<VkDeviceMemory, Block*> _block_lookup;
+};
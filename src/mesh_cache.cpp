@@ -1,35 +1,305 @@
 #include "mesh_cache.h"
 
-RenderMesh::RenderMesh(VkDevice device)
-    : device(device)
+#include <Windows.h>
+
+#include <sstream>
+
+#include "upload_queue.h"
+#include "vulkan.h"
+#include "vulkan_device.h"
+
+void RangeAllocator::reset(uint32_t size)
 {
+    _free_ranges.clear();
+    _free_by_size.clear();
+    _size = size;
+    _free = 0;
+
+    if (size)
+    {
+        add_free_range(0, size);
+    }
 }
 
-RenderMesh::RenderMesh(RenderMesh&& other)
+bool RangeAllocator::allocate(uint32_t size, uint32_t& offset)
 {
-    device = other.device;
-    index_buffer = other.index_buffer;
-    vertex_buffer = other.vertex_buffer;
-    index_count = other.index_count;
-    memory = other.memory;
-    _aabb = other._aabb;
-    memset(&other, 0, sizeof(RenderMesh));
+    std::multimap<uint32_t, uint32_t>::iterator it = _free_by_size.lower_bound(size);
+
+    if (it == _free_by_size.end())
+    {
+        return false;
+    }
+
+    uint32_t range_offset = it->second;
+    uint32_t range_size = it->first;
+    remove_free_range(range_offset, range_size);
+
+    if (size < range_size)
+    {
+        add_free_range(range_offset + size, range_size - size);
+    }
+
+    offset = range_offset;
+    return true;
 }
 
-RenderMesh::~RenderMesh()
+void RangeAllocator::free(uint32_t offset, uint32_t size)
+{
+    // Coalesce with the free ranges either side
+    std::map<uint32_t, uint32_t>::iterator next = _free_ranges.lower_bound(offset);
+
+    if (next != _free_ranges.begin())
+    {
+        std::map<uint32_t, uint32_t>::iterator prev = std::prev(next);
+
+        if (prev->first + prev->second == offset)
+        {
+            uint32_t prev_offset = prev->first;
+            uint32_t prev_size = prev->second;
+            offset = prev_offset;
+            size += prev_size;
+            remove_free_range(prev_offset, prev_size);
+        }
+    }
+
+    next = _free_ranges.lower_bound(offset + size);
+
+    if (next != _free_ranges.end() && next->first == offset + size)
+    {
+        uint32_t next_offset = next->first;
+        uint32_t next_size = next->second;
+        size += next_size;
+        remove_free_range(next_offset, next_size);
+    }
+
+    add_free_range(offset, size);
+}
+
+void RangeAllocator::add_free_range(uint32_t offset, uint32_t size)
 {
-    if (index_buffer)
+    _free_ranges[offset] = size;
+    _free_by_size.insert(std::make_pair(size, offset));
+    _free += size;
+}
+
+void RangeAllocator::remove_free_range(uint32_t offset, uint32_t size)
+{
+    _free_ranges.erase(offset);
+    _free -= size;
+
+    std::pair<std::multimap<uint32_t, uint32_t>::iterator, std::multimap<uint32_t, uint32_t>::iterator> range = _free_by_size.equal_range(size);
+
+    for (std::multimap<uint32_t, uint32_t>::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == offset)
+        {
+            _free_by_size.erase(it);
+            break;
+        }
+    }
+}
+
+bool MeshCache::create(VulkanDevice& device, UploadQueue& upload_queue, uint32_t pool_vertex_count, uint32_t pool_index_count)
+{
+    _device = &device;
+    _upload_queue = &upload_queue;
+    _pool_vertex_count = pool_vertex_count;
+    _pool_index_count = pool_index_count;
+
+    // Start with one pool so the common case never allocates device memory mid-game
+    return create_pool(pool_vertex_count, pool_index_count) != nullptr;
+}
+
+void MeshCache::destroy()
+{
+    for (std::unique_ptr<Pool>& pool : _pools)
+    {
+        destroy_pool(*pool);
+    }
+
+    _pools.clear();
+}
+
+bool MeshCache::upload(const SectionGeometry& geometry, Allocation& allocation)
+{
+    uint32_t vertex_count = (uint32_t)geometry.vertices.size();
+    uint32_t index_count = (uint32_t)geometry.indices.size();
+    Pool* pool = nullptr;
+    uint32_t pool_index = 0;
+
+    for (; pool_index < (uint32_t)_pools.size(); ++pool_index)
     {
-        vkDestroyBuffer(device, index_buffer, nullptr);
+        Pool& candidate = *_pools[pool_index];
+
+        if (candidate.vertices.allocate(vertex_count, allocation.first_vertex))
+        {
+            if (candidate.indices.allocate(index_count, allocation.first_index))
+            {
+                pool = &candidate;
+                break;
+            }
+
+            candidate.vertices.free(allocation.first_vertex, vertex_count);
+        }
     }
 
-    if (vertex_buffer)
+    if (!pool)
+    {
+        pool = create_pool(max(vertex_count, _pool_vertex_count), max(index_count, _pool_index_count));
+
+        if (!pool || !pool->vertices.allocate(vertex_count, allocation.first_vertex) || !pool->indices.allocate(index_count, allocation.first_index))
+        {
+            return false;
+        }
+
+        pool_index = (uint32_t)_pools.size() - 1;
+    }
+
+    allocation.pool = pool_index;
+    allocation.vertex_count = vertex_count;
+    allocation.index_count = index_count;
+
+    VkDeviceSize vertex_data_size = sizeof(geometry.vertices[0]) * vertex_count;
+    VkDeviceSize index_data_size = sizeof(geometry.indices[0]) * index_count;
+
+    if (!_upload_queue->copy_to_buffer(pool->vertex_buffer, allocation.first_vertex * sizeof(geometry.vertices[0]), geometry.vertices.data(),
+                                       vertex_data_size) ||
+        !_upload_queue->copy_to_buffer(pool->index_buffer, allocation.first_index * sizeof(geometry.indices[0]), geometry.indices.data(),
+                                       index_data_size))
     {
-        vkDestroyBuffer(device, vertex_buffer, nullptr);
+        free(allocation);
+        return false;
     }
 
-    if (memory)
+    return true;
+}
+
+void MeshCache::free(Allocation& allocation)
+{
+    if (allocation.pool >= _pools.size())
+    {
+        return;
+    }
+
+    Pool& pool = *_pools[allocation.pool];
+    pool.vertices.free(allocation.first_vertex, allocation.vertex_count);
+    pool.indices.free(allocation.first_index, allocation.index_count);
+    allocation.pool = UINT32_MAX;
+}
+
+void MeshCache::log_stats() const
+{
+    std::stringstream ss;
+    ss << "mesh cache: " << _pools.size() << " pools" << std::endl;
+
+    for (size_t i = 0; i < _pools.size(); ++i)
+    {
+        const Pool& pool = *_pools[i];
+        ss << "    pool " << i << ": vertices " << ((pool.vertices.get_size() - pool.vertices.get_free()) * sizeof(ChunkVertex) >> 10) << " / ";
+        ss << (pool.vertices.get_size() * sizeof(ChunkVertex) >> 10) << " KB (" << pool.vertices.get_free_range_count() << " free ranges), ";
+        ss << "indices " << ((pool.indices.get_size() - pool.indices.get_free()) * sizeof(uint32_t) >> 10) << " / ";
+        ss << (pool.indices.get_size() * sizeof(uint32_t) >> 10) << " KB (" << pool.indices.get_free_range_count() << " free ranges)" << std::endl;
+    }
+
+    OutputDebugStringA(ss.str().c_str());
+}
+
+bool MeshCache::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& memory, VkDeviceSize& offset)
+{
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size = size;
+    create_info.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    _upload_queue->set_sharing_mode(create_info);
+    VK_CHECK_RESULT(vkCreateBuffer((VkDevice)*_device, &create_info, nullptr, &buffer));
+
+    VkMemoryRequirements memory_requirements;
+    vkGetBufferMemoryRequirements((VkDevice)*_device, buffer, &memory_requirements);
+
+    if (!_device->allocate_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_requirements, memory, offset))
+    {
+        return false;
+    }
+
+    VK_CHECK_RESULT(vkBindBufferMemory((VkDevice)*_device, buffer, memory, offset));
+
+    return true;
+}
+
+MeshCache::Pool* MeshCache::create_pool(uint32_t vertex_count, uint32_t index_count)
+{
+    std::unique_ptr<Pool> pool(new Pool());
+
+    if (!create_buffer(vertex_count * sizeof(ChunkVertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, pool->vertex_buffer, pool->vertex_memory,
+                       pool->vertex_memory_offset) ||
+        !create_buffer(index_count * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, pool->index_buffer, pool->index_memory,
+                       pool->index_memory_offset))
+    {
+        destroy_pool(*pool);
+        return nullptr;
+    }
+
+    pool->vertices.reset(vertex_count);
+    pool->indices.reset(index_count);
+
+    Pool* result = pool.get();
+    _pools.push_back(std::move(pool));
+    return result;
+}
+
+void MeshCache::destroy_pool(Pool& pool)
+{
+    if (pool.vertex_buffer)
+    {
+        vkDestroyBuffer((VkDevice)*_device, pool.vertex_buffer, nullptr);
+    }
+
+    if (pool.index_buffer)
+    {
+        vkDestroyBuffer((VkDevice)*_device, pool.index_buffer, nullptr);
+    }
+
+    if (pool.vertex_memory)
+    {
+        _device->free_memory(pool.vertex_memory, pool.vertex_memory_offset);
+    }
+
+    if (pool.index_memory)
+    {
+        _device->free_memory(pool.index_memory, pool.index_memory_offset);
+    }
+
+    pool = Pool();
+}
+
+RenderMesh::RenderMesh(MeshCache& cache)
+    : cache(&cache)
+{
+}
+
+RenderMesh::RenderMesh(RenderMesh&& other)
+{
+    cache = other.cache;
+    upload_batch = other.upload_batch;
+    _aabb = other._aabb;
+    sections = std::move(other.sections);
+    allocations = std::move(other.allocations);
+    connectivity = std::move(other.connectivity);
+    occluders = std::move(other.occluders);
+    origin = other.origin;
+    face_count = other.face_count;
+    vertex_count = other.vertex_count;
+    index_count = other.index_count;
+    visit_serial = other.visit_serial;
+    reachable_sections = other.reachable_sections;
+
+    other.allocations.clear();
+}
+
+RenderMesh::~RenderMesh()
+{
+    for (MeshCache::Allocation& allocation : allocations)
     {
-        vkFreeMemory(device, memory, nullptr);
+        cache->free(allocation);
     }
 }
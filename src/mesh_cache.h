@@ -1,26 +1,113 @@
 #pragma once
 
+#include <map>
+#include <memory>
 #include <vulkan/vulkan.h>
 
 #include "geometry.h"
 #include "world.h"
 
+class UploadQueue;
+class VulkanDevice;
+
+// Hands out ranges of a fixed size space, best fit, coalescing neighbouring free ranges on free
+class RangeAllocator
+{
+public:
+    void reset(uint32_t size);
+
+    bool allocate(uint32_t size, uint32_t& offset);
+    void free(uint32_t offset, uint32_t size);
+
+    uint32_t get_size() const { return _size; }
+    uint32_t get_free() const { return _free; }
+    uint32_t get_largest_free() const { return _free_by_size.empty() ? 0 : _free_by_size.rbegin()->first; }
+    uint32_t get_free_range_count() const { return (uint32_t)_free_ranges.size(); }
+
+private:
+    void add_free_range(uint32_t offset, uint32_t size);
+    void remove_free_range(uint32_t offset, uint32_t size);
+
+    std::map<uint32_t, uint32_t> _free_ranges;        // offset -> size
+    std::multimap<uint32_t, uint32_t> _free_by_size; // size -> offset
+    uint32_t _size = 0;
+    uint32_t _free = 0;
+};
+
+// Chunk geometry lives in a few large pools, each a vertex buffer and an index buffer, so a frame binds the buffers once per pool
+// and draws every visible section out of them. Each section of a mesh gets a range of whole vertices and indices in one pool, so
+// a remeshed section can be swapped without touching the rest; indices stay relative to the section and are rebased with the
+// draw's vertex offset. A new pool is created when no existing one has room.
+class MeshCache
+{
+public:
+    struct Allocation
+    {
+        uint32_t pool = UINT32_MAX;
+        uint32_t first_vertex = 0;
+        uint32_t vertex_count = 0;
+        uint32_t first_index = 0;
+        uint32_t index_count = 0;
+    };
+
+    ~MeshCache() { destroy(); }
+
+    bool create(VulkanDevice& device, UploadQueue& upload_queue, uint32_t pool_vertex_count, uint32_t pool_index_count);
+    void destroy();
+
+    // Reserves space for one of a mesh's sections and queues the copies on the upload queue
+    bool upload(const SectionGeometry& geometry, Allocation& allocation);
+    void free(Allocation& allocation);
+
+    uint32_t get_pool_count() const { return (uint32_t)_pools.size(); }
+    VkBuffer get_vertex_buffer(uint32_t pool) const { return _pools[pool]->vertex_buffer; }
+    VkBuffer get_index_buffer(uint32_t pool) const { return _pools[pool]->index_buffer; }
+
+    void log_stats() const;
+
+private:
+    struct Pool
+    {
+        VkBuffer vertex_buffer = VK_NULL_HANDLE;
+        VkBuffer index_buffer = VK_NULL_HANDLE;
+        VkDeviceMemory vertex_memory = VK_NULL_HANDLE;
+        VkDeviceMemory index_memory = VK_NULL_HANDLE;
+        VkDeviceSize vertex_memory_offset = 0;
+        VkDeviceSize index_memory_offset = 0;
+        RangeAllocator vertices;
+        RangeAllocator indices;
+    };
+
+    bool create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& memory, VkDeviceSize& offset);
+    Pool* create_pool(uint32_t vertex_count, uint32_t index_count);
+    void destroy_pool(Pool& pool);
+
+    VulkanDevice* _device = nullptr;
+    UploadQueue* _upload_queue = nullptr;
+    uint32_t _pool_vertex_count = 0;
+    uint32_t _pool_index_count = 0;
+    std::vector<std::unique_ptr<Pool>> _pools;
+};
+
 class RenderMesh
 {
 public:
-    RenderMesh(VkDevice device);
+    RenderMesh(MeshCache& cache);
     RenderMesh(RenderMesh&& other);
     ~RenderMesh();
 
-    VkDevice device = VK_NULL_HANDLE;
-    VkBuffer vertex_buffer = VK_NULL_HANDLE;
-    VkBuffer index_buffer = VK_NULL_HANDLE;
-    VkDeviceMemory memory = VK_NULL_HANDLE;
-    uint32_t index_count = 0;
+    MeshCache* cache = nullptr;
+    uint64_t upload_batch = 0; // not drawn until the UploadQueue has completed this batch
 
     geometry::aabb _aabb;
+    std::vector<MeshSection> sections;
+    std::vector<MeshCache::Allocation> allocations; // one per entry of sections
+    std::vector<uint16_t> connectivity; // per vertical section, see Mesh::connectivity
+    std::vector<geometry::aabb> occluders;
+    glm::vec4 origin;
+    uint32_t face_count = 0;   // summed over sections, kept up to date as section updates are applied
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+    uint64_t visit_serial = 0; // last occlusion traversal that reached the mesh
+    uint16_t reachable_sections = 0; // vertical sections that traversal reached, one bit each
 };
-
-class MeshCache
-{
-};
\ No newline at end of file
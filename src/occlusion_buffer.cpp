@@ -0,0 +1,260 @@
+#include "occlusion_buffer.h"
+
+#include <Windows.h>
+
+#include <glm/common.hpp>
+#include <glm/vec4.hpp>
+
+#include <algorithm>
+#include <float.h>
+#include <immintrin.h>
+#include <stdio.h>
+
+// Corners closer to the eye than this project too far off screen to be useful
+static const float min_depth = 0.01f;
+
+static float cross(const glm::vec3& o, const glm::vec3& a, const glm::vec3& b)
+{
+    return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+OcclusionBuffer::OcclusionBuffer()
+    : _depth(width * height, FLT_MAX)
+{
+}
+
+void OcclusionBuffer::clear(const glm::mat4x4& view_proj)
+{
+    _view_proj = view_proj;
+    std::fill(_depth.begin(), _depth.end(), FLT_MAX);
+}
+
+bool OcclusionBuffer::project(const geometry::aabb& box, glm::vec3 (&points)[8]) const
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        glm::vec3 corner = box.center;
+        corner.x += (i & 1) ? box.extents.x : -box.extents.x;
+        corner.y += (i & 2) ? box.extents.y : -box.extents.y;
+        corner.z += (i & 4) ? box.extents.z : -box.extents.z;
+
+        glm::vec4 clip = _view_proj * glm::vec4(corner, 1.0f);
+
+        if (clip.w < min_depth)
+        {
+            return false;
+        }
+
+        points[i] = glm::vec3((clip.x / clip.w * 0.5f + 0.5f) * width, (clip.y / clip.w * 0.5f + 0.5f) * height, clip.w);
+    }
+
+    return true;
+}
+
+bool OcclusionBuffer::draw_occluder(const geometry::aabb& box)
+{
+    glm::vec3 points[8];
+
+    if (!project(box, points))
+    {
+        return false;
+    }
+
+    float depth = 0.0f;
+
+    for (const glm::vec3& p : points)
+    {
+        depth = max(depth, p.z);
+    }
+
+    // Silhouette is the convex hull of the corners, built counter clockwise with a monotone chain
+    std::sort(points, points + 8, [](const glm::vec3& a, const glm::vec3& b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+
+    glm::vec3 hull[16];
+    int hull_size = 0;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        while (hull_size >= 2 && cross(hull[hull_size - 2], hull[hull_size - 1], points[i]) <= 0.0f)
+        {
+            hull_size--;
+        }
+
+        hull[hull_size++] = points[i];
+    }
+
+    for (int i = 6, lower_size = hull_size + 1; i >= 0; --i)
+    {
+        while (hull_size >= lower_size && cross(hull[hull_size - 2], hull[hull_size - 1], points[i]) <= 0.0f)
+        {
+            hull_size--;
+        }
+
+        hull[hull_size++] = points[i];
+    }
+
+    // The first point is repeated at the end
+    hull_size--;
+
+    if (hull_size < 3)
+    {
+        return false;
+    }
+
+    float min_x = FLT_MAX, max_x = -FLT_MAX, min_y = FLT_MAX, max_y = -FLT_MAX;
+
+    for (int i = 0; i < hull_size; ++i)
+    {
+        min_x = min(min_x, hull[i].x);
+        max_x = max(max_x, hull[i].x);
+        min_y = min(min_y, hull[i].y);
+        max_y = max(max_y, hull[i].y);
+    }
+
+    int x0 = max((int)floor(min_x), 0) & ~3;
+    int x1 = min((int)ceil(max_x), width) - 1;
+    int y0 = max((int)floor(min_y), 0);
+    int y1 = min((int)ceil(max_y), height) - 1;
+
+    if (x0 > x1 || y0 > y1)
+    {
+        return false;
+    }
+
+    // Edge functions a * x + b * y + c, non-negative inside. Offsetting c by half the pixel's extent along the edge normal
+    // makes the test at the pixel centre pass only for pixels wholly inside the edge.
+    __m128 edge_a[8];
+    float edge_b[8];
+    float edge_c[8];
+
+    for (int i = 0; i < hull_size; ++i)
+    {
+        const glm::vec3& p0 = hull[i];
+        const glm::vec3& p1 = hull[(i + 1) % hull_size];
+        float a = p0.y - p1.y;
+        float b = p1.x - p0.x;
+        edge_a[i] = _mm_set1_ps(a);
+        edge_b[i] = b;
+        edge_c[i] = -a * p0.x - b * p0.y - 0.5f * (fabs(a) + fabs(b));
+    }
+
+    __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 occluder_depth = _mm_set1_ps(depth);
+
+    for (int y = y0; y <= y1; ++y)
+    {
+        float* row = &_depth[y * width];
+        __m128 edge_row[8];
+
+        for (int i = 0; i < hull_size; ++i)
+        {
+            edge_row[i] = _mm_set1_ps(edge_b[i] * ((float)y + 0.5f) + edge_c[i]);
+        }
+
+        for (int x = x0; x <= x1; x += 4)
+        {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+            for (int i = 0; i < hull_size; ++i)
+            {
+                __m128 e = _mm_add_ps(_mm_mul_ps(edge_a[i], px), edge_row[i]);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(e, _mm_setzero_ps()));
+            }
+
+            __m128 d = _mm_loadu_ps(row + x);
+            d = _mm_or_ps(_mm_and_ps(inside, _mm_min_ps(d, occluder_depth)), _mm_andnot_ps(inside, d));
+            _mm_storeu_ps(row + x, d);
+        }
+    }
+
+    return true;
+}
+
+bool OcclusionBuffer::is_occluded(const geometry::aabb& box) const
+{
+    glm::vec3 points[8];
+
+    if (!project(box, points))
+    {
+        return false;
+    }
+
+    float min_x = FLT_MAX, max_x = -FLT_MAX, min_y = FLT_MAX, max_y = -FLT_MAX;
+    float depth = FLT_MAX;
+
+    for (const glm::vec3& p : points)
+    {
+        min_x = min(min_x, p.x);
+        max_x = max(max_x, p.x);
+        min_y = min(min_y, p.y);
+        max_y = max(max_y, p.y);
+        depth = min(depth, p.z);
+    }
+
+    // Every pixel the bounds touch
+    int x0 = max((int)floor(min_x), 0);
+    int x1 = min((int)ceil(max_x), width) - 1;
+    int y0 = max((int)floor(min_y), 0);
+    int y1 = min((int)ceil(max_y), height) - 1;
+
+    if (x0 > x1 || y0 > y1)
+    {
+        return false;
+    }
+
+    __m128 lane_offsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 first = _mm_set1_ps((float)x0);
+    __m128 last = _mm_set1_ps((float)x1);
+    __m128 box_depth = _mm_set1_ps(depth);
+
+    for (int y = y0; y <= y1; ++y)
+    {
+        const float* row = &_depth[y * width];
+
+        for (int x = x0 & ~3; x <= x1; x += 4)
+        {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+            __m128 in_bounds = _mm_and_ps(_mm_cmpge_ps(px, first), _mm_cmple_ps(px, last));
+            __m128 visible = _mm_and_ps(in_bounds, _mm_cmpge_ps(_mm_loadu_ps(row + x), box_depth));
+
+            if (_mm_movemask_ps(visible))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool OcclusionBuffer::dump(const std::wstring& path) const
+{
+    FILE* fp = nullptr;
+    _wfopen_s(&fp, path.c_str(), L"wb");
+
+    if (!fp)
+    {
+        return false;
+    }
+
+    float far_depth = 0.0f;
+
+    for (float d : _depth)
+    {
+        far_depth = (d < FLT_MAX) ? max(far_depth, d) : far_depth;
+    }
+
+    std::vector<uint8_t> pixels(_depth.size());
+
+    for (size_t i = 0; i < _depth.size(); ++i)
+    {
+        pixels[i] = (_depth[i] < FLT_MAX) ? (uint8_t)(255.0f - 223.0f * (_depth[i] / far_depth)) : 0;
+    }
+
+    fprintf(fp, "P5\n%d %d\n255\n", width, height);
+    bool written = fwrite(pixels.data(), 1, pixels.size(), fp) == pixels.size();
+    fclose(fp);
+
+    return written;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+
+#include <string>
+#include <vector>
+
+#include "culling.h"
+
+// Low resolution software depth buffer for occlusion culling. Occluder boxes, which must lie wholly inside opaque blocks, are
+// rasterised as their screen space silhouette at the depth of their farthest corner, and only into pixels they cover completely.
+// Boxes tested against the buffer use their nearest corner over every pixel their bounds touch, so both sides are conservative
+// and a box is only reported occluded if it is certainly hidden. Depth is the clip space w, i.e. the distance along the view axis.
+class OcclusionBuffer
+{
+public:
+    static const int width = 256;
+    static const int height = 128;
+
+    OcclusionBuffer();
+
+    void clear(const glm::mat4x4& view_proj);
+
+    // Returns false if the box isn't drawn because it crosses the near plane or is off screen
+    bool draw_occluder(const geometry::aabb& box);
+    bool is_occluded(const geometry::aabb& box) const;
+
+    // Writes the buffer as a binary PGM, near is white and uncovered pixels are black
+    bool dump(const std::wstring& path) const;
+
+private:
+    // Projects the box's corners to pixel coordinates, false if any corner is too close to or behind the eye
+    bool project(const geometry::aabb& box, glm::vec3 (&points)[8]) const;
+
+    glm::mat4x4 _view_proj;
+    std::vector<float> _depth;
+};
@@ -0,0 +1,348 @@
+#include "region_file.h"
+
+#include <sstream>
+
+#include "world.h"
+
+static const uint32_t region_magic = 0x47524356; // "VCRG"
+static const uint32_t region_version = 1;
+
+bool RegionFile::open(const std::wstring& path)
+{
+    close();
+
+    _file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (_file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    const uint32_t header_bytes = header_sectors * sector_size;
+    LARGE_INTEGER size;
+    bool created = false;
+
+    if (!GetFileSizeEx(_file, &size))
+    {
+        close();
+        return false;
+    }
+
+    if (size.QuadPart < header_bytes)
+    {
+        if (size.QuadPart != 0)
+        {
+            // Truncated header, leave the file alone rather than overwrite whatever it is
+            close();
+            return false;
+        }
+
+        LARGE_INTEGER end;
+        end.QuadPart = header_bytes;
+
+        if (!SetFilePointerEx(_file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(_file))
+        {
+            close();
+            return false;
+        }
+
+        created = true;
+    }
+
+    _mapping = CreateFileMappingW(_file, nullptr, PAGE_READWRITE, 0, header_bytes, nullptr);
+
+    if (!_mapping)
+    {
+        close();
+        return false;
+    }
+
+    _header = (Header*)MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, header_bytes);
+
+    if (!_header)
+    {
+        close();
+        return false;
+    }
+
+    if (created)
+    {
+        // The new file is zero filled, so every entry starts out empty
+        _header->magic = region_magic;
+        _header->version = region_version;
+        _header->sector_count = header_sectors;
+    }
+    else if (_header->magic != region_magic || _header->version != region_version || _header->sector_count < header_sectors)
+    {
+        close();
+        return false;
+    }
+
+    _used_sectors.assign(_header->sector_count, false);
+
+    for (uint32_t i = 0; i < header_sectors; ++i)
+    {
+        _used_sectors[i] = true;
+    }
+
+    for (Entry& entry : _header->entries)
+    {
+        if (entry.sector == 0)
+        {
+            continue;
+        }
+
+        uint32_t count = (entry.length + sector_size - 1) / sector_size;
+
+        if (entry.sector < header_sectors || entry.length == 0 || count > _header->sector_count - entry.sector)
+        {
+            // Points outside the file, forget the chunk so it is regenerated
+            entry.sector = 0;
+            entry.length = 0;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            _used_sectors[entry.sector + i] = true;
+        }
+    }
+
+    return true;
+}
+
+void RegionFile::close()
+{
+    if (_header)
+    {
+        FlushViewOfFile(_header, 0);
+        UnmapViewOfFile(_header);
+        _header = nullptr;
+    }
+
+    if (_mapping)
+    {
+        CloseHandle(_mapping);
+        _mapping = nullptr;
+    }
+
+    if (_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_file);
+        _file = INVALID_HANDLE_VALUE;
+    }
+
+    _used_sectors.clear();
+}
+
+bool RegionFile::read(int x, int z, std::vector<uint8_t>& payload)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_header)
+    {
+        return false;
+    }
+
+    const Entry& entry = _header->entries[x + z * region_size];
+
+    if (entry.sector == 0)
+    {
+        return false;
+    }
+
+    payload.resize(entry.length);
+
+    OVERLAPPED overlapped = {};
+    uint64_t offset = (uint64_t)entry.sector * sector_size;
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    DWORD bytes_read = 0;
+    return ReadFile(_file, payload.data(), entry.length, &bytes_read, &overlapped) && bytes_read == entry.length;
+}
+
+bool RegionFile::write(int x, int z, const std::vector<uint8_t>& payload)
+{
+    uint32_t length = (uint32_t)payload.size();
+    uint32_t count = (length + sector_size - 1) / sector_size;
+    uint32_t first;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (!_header || payload.empty())
+        {
+            return false;
+        }
+
+        first = allocate_sectors(count);
+    }
+
+    // The sectors are ours now, so the write and the flush don't hold up reads and writes of other chunks in the region
+    OVERLAPPED overlapped = {};
+    uint64_t offset = (uint64_t)first * sector_size;
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    DWORD bytes_written = 0;
+
+    // The index is mapped and may reach the disk at any time, so the payload has to get there first
+    if (!WriteFile(_file, payload.data(), length, &bytes_written, &overlapped) || bytes_written != length || !FlushFileBuffers(_file))
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        free_sectors(first, count);
+        return false;
+    }
+
+    Entry previous;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Entry& entry = _header->entries[x + z * region_size];
+        previous = entry;
+        entry.sector = first;
+        entry.length = length;
+    }
+
+    if (!previous.sector)
+    {
+        return true;
+    }
+
+    // Until the switched index is on disk the previous copy is the one a crash would come back to, so its sectors can't be
+    // handed out again before then. If the flush fails they stay reserved until the file is next opened.
+    if (FlushViewOfFile(_header, 0))
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        free_sectors(previous.sector, (previous.length + sector_size - 1) / sector_size);
+    }
+
+    return true;
+}
+
+uint32_t RegionFile::allocate_sectors(uint32_t count)
+{
+    // First fit, otherwise grow the file
+    uint32_t run = 0;
+
+    for (uint32_t i = header_sectors; i < (uint32_t)_used_sectors.size(); ++i)
+    {
+        run = _used_sectors[i] ? 0 : run + 1;
+
+        if (run == count)
+        {
+            uint32_t first = i + 1 - count;
+
+            for (uint32_t j = first; j <= i; ++j)
+            {
+                _used_sectors[j] = true;
+            }
+
+            return first;
+        }
+    }
+
+    uint32_t first = (uint32_t)_used_sectors.size();
+    _used_sectors.resize(first + count, true);
+    _header->sector_count = first + count;
+    return first;
+}
+
+void RegionFile::free_sectors(uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        _used_sectors[i] = false;
+    }
+}
+
+static int floor_div(int value, int divisor)
+{
+    return (value >= 0) ? value / divisor : (value - divisor + 1) / divisor;
+}
+
+std::shared_ptr<RegionFile> ChunkStore::get_region(int chunk_x, int chunk_z, int& local_x, int& local_z)
+{
+    int region_x = floor_div(chunk_x, RegionFile::region_size);
+    int region_z = floor_div(chunk_z, RegionFile::region_size);
+    local_x = chunk_x - region_x * RegionFile::region_size;
+    local_z = chunk_z - region_z * RegionFile::region_size;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint64_t key = world::ChunkMap::key(region_x, region_z);
+    auto it = _regions.find(key);
+
+    if (it != _regions.end())
+    {
+        it->second.last_used = ++_use_serial;
+        return it->second.file;
+    }
+
+    close_unused_regions();
+
+    if (!_directory_created)
+    {
+        CreateDirectoryW(_directory.c_str(), nullptr);
+        _directory_created = true;
+    }
+
+    std::wstring path = _directory + L"\\r." + std::to_wstring(region_x) + L"." + std::to_wstring(region_z) + L".region";
+    std::shared_ptr<RegionFile> region = std::make_shared<RegionFile>();
+
+    if (!region->open(path))
+    {
+        // Remember the failure so chunks in this region are just regenerated, rather than retrying every load
+        std::stringstream ss;
+        ss << "region (" << region_x << ", " << region_z << "): failed to open, chunks will not be saved" << std::endl;
+        OutputDebugStringA(ss.str().c_str());
+        region.reset();
+    }
+
+    OpenRegion& open_region = _regions[key];
+    open_region.file = region;
+    open_region.last_used = ++_use_serial;
+    return region;
+}
+
+void ChunkStore::close_unused_regions()
+{
+    // Makes room for one more region. Regions a job is still reading or writing are skipped, only _regions can hand out new
+    // references and that needs _mutex, which the caller holds.
+    while (_regions.size() >= max_open_regions)
+    {
+        auto oldest = _regions.end();
+
+        for (auto it = _regions.begin(); it != _regions.end(); ++it)
+        {
+            bool in_use = it->second.file && it->second.file.use_count() > 1;
+
+            if (!in_use && (oldest == _regions.end() || it->second.last_used < oldest->second.last_used))
+            {
+                oldest = it;
+            }
+        }
+
+        if (oldest == _regions.end())
+        {
+            return;
+        }
+
+        // Failed regions are forgotten too, so they are retried if the player comes back
+        _regions.erase(oldest);
+    }
+}
+
+bool ChunkStore::load(int chunk_x, int chunk_z, std::vector<uint8_t>& payload)
+{
+    int x, z;
+    std::shared_ptr<RegionFile> region = get_region(chunk_x, chunk_z, x, z);
+    return region && region->read(x, z, payload);
+}
+
+bool ChunkStore::save(int chunk_x, int chunk_z, const std::vector<uint8_t>& payload)
+{
+    int x, z;
+    std::shared_ptr<RegionFile> region = get_region(chunk_x, chunk_z, x, z);
+    return region && region->write(x, z, payload);
+}
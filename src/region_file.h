@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Stores the chunks of one region_size x region_size region in a single file. The file starts with a fixed size header holding
+// an index entry per chunk, which stays mapped into memory while the file is open, followed by the chunk payloads in whole
+// sectors. A payload is always written to free sectors and flushed to disk before its index entry is switched over, and the
+// previous copy's sectors are only reused once the switched index has been flushed too, so an interrupted write or a crash
+// leaves one intact copy of the chunk.
+class RegionFile
+{
+public:
+    static const int region_size = 32;
+    static const uint32_t sector_size = 4096;
+
+    ~RegionFile() { close(); }
+
+    bool open(const std::wstring& path);
+    void close();
+
+    // Coordinates are local to the region. read() returns false if the chunk has never been written.
+    bool read(int x, int z, std::vector<uint8_t>& payload);
+    bool write(int x, int z, const std::vector<uint8_t>& payload);
+
+private:
+    struct Entry
+    {
+        uint32_t sector; // first sector of the payload, 0 if the chunk isn't stored
+        uint32_t length; // payload bytes
+    };
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sector_count; // sectors in use by the file, including the header
+        uint32_t reserved;
+        Entry entries[region_size * region_size];
+    };
+
+    static const uint32_t header_sectors = (sizeof(Header) + sector_size - 1) / sector_size;
+
+    uint32_t allocate_sectors(uint32_t count);
+    void free_sectors(uint32_t first, uint32_t count);
+
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+    Header* _header = nullptr;
+    std::vector<bool> _used_sectors;
+    std::mutex _mutex;
+};
+
+// Persists chunk payloads to region files under a directory, opening regions as they are first needed and closing the least
+// recently used ones beyond max_open_regions, so a long flight doesn't accumulate file handles and mappings. Safe to call from any
+// thread; reads and writes to the same region are serialised, different regions proceed in parallel.
+class ChunkStore
+{
+public:
+    // The resident chunks only ever span a few regions, the rest are closed once nothing is reading or writing them
+    static const size_t max_open_regions = 8;
+
+    void set_directory(const std::wstring& directory) { _directory = directory; }
+
+    bool load(int chunk_x, int chunk_z, std::vector<uint8_t>& payload);
+    bool save(int chunk_x, int chunk_z, const std::vector<uint8_t>& payload);
+
+private:
+    struct OpenRegion
+    {
+        std::shared_ptr<RegionFile> file; // null if the region failed to open
+        uint64_t last_used;
+    };
+
+    // The region stays open for as long as the caller holds on to it
+    std::shared_ptr<RegionFile> get_region(int chunk_x, int chunk_z, int& local_x, int& local_z);
+    void close_unused_regions();
+
+    std::wstring _directory = L"world";
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, OpenRegion> _regions;
+    uint64_t _use_serial = 0;
+    bool _directory_created = false;
+};
@@ -69,6 +69,7 @@ bool RenderPass::create()
     create_info.pSubpasses = &subpass;
 
     VK_CHECK_RESULT(vkCreateRenderPass((VkDevice)*_device, &create_info, nullptr, &_render_pass));
+    _colour_format = colour_buffer.format;
 
     return true;
 }
@@ -80,4 +81,6 @@ void RenderPass::invalidate()
         vkDestroyRenderPass((VkDevice)*_device, _render_pass, nullptr);
         _render_pass = VK_NULL_HANDLE;
     }
+
+    _colour_format = VK_FORMAT_UNDEFINED;
 }
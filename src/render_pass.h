@@ -17,9 +17,13 @@ public:
 
     explicit operator VkRenderPass() { return _render_pass; }
 
+    // Format of the swapchain images the pass was created for, VK_FORMAT_UNDEFINED before it is created
+    VkFormat get_colour_format() const { return _colour_format; }
+
 private:
     VulkanDevice* _device = nullptr;
     Swapchain* _swapchain = nullptr;
     DepthBuffer* _depth_buffer = nullptr;
     VkRenderPass _render_pass = VK_NULL_HANDLE;
+    VkFormat _colour_format = VK_FORMAT_UNDEFINED;
 };
\ No newline at end of file
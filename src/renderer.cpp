@@ -3,15 +3,25 @@
 #include <Windows.h>
 
 #include <GLFW/glfw3.h>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <intrin.h>
 #include <sstream>
 #include <vector>
 
 #include "geometry.h"
+#include "job_system.h"
 #include "mesh_cache.h"
 #include "vulkan.h"
+#include "world.h"
 
-bool Renderer::initialise(GLFWwindow* window)
+// Pipeline cache data from the last run, reused so startup skips shader compilation after the first launch
+static const wchar_t* pipeline_cache_path = L"pipeline_cache.bin";
+
+bool Renderer::initialise(GLFWwindow* window, uint32_t frames_in_flight, JobSystem* jobs)
 {
     _window = window;
 
@@ -30,12 +40,7 @@ bool Renderer::initialise(GLFWwindow* window)
         return false;
     }
 
-    if (!create_semaphores())
-    {
-        return false;
-    }
-
-    if (!_device.create_command_pool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, _command_pool))
+    if (!create_frames(min(max(frames_in_flight, 1u), 3u)))
     {
         return false;
     }
@@ -57,6 +62,11 @@ bool Renderer::initialise(GLFWwindow* window)
 
     _graphics_pipeline_factory.initialise(_device, _swapchain, _render_pass, 0);
 
+    if (!_graphics_pipeline_factory.load_pipeline_cache(pipeline_cache_path))
+    {
+        return false;
+    }
+
     _vertex_shader = _shader_cache.load(L"res/shaders/triangle.vert.spv");
     _fragment_shader = _shader_cache.load(L"res/shaders/triangle.frag.spv");
 
@@ -68,7 +78,7 @@ bool Renderer::initialise(GLFWwindow* window)
     _graphics_pipeline_factory.set_shader(VK_SHADER_STAGE_VERTEX_BIT, _vertex_shader, "main");
     _graphics_pipeline_factory.set_shader(VK_SHADER_STAGE_FRAGMENT_BIT, _fragment_shader, "main");
 
-    if (!_textures.create(_device, L"res/textures"))
+    if (!_textures.create(_device, L"res/textures", jobs))
     {
         return false;
     }
@@ -83,21 +93,69 @@ bool Renderer::initialise(GLFWwindow* window)
         return false;
     }
 
-    if (!create_ubo())
+    if (!create_descriptor_sets())
     {
         return false;
     }
 
-    if (!create_descriptor_set())
+    std::chrono::high_resolution_clock::time_point upload_start = std::chrono::high_resolution_clock::now();
+
+    if (!_device.upload_texture(_textures))
     {
         return false;
     }
 
-    if (!_device.upload_texture(_textures))
+    const TextureArray::LoadStats& texture_stats = _textures.get_load_stats();
+    std::stringstream texture_ss;
+    texture_ss << "textures: " << _textures._layer_count << " layers on " << texture_stats.threads << " threads, decode "
+               << texture_stats.decode_ms << " ms, copy " << texture_stats.copy_ms << " ms (" << texture_stats.wall_ms << " ms wall), upload "
+               << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - upload_start).count() << " ms"
+               << std::endl;
+    OutputDebugStringA(texture_ss.str().c_str());
+
+    if (!_upload_queue.create(_device, 32 * 1024 * 1024))
+    {
+        return false;
+    }
+
+    // 32MB of vertices and 24MB of indices per pool, both meshers emit six indices per four vertices
+    if (!_mesh_cache.create(_device, _upload_queue, 4 * 1024 * 1024, 6 * 1024 * 1024))
+    {
+        return false;
+    }
+
+    const VkPhysicalDeviceFeatures& features = _device.get_features();
+
+    if (features.drawIndirectFirstInstance)
+    {
+        _draw_mode = features.multiDrawIndirect ? DrawMode::MultiDrawIndirect : DrawMode::Indirect;
+    }
+
+    std::stringstream ss;
+    static const char* draw_mode_names[] = { "multi draw indirect", "indirect", "direct" };
+    ss << "chunk draws: " << draw_mode_names[(int)_draw_mode] << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+
+    // The culling pass relies on multi draw indirect to draw a pool's survivors with one call
+    _gpu_culling_supported = _draw_mode == DrawMode::MultiDrawIndirect && (_device.get_graphics_queue_flags() & VK_QUEUE_COMPUTE_BIT) != 0;
+
+    if (_gpu_culling_supported)
+    {
+        _cull_shader = _shader_cache.load(L"res/shaders/cull.comp.spv");
+        _gpu_culling_supported = _cull_shader && _gpu_culler.create(_device, _cull_shader, _graphics_pipeline_factory.get_pipeline_cache());
+    }
+
+    if (_gpu_culling_supported && !_gpu_culler.create_frames((uint32_t)_frames.size()))
     {
         return false;
     }
 
+    ss.str("");
+    ss << "gpu culling: " << (_gpu_culling_supported ? (_device.supports_draw_indirect_count() ? "compacted draw count" : "zero instance count")
+                                                      : "unsupported")
+       << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+
     _valid_state = true;
 
     return true;
@@ -107,10 +165,19 @@ void Renderer::shutdown()
 {
     invalidate();
 
+    _gpu_culler.destroy();
     _textures.destroy();
-    _ubo_buffer.destroy();
+    _layer_map.destroy();
+    destroy_frames();
     _graphics_pipeline.destroy();
 
+    if (!_graphics_pipeline_factory.save_pipeline_cache(pipeline_cache_path))
+    {
+        OutputDebugStringA("pipeline cache: failed to save\n");
+    }
+
+    _graphics_pipeline_factory.destroy();
+
     if (_descriptor_pool)
     {
         vkDestroyDescriptorPool((VkDevice)_device, _descriptor_pool, nullptr);
@@ -122,23 +189,25 @@ void Renderer::shutdown()
     }
 
     _meshes.clear();
+    _mesh_tree.clear();
+    _column_meshes.clear();
+    _retired_meshes.clear();
+    _replaced_meshes.clear();
+    _section_updates.clear();
+    _mesh_cache.destroy();
+    _upload_queue.destroy();
 
     _depth_buffer.destroy();
     _swapchain.destroy();
 
-    if (_command_pool)
-    {
-        vkDestroyCommandPool((VkDevice)_device, _command_pool, nullptr);
-    }
+    _shader_cache.release(_vertex_shader);
+    _shader_cache.release(_fragment_shader);
 
-    if (_drawing_complete_semaphore)
+    if (_cull_shader)
     {
-        vkDestroySemaphore((VkDevice)_device, _drawing_complete_semaphore, nullptr);
+        _shader_cache.release(_cull_shader);
     }
 
-    _shader_cache.release(_vertex_shader);
-    _shader_cache.release(_fragment_shader);
-
     _device.destroy();
 
     if (_surface)
@@ -161,141 +230,397 @@ void Renderer::shutdown()
 
 bool Renderer::set_window_size(uint32_t width, uint32_t height)
 {
-    invalidate();
+    // Minimised, keep the targets and skip drawing until the window is restored
+    if (!width || !height)
+    {
+        _valid_state = false;
+        return true;
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-    if (width && height)
+    // Frames already submitted may still be rendering to the old targets, they are destroyed as those frames complete rather than
+    // waiting for the device to go idle
+    RetiredTargets retired;
+    retired.serial = _frame_serial;
+
+    if (!_swapchain.create(&width, &height, true, &retired.swapchain))
     {
-        if (!_swapchain.create(&width, &height, true))
-        {
-            return false;
-        }
+        return false;
+    }
 
-        uint32_t swapchain_image_count = (uint32_t)_swapchain.get_image_views().size();
+    retired.frame_buffers = std::move(_frame_buffers);
+    _frame_buffers.clear();
+    _depth_buffer.retire(retired.depth_image, retired.depth_image_view);
+    _retired_targets.push_back(std::move(retired));
 
-        if (!create_command_buffers(swapchain_image_count))
+    // With dynamic viewport and scissor the render pass and pipeline only depend on the image format, so they are only built by
+    // the first call or when the window moves to a display with another surface format
+    bool rebuilt = false;
+
+    if (_render_pass.get_colour_format() != _swapchain.get_image_format())
+    {
+        invalidate();
+
+        if (!_render_pass.create())
         {
             return false;
         }
 
-        if (!create_fences(swapchain_image_count))
+        if (!_graphics_pipeline.create())
         {
             return false;
         }
 
-        if (!_depth_buffer.create())
+        rebuilt = true;
+    }
+
+    if (!_depth_buffer.create())
+    {
+        return false;
+    }
+
+    if (!create_frame_buffers())
+    {
+        return false;
+    }
+
+    _valid_state = true;
+
+    std::stringstream ss;
+    ss << "window size: " << width << "x" << height << " in "
+       << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms"
+       << (rebuilt ? ", render pass and pipeline rebuilt" : "") << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+
+    return true;
+}
+
+// Sums the counts shown by log_memory_stats over the mesh's sections
+static void count_mesh(RenderMesh& mesh)
+{
+    mesh.face_count = 0;
+    mesh.vertex_count = 0;
+    mesh.index_count = 0;
+
+    for (const MeshSection& section : mesh.sections)
+    {
+        mesh.face_count += section.face_count;
+        mesh.vertex_count += section.vertex_count;
+        mesh.index_count += section.index_count;
+    }
+}
+
+bool Renderer::add_mesh(const Mesh& mesh, uint32_t& mesh_id)
+{
+    if (!upload_mesh(mesh, mesh_id))
+    {
+        return false;
+    }
+
+    if (mesh_id != 0)
+    {
+        int chunk_x, chunk_z;
+        world_to_chunk(mesh.origin.x, mesh.origin.z, chunk_x, chunk_z);
+        _column_meshes[world::ChunkMap::key(chunk_x, chunk_z)] = mesh_id;
+    }
+
+    return true;
+}
+
+bool Renderer::replace_mesh(uint32_t old_id, const Mesh& mesh, uint32_t& mesh_id)
+{
+    if (old_id == 0)
+    {
+        return add_mesh(mesh, mesh_id);
+    }
+
+    if (!upload_mesh(mesh, mesh_id) || mesh_id == 0)
+    {
+        remove_mesh(old_id);
+        return mesh_id == 0;
+    }
+
+    for (std::pair<uint32_t, uint32_t>& replaced : _replaced_meshes)
+    {
+        if (replaced.second == old_id)
         {
-            return false;
+            // old_id was never drawn, keep drawing the mesh it was replacing instead
+            replaced.second = mesh_id;
+            remove_mesh(old_id);
+            return true;
         }
+    }
 
-        if (!_render_pass.create())
+    _replaced_meshes.emplace_back(old_id, mesh_id);
+    return true;
+}
+
+bool Renderer::upload_mesh(const Mesh& mesh, uint32_t& mesh_id)
+{
+    mesh_id = 0;
+
+    // Only sections with faces are stored
+    if (mesh.sections.empty())
+    {
+        return true;
+    }
+
+    RenderMesh render_mesh(_mesh_cache);
+    render_mesh.allocations.resize(mesh.sections.size());
+
+    for (size_t i = 0; i < mesh.sections.size(); ++i)
+    {
+        if (!_mesh_cache.upload(mesh.geometry[i], render_mesh.allocations[i]))
         {
             return false;
         }
+    }
 
-        if (!_graphics_pipeline.create())
+    // Copies are batched and submitted by draw_frame, the mesh is skipped until its batch has completed
+    render_mesh.upload_batch = _upload_queue.get_pending_batch();
+
+    render_mesh._aabb = mesh.aabb;
+    render_mesh.sections = mesh.sections;
+    render_mesh.connectivity = mesh.connectivity;
+    render_mesh.occluders = mesh.occluders;
+    render_mesh.origin = mesh.origin;
+    count_mesh(render_mesh);
+
+    mesh_id = _next_mesh_id++;
+    int chunk_x, chunk_z;
+    world_to_chunk(mesh.origin.x, mesh.origin.z, chunk_x, chunk_z);
+    _mesh_tree.insert(chunk_x, chunk_z, mesh_id, mesh.aabb);
+    _meshes.emplace(mesh_id, std::move(render_mesh));
+
+    return true;
+}
+
+bool Renderer::update_mesh(uint32_t mesh_id, const Mesh& mesh, uint16_t sections)
+{
+    std::unordered_map<uint32_t, RenderMesh>::iterator it = _meshes.find(mesh_id);
+
+    if (it == _meshes.end())
+    {
+        return false;
+    }
+
+    RenderMesh& render_mesh = it->second;
+    uint64_t upload_batch = _upload_queue.get_pending_batch();
+
+    for (uint32_t section = 0; section < Chunk::section_count; ++section)
+    {
+        if (!(sections & (1 << section)))
         {
-            return false;
+            continue;
         }
 
-        if (!create_frame_buffers())
+        // A section left without faces is queued too, so its old range is dropped in order
+        SectionUpdate update = {};
+        update.mesh_id = mesh_id;
+        update.section = section;
+        update.upload_batch = upload_batch;
+
+        for (size_t i = 0; i < mesh.sections.size(); ++i)
         {
-            return false;
+            if (mesh.sections[i].section == section)
+            {
+                if (!_mesh_cache.upload(mesh.geometry[i], update.allocation))
+                {
+                    return false;
+                }
+
+                update.mesh_section = mesh.sections[i];
+                update.has_faces = true;
+                break;
+            }
         }
 
-        _valid_state = true;
+        _section_updates.push_back(update);
     }
 
+    // The bounds cover the old and new sections until the chunk is next meshed whole
+    glm::vec3 mesh_min = glm::min(render_mesh._aabb.center - render_mesh._aabb.extents, mesh.aabb.center - mesh.aabb.extents);
+    glm::vec3 mesh_max = glm::max(render_mesh._aabb.center + render_mesh._aabb.extents, mesh.aabb.center + mesh.aabb.extents);
+    render_mesh._aabb.set_from_corners(mesh_min, mesh_max);
+    render_mesh.connectivity = mesh.connectivity;
+    render_mesh.occluders = mesh.occluders;
+
+    int chunk_x, chunk_z;
+    world_to_chunk(render_mesh.origin.x, render_mesh.origin.z, chunk_x, chunk_z);
+    _mesh_tree.remove(chunk_x, chunk_z, mesh_id);
+    _mesh_tree.insert(chunk_x, chunk_z, mesh_id, render_mesh._aabb);
+
     return true;
 }
 
-bool Renderer::add_mesh(const Mesh& mesh)
+void Renderer::apply_section_updates()
 {
-    uint32_t vertex_count = (uint32_t)mesh.vertices.size();
-
-    if (vertex_count == 0)
+    // Batches complete in order, so the updates do too
+    while (!_section_updates.empty() && _upload_queue.is_complete(_section_updates.front().upload_batch))
     {
-        return true;
+        SectionUpdate& update = _section_updates.front();
+        std::unordered_map<uint32_t, RenderMesh>::iterator it = _meshes.find(update.mesh_id);
+
+        if (it == _meshes.end())
+        {
+            // Removed since, the new range was never drawn
+            _mesh_cache.free(update.allocation);
+            _section_updates.pop_front();
+            continue;
+        }
+
+        RenderMesh& mesh = it->second;
+        size_t i = 0;
+
+        while (i < mesh.sections.size() && mesh.sections[i].section < update.section)
+        {
+            i++;
+        }
+
+        if (i < mesh.sections.size() && mesh.sections[i].section == update.section)
+        {
+            // Frames already submitted may still be drawing the old range
+            RenderMesh retired(_mesh_cache);
+            retired.allocations.push_back(mesh.allocations[i]);
+            _retired_meshes.emplace_back(_frame_serial, std::move(retired));
+
+            mesh.sections.erase(mesh.sections.begin() + i);
+            mesh.allocations.erase(mesh.allocations.begin() + i);
+        }
+
+        if (update.has_faces)
+        {
+            mesh.sections.insert(mesh.sections.begin() + i, update.mesh_section);
+            mesh.allocations.insert(mesh.allocations.begin() + i, update.allocation);
+        }
+
+        count_mesh(mesh);
+
+        _section_updates.pop_front();
     }
+}
 
-    RenderMesh render_mesh((VkDevice)_device);
-    render_mesh.index_count = (uint32_t)mesh.indices.size();
+void Renderer::remove_mesh(uint32_t mesh_id)
+{
+    std::unordered_map<uint32_t, RenderMesh>::iterator it = _meshes.find(mesh_id);
 
-    if (render_mesh.index_count == 0)
+    if (it == _meshes.end())
     {
-        return true;
+        return;
     }
 
-    VkBufferCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_info.size = vertex_count * sizeof(mesh.vertices[0]);
-    create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    VK_CHECK_RESULT(vkCreateBuffer((VkDevice)_device, &create_info, nullptr, &render_mesh.vertex_buffer));
+    int chunk_x, chunk_z;
+    world_to_chunk(it->second.origin.x, it->second.origin.z, chunk_x, chunk_z);
+    _mesh_tree.remove(chunk_x, chunk_z, mesh_id);
 
-    create_info.size = render_mesh.index_count * sizeof(mesh.indices[0]);
-    create_info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    VK_CHECK_RESULT(vkCreateBuffer((VkDevice)_device, &create_info, nullptr, &render_mesh.index_buffer));
+    // While a replacement is pending the column still maps to the mesh being replaced
+    std::unordered_map<uint64_t, uint32_t>::iterator column = _column_meshes.find(world::ChunkMap::key(chunk_x, chunk_z));
 
-    VkMemoryRequirements vertex_memory_requirements;
-    vkGetBufferMemoryRequirements((VkDevice)_device, render_mesh.vertex_buffer, &vertex_memory_requirements);
-
-    VkMemoryRequirements index_memory_requirements;
-    vkGetBufferMemoryRequirements((VkDevice)_device, render_mesh.index_buffer, &index_memory_requirements);
+    if (column != _column_meshes.end() && column->second == mesh_id)
+    {
+        _column_meshes.erase(column);
+    }
 
-    VkMemoryRequirements memory_requirements;
-    memory_requirements.alignment = max(vertex_memory_requirements.alignment, index_memory_requirements.alignment);
-    VkDeviceSize index_data_offset =
-            (vertex_memory_requirements.size + index_memory_requirements.alignment - 1) &
-            ~(index_memory_requirements.alignment - 1); // TODO: Fail on non-power of 2 alignments (like that would ever happen?)
-    memory_requirements.size = index_data_offset + index_memory_requirements.size;
-    memory_requirements.memoryTypeBits = vertex_memory_requirements.memoryTypeBits & index_memory_requirements.memoryTypeBits;
+    // Frames already submitted may still be drawing it, keep the buffers alive until they have completed
+    _retired_meshes.emplace_back(_frame_serial, std::move(it->second));
+    _meshes.erase(it);
 
-    if (memory_requirements.memoryTypeBits == 0)
+    for (size_t i = 0; i < _replaced_meshes.size(); ++i)
     {
-        return false;
+        if (_replaced_meshes[i].second == mesh_id)
+        {
+            // The caller only knows the replacement's id, so removing it removes the mesh it was replacing too
+            uint32_t old_id = _replaced_meshes[i].first;
+            _replaced_meshes.erase(_replaced_meshes.begin() + i);
+            remove_mesh(old_id);
+            break;
+        }
     }
+}
 
-    VulkanBuffer staging_buffer;
-    if (!staging_buffer.create(_device, memory_requirements.size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+void Renderer::release_retired()
+{
+    for (const FrameData& frame : _frames)
     {
-        return false;
+        if (frame.fence_serial > _completed_frame_serial && vkGetFenceStatus((VkDevice)_device, frame.fence) == VK_SUCCESS)
+        {
+            // Frames are submitted to a single queue so they complete in order
+            _completed_frame_serial = frame.fence_serial;
+        }
     }
 
-    uint8_t* memory;
+    // Also wait for the upload, a mesh can be removed before its copies have been submitted
+    while (!_retired_meshes.empty() && _retired_meshes.front().first <= _completed_frame_serial &&
+           _upload_queue.is_complete(_retired_meshes.front().second.upload_batch))
+    {
+        _retired_meshes.pop_front();
+    }
 
-    if (!staging_buffer.map((void**)&memory))
+    while (!_retired_targets.empty() && _retired_targets.front().serial <= _completed_frame_serial)
     {
-        return false;
+        destroy_targets(_retired_targets.front());
+        _retired_targets.pop_front();
     }
+}
 
-    memcpy(memory, mesh.vertices.data(), sizeof(mesh.vertices[0]) * mesh.vertices.size());
-    memcpy(memory + index_data_offset, mesh.indices.data(), sizeof(mesh.indices[0]) * mesh.indices.size());
-    staging_buffer.unmap();
+void Renderer::destroy_targets(RetiredTargets& targets)
+{
+    for (VkFramebuffer framebuffer : targets.frame_buffers)
+    {
+        vkDestroyFramebuffer((VkDevice)_device, framebuffer, nullptr);
+    }
 
-    VkDeviceSize offset;
-    if (!_device.allocate_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_requirements, render_mesh.memory, offset))
+    if (targets.depth_image_view)
     {
-        return false;
+        vkDestroyImageView((VkDevice)_device, targets.depth_image_view, nullptr);
     }
 
-    VK_CHECK_RESULT(vkBindBufferMemory((VkDevice)_device, render_mesh.vertex_buffer, render_mesh.memory, offset));
-    VK_CHECK_RESULT(vkBindBufferMemory((VkDevice)_device, render_mesh.index_buffer, render_mesh.memory, offset + index_data_offset));
+    targets.depth_image.destroy();
+    _swapchain.destroy(targets.swapchain);
+}
 
-    if (!_device.copy_buffer(staging_buffer, render_mesh.vertex_buffer, 0, 0, vertex_memory_requirements.size) ||
-        !_device.copy_buffer(staging_buffer, render_mesh.index_buffer, index_data_offset, 0, index_memory_requirements.size))
+void Renderer::apply_mesh_replacements()
+{
+    size_t kept = 0;
+
+    for (const std::pair<uint32_t, uint32_t>& replaced : _replaced_meshes)
     {
-        return false;
+        const RenderMesh& mesh = _meshes.at(replaced.second);
+
+        if (!_upload_queue.is_complete(mesh.upload_batch))
+        {
+            _replaced_meshes[kept++] = replaced;
+            continue;
+        }
+
+        // Retired by frame serial like any removed mesh, this frame is the first to draw the replacement instead
+        int chunk_x, chunk_z;
+        world_to_chunk(mesh.origin.x, mesh.origin.z, chunk_x, chunk_z);
+        remove_mesh(replaced.first);
+        _column_meshes[world::ChunkMap::key(chunk_x, chunk_z)] = replaced.second;
     }
 
-    render_mesh._aabb = mesh.aabb;
+    _replaced_meshes.resize(kept);
+}
 
-    staging_buffer.destroy();
+void Renderer::clear_meshes()
+{
+    // Queued copies may target these meshes' buffers
+    _upload_queue.wait_idle();
+    vkDeviceWaitIdle((VkDevice)_device);
+    _meshes.clear();
+    _mesh_tree.clear();
+    _column_meshes.clear();
+    _retired_meshes.clear();
+    _replaced_meshes.clear();
 
-    _meshes.push_back(std::move(render_mesh));
+    for (SectionUpdate& update : _section_updates)
+    {
+        _mesh_cache.free(update.allocation);
+    }
 
-    return true;
+    _section_updates.clear();
 }
 
 geometry::frustum _clip_frustum;
@@ -308,7 +633,26 @@ bool Renderer::draw_frame()
         return true;
     }
 
-    if (!_swapchain.begin_frame())
+    if (!_upload_queue.flush() || !_upload_queue.update())
+    {
+        return false;
+    }
+
+    // Wait for the GPU to finish the last frame that used these resources, the frames submitted since keep it busy while this one
+    // is recorded
+    uint32_t frame_index = _frame_index;
+    FrameData& frame = _frames[frame_index];
+    VK_CHECK_RESULT(vkWaitForFences((VkDevice)_device, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+    release_retired();
+    apply_mesh_replacements();
+    apply_section_updates();
+
+    if (_gpu_culling_supported)
+    {
+        _gpu_culler.verify(frame_index);
+    }
+
+    if (!_swapchain.begin_frame(frame.image_acquired_semaphore))
     {
         return false;
     }
@@ -316,23 +660,55 @@ bool Renderer::draw_frame()
     uint32_t swapchain_image_index = _swapchain.get_acquired_image_index();
 
     void* data;
-    if (!_ubo_buffer.map(&data))
+    if (!frame.ubo.map(&data))
     {
         return false;
     }
     memcpy(data, &_ubo_data, sizeof(UBO));
-    _ubo_buffer.unmap();
+    frame.ubo.unmap();
 
-    VkFence frame_fence = _frame_fences[swapchain_image_index];
-    VK_CHECK_RESULT(vkWaitForFences((VkDevice)_device, 1, &frame_fence, VK_TRUE, UINT64_MAX));
-    VK_CHECK_RESULT(vkResetFences((VkDevice)_device, 1, &frame_fence));
+    if (UpdateClipFrustum)
+    {
+        _clip_frustum.set_from_matrix(_ubo_data.proj * _ubo_data.view * _ubo_data.model);
+    }
+
+    // On the GPU path every drawable section is a candidate for the culling pass
+    uint32_t draw_count = gather_section_draws(!_gpu_culling);
+    FrameDraws& frame_draws = frame.draws;
+
+    if (!reserve_frame_draws(frame_draws, draw_count))
+    {
+        return false;
+    }
 
-    VkCommandBuffer command_buffer = _command_buffers[swapchain_image_index];
+    VkDrawIndexedIndirectCommand* commands;
+    glm::vec4* origins;
+
+    if (!frame_draws.commands.map((void**)&commands) || !frame_draws.origins.map((void**)&origins))
+    {
+        return false;
+    }
+
+    // Resetting the pool recycles the command buffer's memory in one go
+    VK_CHECK_RESULT(vkResetCommandPool((VkDevice)_device, frame.command_pool, 0));
+
+    VkCommandBuffer command_buffer = frame.command_buffer;
     VkCommandBufferBeginInfo begin_info = {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     VK_CHECK_RESULT(vkBeginCommandBuffer(command_buffer, &begin_info));
 
+    if (_gpu_culling)
+    {
+        if (!write_gpu_candidates(frame_index, origins, draw_count))
+        {
+            return false;
+        }
+
+        // Dispatches can't be recorded inside a render pass
+        _gpu_culler.record(command_buffer, frame_index, _clip_frustum);
+    }
+
     VkClearValue clear_values[2];
     clear_values[0] = { 0.24f, 0.77f, 0.96f, 1.0f };
     clear_values[1] = { 1.0f, 0 };
@@ -348,36 +724,95 @@ bool Renderer::draw_frame()
     vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (VkPipeline)_graphics_pipeline);
 
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (VkPipelineLayout)_graphics_pipeline, 0, 1, &_descriptor_set, 0,
+    VkViewport viewport = {};
+    viewport.width = (float)_swapchain.get_extent().width;
+    viewport.height = (float)_swapchain.get_extent().height;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {};
+    scissor.extent = _swapchain.get_extent();
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (VkPipelineLayout)_graphics_pipeline, 0, 1, &frame.descriptor_set, 0,
                             nullptr);
 
-    if (UpdateClipFrustum)
-    {
-        _clip_frustum.set_from_matrix(_ubo_data.proj * _ubo_data.view * _ubo_data.model);
-    }
+    uint32_t max_draw_count = _device.get_properties().limits.maxDrawIndirectCount;
+    uint32_t first_draw = 0;
 
-    for (const RenderMesh& mesh : _meshes)
+    for (uint32_t pool = 0; pool < (uint32_t)_pool_draws.size(); ++pool)
     {
-        if (culling::cull(_clip_frustum, mesh._aabb))
+        const std::vector<SectionDraw>& draws = _pool_draws[pool];
+        uint32_t count = (uint32_t)draws.size();
+
+        if (count == 0)
         {
             continue;
         }
 
-        VkDeviceSize offsets = 0;
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &mesh.vertex_buffer, &offsets);
-        vkCmdBindIndexBuffer(command_buffer, mesh.index_buffer, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(command_buffer, mesh.index_count, 1, 0, 0, 0);
+        VkBuffer vertex_buffers[2] = { _mesh_cache.get_vertex_buffer(pool), (VkBuffer)frame_draws.origins };
+        VkDeviceSize offsets[2] = { 0, 0 };
+        vkCmdBindVertexBuffers(command_buffer, 0, 2, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(command_buffer, _mesh_cache.get_index_buffer(pool), 0, VK_INDEX_TYPE_UINT32);
+
+        if (_gpu_culling)
+        {
+            _gpu_culler.draw(command_buffer, frame_index, pool, first_draw, count);
+            first_draw += count;
+            continue;
+        }
+
+        // firstInstance selects the draw's origin from the per instance origins binding
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            commands[first_draw + i] = draws[i].command;
+            commands[first_draw + i].firstInstance = first_draw + i;
+            origins[first_draw + i] = draws[i].origin;
+        }
+
+        VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+
+        switch (_draw_mode)
+        {
+            case DrawMode::MultiDrawIndirect:
+                for (uint32_t i = 0; i < count; i += max_draw_count)
+                {
+                    vkCmdDrawIndexedIndirect(command_buffer, frame_draws.commands, (first_draw + i) * stride, min(count - i, max_draw_count), (uint32_t)stride);
+                }
+                break;
+
+            case DrawMode::Indirect:
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    vkCmdDrawIndexedIndirect(command_buffer, frame_draws.commands, (first_draw + i) * stride, 1, (uint32_t)stride);
+                }
+                break;
+
+            case DrawMode::Direct:
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    const VkDrawIndexedIndirectCommand& command = commands[first_draw + i];
+                    vkCmdDrawIndexed(command_buffer, command.indexCount, 1, command.firstIndex, command.vertexOffset, command.firstInstance);
+                }
+                break;
+        }
+
+        first_draw += count;
     }
 
     vkCmdEndRenderPass(command_buffer);
 
     VK_CHECK_RESULT(vkEndCommandBuffer(command_buffer));
 
-    VkSemaphore image_acquired_semaphore = _swapchain.get_image_acquired_semaphore();
+    // Only reset once the submit is certain, an unsignalled fence that is never submitted would block this frame forever
+    VK_CHECK_RESULT(vkResetFences((VkDevice)_device, 1, &frame.fence));
+
     VkPipelineStageFlags wait_stage_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    _device.submit(command_buffer, 1, &image_acquired_semaphore, &wait_stage_mask, 1, &_drawing_complete_semaphore, frame_fence);
+    _device.submit(command_buffer, 1, &frame.image_acquired_semaphore, &wait_stage_mask, 1, &frame.drawing_complete_semaphore, frame.fence);
+    frame.fence_serial = ++_frame_serial;
+    _frame_index = (_frame_index + 1) % (uint32_t)_frames.size();
 
-    if (!_swapchain.end_frame(1, &_drawing_complete_semaphore))
+    if (!_swapchain.end_frame(1, &frame.drawing_complete_semaphore))
     {
         return false;
     }
@@ -398,36 +833,35 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(VkDebugReportFlagsEXT flags
 
 void Renderer::invalidate()
 {
-    if (_valid_state)
+    _valid_state = false;
+
+    if (!(VkDevice)_device)
     {
-        _valid_state = false;
+        return;
+    }
 
-        vkDeviceWaitIdle((VkDevice)_device);
+    _upload_queue.wait_idle();
+    vkDeviceWaitIdle((VkDevice)_device);
 
-        for (VkFence& fence : _frame_fences)
-        {
-            vkDestroyFence((VkDevice)_device, fence, nullptr);
-        }
+    _retired_meshes.clear();
 
-        _frame_fences.clear();
+    for (RetiredTargets& targets : _retired_targets)
+    {
+        destroy_targets(targets);
+    }
 
-        for (VkFramebuffer& framebuffer : _frame_buffers)
-        {
-            vkDestroyFramebuffer((VkDevice)_device, framebuffer, nullptr);
-        }
+    _retired_targets.clear();
 
-        _frame_buffers.clear();
+    for (VkFramebuffer& framebuffer : _frame_buffers)
+    {
+        vkDestroyFramebuffer((VkDevice)_device, framebuffer, nullptr);
+    }
 
-        if (_command_buffers.size())
-        {
-            vkFreeCommandBuffers((VkDevice)_device, _command_pool, (uint32_t)_command_buffers.size(), _command_buffers.data());
-            _command_buffers.clear();
-        }
+    _frame_buffers.clear();
 
-        _graphics_pipeline.invalidate();
-        _render_pass.invalidate();
-        _depth_buffer.invalidate();
-    }
+    _graphics_pipeline.invalidate();
+    _render_pass.invalidate();
+    _depth_buffer.invalidate();
 }
 
 bool Renderer::create_instance()
@@ -547,14 +981,6 @@ bool Renderer::create_device()
     return _device.create();
 }
 
-bool Renderer::create_semaphores()
-{
-    VkSemaphoreCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK_RESULT(vkCreateSemaphore((VkDevice)_device, &create_info, nullptr, &_drawing_complete_semaphore));
-    return true;
-}
-
 bool Renderer::create_frame_buffers()
 {
     VkFramebufferCreateInfo create_info = {};
@@ -578,49 +1004,534 @@ bool Renderer::create_frame_buffers()
     return true;
 }
 
-bool Renderer::create_command_buffers(uint32_t count)
+bool Renderer::create_frames(uint32_t count)
 {
-    _command_buffers.resize(count);
+    _frames.resize(count);
+
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    // Signalled so the first wait on each frame returns immediately
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (FrameData& frame : _frames)
+    {
+        // A pool per frame so each can be reset while the others are still executing
+        if (!_device.create_command_pool(VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, frame.command_pool))
+        {
+            return false;
+        }
+
+        VkCommandBufferAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = frame.command_pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+        VK_CHECK_RESULT(vkAllocateCommandBuffers((VkDevice)_device, &alloc_info, &frame.command_buffer));
+
+        VK_CHECK_RESULT(vkCreateSemaphore((VkDevice)_device, &semaphore_info, nullptr, &frame.image_acquired_semaphore));
+        VK_CHECK_RESULT(vkCreateSemaphore((VkDevice)_device, &semaphore_info, nullptr, &frame.drawing_complete_semaphore));
+        VK_CHECK_RESULT(vkCreateFence((VkDevice)_device, &fence_info, nullptr, &frame.fence));
+
+        if (!frame.ubo.create(_device, sizeof(UBO), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+        {
+            return false;
+        }
+    }
 
-    VkCommandBufferAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    alloc_info.commandPool = _command_pool;
-    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandBufferCount = count;
-    VK_CHECK_RESULT(vkAllocateCommandBuffers((VkDevice)_device, &alloc_info, _command_buffers.data()));
     return true;
 }
 
-bool Renderer::create_fences(uint32_t count)
+void Renderer::destroy_frames()
 {
-    _frame_fences.resize(count);
+    for (FrameData& frame : _frames)
+    {
+        if (frame.command_pool)
+        {
+            vkDestroyCommandPool((VkDevice)_device, frame.command_pool, nullptr);
+        }
+
+        if (frame.image_acquired_semaphore)
+        {
+            vkDestroySemaphore((VkDevice)_device, frame.image_acquired_semaphore, nullptr);
+        }
+
+        if (frame.drawing_complete_semaphore)
+        {
+            vkDestroySemaphore((VkDevice)_device, frame.drawing_complete_semaphore, nullptr);
+        }
 
-    VkFenceCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        if (frame.fence)
+        {
+            vkDestroyFence((VkDevice)_device, frame.fence, nullptr);
+        }
+    }
 
-    for (VkFence& fence : _frame_fences)
+    // Destroys the buffers, the descriptor sets go with the pool
+    _frames.clear();
+}
+
+bool Renderer::reserve_frame_draws(FrameDraws& frame_draws, uint32_t count)
+{
+    if (frame_draws.capacity && count <= frame_draws.capacity)
     {
-        VK_CHECK_RESULT(vkCreateFence((VkDevice)_device, &create_info, nullptr, &fence));
+        return true;
     }
 
+    // Only called once the frame's fence has signalled, so the GPU is done with the old buffers
+    uint32_t capacity = max(max(count, frame_draws.capacity * 2), 1024u);
+    frame_draws.commands.destroy();
+    frame_draws.origins.destroy();
+    frame_draws.capacity = 0;
+
+    VkMemoryPropertyFlags memory_properties = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+
+    if (!frame_draws.commands.create(_device, capacity * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, memory_properties) ||
+        !frame_draws.origins.create(_device, capacity * sizeof(glm::vec4), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, memory_properties))
+    {
+        return false;
+    }
+
+    frame_draws.capacity = capacity;
     return true;
 }
 
+// BlockFace bits of the directions that can face the eye somewhere in the box. A face is only seen from in front of the plane it
+// lies in and a section's faces all lie within its bounds, so e.g. no top face is visible from below the bounds.
+static uint32_t find_facing_directions(const geometry::aabb& box, const glm::vec3& eye)
+{
+    glm::vec3 min = box.center - box.extents;
+    glm::vec3 max = box.center + box.extents;
+    uint32_t faces = 0;
+    faces |= (eye.y > min.y) ? 1 << (int)BlockFace::Top : 0;
+    faces |= (eye.y < max.y) ? 1 << (int)BlockFace::Bottom : 0;
+    faces |= (eye.z < max.z) ? 1 << (int)BlockFace::North : 0;
+    faces |= (eye.z > min.z) ? 1 << (int)BlockFace::South : 0;
+    faces |= (eye.x > min.x) ? 1 << (int)BlockFace::East : 0;
+    faces |= (eye.x < max.x) ? 1 << (int)BlockFace::West : 0;
+    return faces;
+}
+
+uint32_t Renderer::gather_section_draws(bool cull)
+{
+    // Gather the visible sections per pool, each becomes one indexed draw
+    _pool_draws.resize(_mesh_cache.get_pool_count());
+    uint32_t draw_count = 0;
+
+    for (std::vector<SectionDraw>& draws : _pool_draws)
+    {
+        draws.clear();
+    }
+
+    _visible_meshes.clear();
+    _inside_meshes.clear();
+
+    // The traversal tests the frustum as it goes, so it only applies when culling on the CPU
+    bool occlusion = cull && _occlusion_culling && find_reachable_sections();
+
+    if (cull)
+    {
+        _mesh_tree.cull(_clip_frustum, _visible_meshes, _inside_meshes);
+    }
+    else
+    {
+        for (const std::pair<const uint32_t, RenderMesh>& entry : _meshes)
+        {
+            _inside_meshes.push_back(entry.first);
+        }
+    }
+
+    bool occlusion_buffer = cull && _occlusion_buffer_enabled;
+    _occlusion_stats = {};
+    _face_stats = {};
+
+    if (occlusion_buffer)
+    {
+        draw_occluders();
+    }
+
+    // Meshes wholly inside the frustum draw every section without testing them
+    for (int inside = 0; inside < 2; ++inside)
+    {
+        for (uint32_t mesh_id : inside ? _inside_meshes : _visible_meshes)
+        {
+            const RenderMesh& mesh = _meshes.at(mesh_id);
+
+            if (!_upload_queue.is_complete(mesh.upload_batch))
+            {
+                continue;
+            }
+
+            if (occlusion && mesh.visit_serial != _visit_serial)
+            {
+                continue;
+            }
+
+            if (occlusion_buffer)
+            {
+                _occlusion_stats.meshes_tested++;
+
+                if (_occlusion_buffer.is_occluded(mesh._aabb))
+                {
+                    _occlusion_stats.meshes_rejected++;
+                    continue;
+                }
+            }
+
+            for (size_t i = 0; i < mesh.sections.size(); ++i)
+            {
+                const MeshSection& section = mesh.sections[i];
+                const MeshCache::Allocation& allocation = mesh.allocations[i];
+
+                if (occlusion && !(mesh.reachable_sections & (1 << section.section)))
+                {
+                    continue;
+                }
+
+                if (!inside && culling::cull(_clip_frustum, section.aabb))
+                {
+                    continue;
+                }
+
+                if (occlusion_buffer && mesh.sections.size() > 1)
+                {
+                    _occlusion_stats.sections_tested++;
+
+                    if (_occlusion_buffer.is_occluded(section.aabb))
+                    {
+                        _occlusion_stats.sections_rejected++;
+                        continue;
+                    }
+                }
+
+                // Each run of adjacent directions facing the camera becomes one draw, empty directions don't break a run
+                uint32_t facing = _face_culling ? find_facing_directions(section.aabb, _camera_position) : 0x3f;
+                std::vector<SectionDraw>& draws = _pool_draws[allocation.pool];
+                uint32_t first_index = 0;
+                uint32_t run_first = first_index;
+                uint32_t run_count = 0;
+
+                for (int face = 0; face <= 6; ++face)
+                {
+                    uint32_t count = (face < 6) ? section.face_index_counts[face] : 0;
+
+                    if (face < 6 && (count == 0 || (facing & (1 << face))))
+                    {
+                        run_first = run_count ? run_first : first_index;
+                        run_count += count;
+                    }
+                    else if (run_count)
+                    {
+                        SectionDraw draw;
+                        draw.command.indexCount = run_count;
+                        draw.command.instanceCount = 1;
+                        draw.command.firstIndex = allocation.first_index + run_first;
+                        draw.command.vertexOffset = (int32_t)allocation.first_vertex;
+                        draw.command.firstInstance = 0;
+                        draw.origin = mesh.origin;
+                        draw.aabb = section.aabb;
+                        draws.push_back(draw);
+                        draw_count++;
+                        run_count = 0;
+                    }
+
+                    _face_stats.indices_total += count;
+                    _face_stats.indices_culled += (facing & (1 << face)) ? 0 : count;
+                    first_index += count;
+                }
+            }
+        }
+    }
+
+    return draw_count;
+}
+
+void Renderer::log_face_culling_stats() const
+{
+    std::stringstream ss;
+    ss << "face culling " << (_face_culling ? "on" : "off") << ": " << _face_stats.indices_culled << " of " << _face_stats.indices_total;
+    ss << " indices in drawn sections skipped last frame";
+
+    if (_face_stats.indices_total)
+    {
+        ss << " (" << (100 * _face_stats.indices_culled / _face_stats.indices_total) << "%)";
+    }
+
+    ss << "\n";
+    OutputDebugStringA(ss.str().c_str());
+}
+
+void Renderer::draw_occluders()
+{
+    // Occluders further away than this cover too little of the buffer to be worth drawing
+    static const float occluder_distance = 160.0f;
+    static const size_t max_occluders = 128;
+
+    _occlusion_buffer.clear(_ubo_data.proj * _ubo_data.view * _ubo_data.model);
+    _occluders.clear();
+
+    for (int inside = 0; inside < 2; ++inside)
+    {
+        for (uint32_t mesh_id : inside ? _inside_meshes : _visible_meshes)
+        {
+            const RenderMesh& mesh = _meshes.at(mesh_id);
+
+            for (const geometry::aabb& occluder : mesh.occluders)
+            {
+                float distance = glm::length(occluder.center - _camera_position);
+
+                if (distance < occluder_distance)
+                {
+                    _occluders.emplace_back(distance, &occluder);
+                }
+            }
+        }
+    }
+
+    // Nearest first, they hide the most
+    size_t count = min(_occluders.size(), max_occluders);
+    std::partial_sort(_occluders.begin(), _occluders.begin() + count, _occluders.end(),
+                      [](const std::pair<float, const geometry::aabb*>& a, const std::pair<float, const geometry::aabb*>& b) {
+                          return a.first < b.first;
+                      });
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        _occlusion_stats.occluders += _occlusion_buffer.draw_occluder(*_occluders[i].second) ? 1 : 0;
+    }
+}
+
+void Renderer::dump_occlusion_buffer() const
+{
+    std::stringstream ss;
+    ss << "occlusion buffer: " << _occlusion_stats.occluders << " occluders, ";
+    ss << _occlusion_stats.meshes_rejected << " of " << _occlusion_stats.meshes_tested << " meshes and ";
+    ss << _occlusion_stats.sections_rejected << " of " << _occlusion_stats.sections_tested << " sections rejected";
+
+    if (_occlusion_buffer.dump(L"occlusion.pgm"))
+    {
+        ss << ", written to occlusion.pgm";
+    }
+
+    ss << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+}
+
+RenderMesh* Renderer::find_column_mesh(int chunk_x, int chunk_z)
+{
+    std::unordered_map<uint64_t, uint32_t>::iterator it = _column_meshes.find(world::ChunkMap::key(chunk_x, chunk_z));
+    return (it != _column_meshes.end()) ? &_meshes.at(it->second) : nullptr;
+}
+
+bool Renderer::find_reachable_sections()
+{
+    int chunk_x, chunk_z;
+    world_to_chunk(_camera_position.x, _camera_position.z, chunk_x, chunk_z);
+    int section = (int)floor(_camera_position.y / Chunk::section_height);
+    RenderMesh* mesh = find_column_mesh(chunk_x, chunk_z);
+
+    // Outside the meshed world there is no section to start from, draw everything in the frustum
+    if (!mesh || section < 0 || section >= Chunk::section_count)
+    {
+        return false;
+    }
+
+    static const int face_steps[6][3] = {
+        { 0, 1, 0 },  // Top
+        { 0, -1, 0 }, // Bottom
+        { 0, 0, -1 }, // North
+        { 0, 0, 1 },  // South
+        { 1, 0, 0 },  // East
+        { -1, 0, 0 }, // West
+    };
+
+    _visit_serial++;
+    mesh->visit_serial = _visit_serial;
+    mesh->reachable_sections = (uint16_t)(1 << section);
+
+    _section_queue.clear();
+    _section_queue.push_back({ mesh, chunk_x, chunk_z, section, -1, 0 });
+
+    for (size_t head = 0; head < _section_queue.size(); ++head)
+    {
+        SectionVisit visit = _section_queue[head];
+        uint16_t connectivity = visit.mesh->connectivity[visit.section];
+
+        for (int face = 0; face < 6; ++face)
+        {
+            // Never step back towards the camera, a section behind the path can only be seen through another route
+            if (visit.directions & (1 << (int)opposite_face((BlockFace)face)))
+            {
+                continue;
+            }
+
+            if (visit.entry_face >= 0 && !(connectivity & face_pair_bit((BlockFace)visit.entry_face, (BlockFace)face)))
+            {
+                continue;
+            }
+
+            SectionVisit next;
+            next.chunk_x = visit.chunk_x + face_steps[face][0];
+            next.chunk_z = visit.chunk_z + face_steps[face][2];
+            next.section = visit.section + face_steps[face][1];
+            next.entry_face = (int)opposite_face((BlockFace)face);
+            next.directions = visit.directions | (uint8_t)(1 << face);
+
+            if (next.section < 0 || next.section >= Chunk::section_count)
+            {
+                continue;
+            }
+
+            next.mesh = (face_steps[face][1] != 0) ? visit.mesh : find_column_mesh(next.chunk_x, next.chunk_z);
+
+            if (!next.mesh)
+            {
+                continue;
+            }
+
+            if (next.mesh->visit_serial != _visit_serial)
+            {
+                next.mesh->visit_serial = _visit_serial;
+                next.mesh->reachable_sections = 0;
+            }
+
+            if (next.mesh->reachable_sections & (1 << next.section))
+            {
+                continue;
+            }
+
+            glm::vec3 section_min = glm::vec3(next.mesh->origin) + glm::vec3(0.0f, (float)(next.section * Chunk::section_height), 0.0f);
+            glm::vec3 section_max = section_min + glm::vec3((float)Chunk::chunk_size, (float)Chunk::section_height, (float)Chunk::chunk_size);
+            geometry::aabb bounds;
+            bounds.set_from_corners(section_min, section_max);
+
+            if (culling::cull(_clip_frustum, bounds))
+            {
+                continue;
+            }
+
+            next.mesh->reachable_sections |= (uint16_t)(1 << next.section);
+            _section_queue.push_back(next);
+        }
+    }
+
+    return true;
+}
+
+bool Renderer::write_gpu_candidates(uint32_t frame, glm::vec4* origins, uint32_t draw_count)
+{
+    GpuCuller::Candidate* candidates = _gpu_culler.begin_frame(frame, draw_count, (uint32_t)_pool_draws.size());
+
+    if (!candidates)
+    {
+        return false;
+    }
+
+    uint32_t first_draw = 0;
+
+    for (uint32_t pool = 0; pool < (uint32_t)_pool_draws.size(); ++pool)
+    {
+        const std::vector<SectionDraw>& draws = _pool_draws[pool];
+
+        for (uint32_t i = 0; i < (uint32_t)draws.size(); ++i)
+        {
+            GpuCuller::Candidate& candidate = candidates[first_draw + i];
+            candidate.center = glm::vec4(draws[i].aabb.center, 1.0f);
+            candidate.extents = glm::vec4(draws[i].aabb.extents, 0.0f);
+            candidate.command = draws[i].command;
+            candidate.command.firstInstance = first_draw + i;
+            candidate.pool_first = first_draw;
+            candidate.pool = pool;
+            candidate.pad = 0;
+            origins[first_draw + i] = draws[i].origin;
+        }
+
+        first_draw += (uint32_t)draws.size();
+    }
+
+    return true;
+}
+
+void Renderer::log_memory_stats() const
+{
+    _device.get_allocator().log_stats();
+    _mesh_cache.log_stats();
+
+    uint64_t face_count = 0;
+    uint64_t vertex_count = 0;
+    uint64_t index_count = 0;
+
+    for (const std::pair<const uint32_t, RenderMesh>& entry : _meshes)
+    {
+        face_count += entry.second.face_count;
+        vertex_count += entry.second.vertex_count;
+        index_count += entry.second.index_count;
+    }
+
+    std::stringstream ss;
+    // Downsampled meshes don't count block faces, see Mesh::face_count
+    ss << "meshes: " << _meshes.size() << " in " << vertex_count << " vertices, " << index_count << " indices, " << face_count
+       << " block faces at full resolution" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+}
+
+void Renderer::benchmark_culling()
+{
+    culling::AabbBatch boxes;
+
+    for (const std::pair<const uint32_t, RenderMesh>& entry : _meshes)
+    {
+        boxes.add(entry.second._aabb);
+    }
+
+    culling::benchmark_cull_batch(_clip_frustum, boxes);
+
+    std::vector<uint64_t> expected;
+    culling::cull_batch(_clip_frustum, boxes, expected);
+    uint32_t expected_count = 0;
+
+    for (uint64_t word : expected)
+    {
+        expected_count += (uint32_t)__popcnt64(word);
+    }
+
+    uint32_t iterations = 1000;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (uint32_t iteration = 0; iteration < iterations; ++iteration)
+    {
+        _visible_meshes.clear();
+        _inside_meshes.clear();
+        _mesh_tree.cull(_clip_frustum, _visible_meshes, _inside_meshes);
+    }
+
+    double us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+    uint32_t tree_count = (uint32_t)(_visible_meshes.size() + _inside_meshes.size());
+
+    std::stringstream ss;
+    ss << "quadtree cull: " << us << " us, " << _mesh_tree.get_tested_count() << " of " << _mesh_tree.get_node_count() << " nodes tested, ";
+    ss << _visible_meshes.size() << " intersecting + " << _inside_meshes.size() << " inside, ";
+    ss << (tree_count == expected_count ? "matches" : "DIFFERS FROM") << " cull_batch (" << expected_count << " visible)" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+}
+
 bool Renderer::create_graphics_pipeline()
 {
-    static VertexDecl decl = { { 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, position), sizeof(glm::vec3) },
-                               { 1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal), sizeof(glm::vec3) },
-                               { 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, tex_coord), sizeof(glm::vec3) } };
+    static VertexDecl decl = { { 0, VK_FORMAT_R16G16B16A16_UINT, offsetof(ChunkVertex, x), sizeof(ChunkVertex) } };
+    static VertexDecl instance_decl = { { 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0, sizeof(glm::vec4) } };
 
     _graphics_pipeline_factory.set_vertex_decl(decl);
+    _graphics_pipeline_factory.set_vertex_decl(instance_decl, VK_VERTEX_INPUT_RATE_INSTANCE);
 
     return _graphics_pipeline_factory.create_pipeline(_graphics_pipeline);
 }
 
 bool Renderer::create_descriptor_set_layout()
 {
-    VkDescriptorSetLayoutBinding bindings[2];
+    VkDescriptorSetLayoutBinding bindings[4];
 
     bindings[0] = {};
     bindings[0].binding = 0;
@@ -634,9 +1545,22 @@ bool Renderer::create_descriptor_set_layout()
     bindings[1].descriptorCount = 1;
     bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
+    // Block layer to image and layer, and the second image of block compressed textures
+    bindings[2] = {};
+    bindings[2].binding = 2;
+    bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    bindings[2].descriptorCount = 1;
+    bindings[2].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    bindings[3] = {};
+    bindings[3].binding = 3;
+    bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[3].descriptorCount = 1;
+    bindings[3].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
     VkDescriptorSetLayoutCreateInfo layout_info = {};
     layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layout_info.bindingCount = 2;
+    layout_info.bindingCount = 4;
     layout_info.pBindings = bindings;
 
     VK_CHECK_RESULT(vkCreateDescriptorSetLayout((VkDevice)_device, &layout_info, nullptr, &_descriptor_set_layout));
@@ -646,64 +1570,107 @@ bool Renderer::create_descriptor_set_layout()
     return true;
 }
 
-bool Renderer::create_descriptor_set()
+bool Renderer::create_descriptor_sets()
 {
+    uint32_t frame_count = (uint32_t)_frames.size();
     VkDescriptorPoolSize pool_sizes[2];
 
     pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    pool_sizes[0].descriptorCount = 1;
+    pool_sizes[0].descriptorCount = frame_count * 2;
 
     pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    pool_sizes[1].descriptorCount = 1;
+    pool_sizes[1].descriptorCount = frame_count * 2;
 
     VkDescriptorPoolCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    create_info.maxSets = 1;
+    create_info.maxSets = frame_count;
     create_info.poolSizeCount = 2;
     create_info.pPoolSizes = pool_sizes;
     VK_CHECK_RESULT(vkCreateDescriptorPool((VkDevice)_device, &create_info, nullptr, &_descriptor_pool));
 
-    VkDescriptorSetAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    alloc_info.descriptorPool = _descriptor_pool;
-    alloc_info.descriptorSetCount = 1;
-    alloc_info.pSetLayouts = &_descriptor_set_layout;
-
-    VK_CHECK_RESULT(vkAllocateDescriptorSets((VkDevice)_device, &alloc_info, &_descriptor_set));
-
-    VkDescriptorBufferInfo buffer_info = _ubo_buffer.get_descriptor_info();
-
-    VkDescriptorImageInfo image_info = {};
-    image_info.sampler = _textures._sampler;
-    image_info.imageView = _textures._image_view;
-    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    VkWriteDescriptorSet descriptor_writes[2];
-    descriptor_writes[0] = {};
-    descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_writes[0].dstSet = _descriptor_set;
-    descriptor_writes[0].dstBinding = 0;
-    descriptor_writes[0].dstArrayElement = 0;
-    descriptor_writes[0].descriptorCount = 1;
-    descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptor_writes[0].pBufferInfo = &buffer_info;
-
-    descriptor_writes[1] = {};
-    descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_writes[1].dstSet = _descriptor_set;
-    descriptor_writes[1].dstBinding = 1;
-    descriptor_writes[1].dstArrayElement = 0;
-    descriptor_writes[1].descriptorCount = 1;
-    descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    descriptor_writes[1].pImageInfo = &image_info;
-
-    vkUpdateDescriptorSets((VkDevice)_device, 2, descriptor_writes, 0, nullptr);
+    VkDescriptorImageInfo image_infos[2];
 
-    return true;
-}
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        image_infos[i] = {};
+        image_infos[i].sampler = _textures._sampler;
+        image_infos[i].imageView = _textures.get_image_view(i);
+        image_infos[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
 
-bool Renderer::create_ubo()
-{
-    return _ubo_buffer.create(_device, sizeof(UBO), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    // Only written here, so one buffer serves every frame
+    if (!_layer_map.create(_device, compressed_texture::max_layers * sizeof(uint32_t), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+    {
+        return false;
+    }
+
+    const std::vector<uint32_t>& layer_map = _textures.get_layer_map();
+    void* data;
+
+    if (!_layer_map.map(&data))
+    {
+        return false;
+    }
+
+    memset(data, 0, compressed_texture::max_layers * sizeof(uint32_t));
+    memcpy(data, layer_map.data(), min(layer_map.size(), (size_t)compressed_texture::max_layers) * sizeof(uint32_t));
+    _layer_map.unmap();
+
+    VkDescriptorBufferInfo layer_map_info = _layer_map.get_descriptor_info();
+
+    // Each frame in flight binds its own UBO
+    for (FrameData& frame : _frames)
+    {
+        VkDescriptorSetAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = _descriptor_pool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &_descriptor_set_layout;
+
+        VK_CHECK_RESULT(vkAllocateDescriptorSets((VkDevice)_device, &alloc_info, &frame.descriptor_set));
+
+        VkDescriptorBufferInfo buffer_info = frame.ubo.get_descriptor_info();
+
+        VkWriteDescriptorSet descriptor_writes[4];
+        descriptor_writes[0] = {};
+        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[0].dstSet = frame.descriptor_set;
+        descriptor_writes[0].dstBinding = 0;
+        descriptor_writes[0].dstArrayElement = 0;
+        descriptor_writes[0].descriptorCount = 1;
+        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[0].pBufferInfo = &buffer_info;
+
+        descriptor_writes[1] = {};
+        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[1].dstSet = frame.descriptor_set;
+        descriptor_writes[1].dstBinding = 1;
+        descriptor_writes[1].dstArrayElement = 0;
+        descriptor_writes[1].descriptorCount = 1;
+        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[1].pImageInfo = &image_infos[0];
+
+        descriptor_writes[2] = {};
+        descriptor_writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[2].dstSet = frame.descriptor_set;
+        descriptor_writes[2].dstBinding = 2;
+        descriptor_writes[2].dstArrayElement = 0;
+        descriptor_writes[2].descriptorCount = 1;
+        descriptor_writes[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[2].pBufferInfo = &layer_map_info;
+
+        descriptor_writes[3] = {};
+        descriptor_writes[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[3].dstSet = frame.descriptor_set;
+        descriptor_writes[3].dstBinding = 3;
+        descriptor_writes[3].dstArrayElement = 0;
+        descriptor_writes[3].descriptorCount = 1;
+        descriptor_writes[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[3].pImageInfo = &image_infos[1];
+
+        vkUpdateDescriptorSets((VkDevice)_device, 4, descriptor_writes, 0, nullptr);
+    }
+
+    return true;
 }
@@ -2,13 +2,20 @@
 
 #include <glm/mat4x4.hpp>
 
+#include <deque>
+#include <unordered_map>
+
+#include "chunk_quadtree.h"
 #include "culling.h"
 #include "depth_buffer.h"
+#include "gpu_culling.h"
 #include "graphics_pipeline.h"
 #include "mesh_cache.h"
+#include "occlusion_buffer.h"
 #include "render_pass.h"
 #include "shader_cache.h"
 #include "texture_cache.h"
+#include "upload_queue.h"
 #include "vertex_buffer.h"
 #include "vulkan_buffer.h"
 #include "vulkan_device.h"
@@ -24,31 +31,163 @@ struct UBO
 class Renderer
 {
 public:
-    bool initialise(struct GLFWwindow* window);
+    // Up to frames_in_flight frames are being recorded or executed at once, clamped to 1-3. Startup work such as decoding textures
+    // is spread over jobs' workers when given.
+    bool initialise(struct GLFWwindow* window, uint32_t frames_in_flight = 2, class JobSystem* jobs = nullptr);
     void shutdown();
 
+    // Recreates the swapchain without waiting for the device, the old targets are released as the frames using them complete
     bool set_window_size(uint32_t width, uint32_t height);
 
     void set_model_matrix(glm::mat4x4& m) { _ubo_data.model = m; }
     void set_view_matrix(glm::mat4x4& m) { _ubo_data.view = m; }
     void set_proj_matrix(glm::mat4x4& m) { _ubo_data.proj = m; }
-    bool add_mesh(const struct Mesh& mesh);
+    void set_camera_position(const glm::vec3& position) { _camera_position = position; }
+    // mesh_id is 0 for meshes with nothing to draw, which remove_mesh ignores
+    bool add_mesh(const struct Mesh& mesh, uint32_t& mesh_id);
+    // Like add_mesh, but old_id stays drawn until the new mesh has been uploaded, so a remeshed chunk never leaves a hole
+    bool replace_mesh(uint32_t old_id, const struct Mesh& mesh, uint32_t& mesh_id);
+    // Replaces the vertical sections of the mesh set in sections with mesh's, see Chunk::remesh_dirty_sections. The old ranges are
+    // drawn until the new ones have uploaded. Returns false if the mesh isn't known or a section can't be uploaded.
+    bool update_mesh(uint32_t mesh_id, const struct Mesh& mesh, uint16_t sections);
+    void remove_mesh(uint32_t mesh_id);
+    void clear_meshes();
+    uint32_t get_mesh_count() const { return (uint32_t)_meshes.size(); }
+    void log_memory_stats() const;
+    // Times culling the meshes against the current frustum with each culling path
+    void benchmark_culling();
+
+    // Only draw sections reachable from the camera's section through transparent blocks, see find_reachable_sections
+    void set_occlusion_culling(bool enable) { _occlusion_culling = enable; }
+    bool get_occlusion_culling() const { return _occlusion_culling; }
+
+    // Test meshes and sections against a software depth buffer of nearby solid blocks before drawing them
+    void set_occlusion_buffer(bool enable) { _occlusion_buffer_enabled = enable; }
+    bool get_occlusion_buffer() const { return _occlusion_buffer_enabled; }
+    // Writes the last frame's occlusion buffer to occlusion.pgm and logs what it rejected
+    void dump_occlusion_buffer() const;
+
+    // Skip each section's faces whose direction points away from the camera over the whole section
+    void set_face_culling(bool enable) { _face_culling = enable; }
+    bool get_face_culling() const { return _face_culling; }
+    void log_face_culling_stats() const;
+
+    // Frustum cull sections in a compute pass instead of on the CPU, only available with multi draw indirect
+    void set_gpu_culling(bool enable) { _gpu_culling = enable && _gpu_culling_supported; }
+    bool get_gpu_culling() const { return _gpu_culling; }
+    // Compares the next GPU culled frame against the CPU result and logs the differences
+    void verify_gpu_culling() { _gpu_culler.request_verify(); }
 
     bool draw_frame();
 
 private:
+    // How the visible sections are submitted, picked from the device features
+    enum class DrawMode : uint8_t
+    {
+        MultiDrawIndirect, // one vkCmdDrawIndexedIndirect per pool
+        Indirect,          // one single draw vkCmdDrawIndexedIndirect per section, no multiDrawIndirect
+        Direct             // vkCmdDrawIndexed per section, no drawIndirectFirstInstance
+    };
+
+    // Written by the CPU while recording the frame's command buffer
+    struct FrameDraws
+    {
+        VulkanBuffer commands; // VkDrawIndexedIndirectCommand per visible section, grouped by pool
+        VulkanBuffer origins;  // chunk origin per draw, an instance rate attribute selected by the draw's firstInstance
+        uint32_t capacity = 0;
+    };
+
+    // Everything a frame in flight uses, only touched by the CPU once the frame's fence has signalled
+    struct FrameData
+    {
+        VkCommandPool command_pool = VK_NULL_HANDLE;
+        VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+        VkSemaphore image_acquired_semaphore = VK_NULL_HANDLE;
+        VkSemaphore drawing_complete_semaphore = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        uint64_t fence_serial = 0; // serial of the frame last submitted with the fence
+        VulkanBuffer ubo;
+        VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+        FrameDraws draws;
+    };
+
+    // Counters for the last frame's occlusion buffer
+    struct OcclusionStats
+    {
+        uint32_t occluders;
+        uint32_t meshes_tested;
+        uint32_t meshes_rejected;
+        uint32_t sections_tested;
+        uint32_t sections_rejected;
+    };
+
+    // Counters for the last frame's face direction culling
+    struct FaceStats
+    {
+        uint64_t indices_total;
+        uint64_t indices_culled;
+    };
+
+    // Breadth first traversal state for one chunk section
+    struct SectionVisit
+    {
+        RenderMesh* mesh;
+        int chunk_x;
+        int chunk_z;
+        int section;
+        int entry_face;     // BlockFace the traversal entered through, -1 for the camera's section
+        uint8_t directions; // BlockFace bits of every step taken to reach the section
+    };
+
+    struct SectionDraw
+    {
+        VkDrawIndexedIndirectCommand command;
+        glm::vec4 origin;
+        geometry::aabb aabb; // only used when culling on the GPU
+    };
+
+    // A remeshed section waiting for its copies, swapped into the mesh by apply_section_updates
+    struct SectionUpdate
+    {
+        uint32_t mesh_id;
+        uint32_t section; // vertical section index within the chunk
+        uint64_t upload_batch;
+        bool has_faces; // false drops the section
+        MeshSection mesh_section;
+        MeshCache::Allocation allocation;
+    };
+
+    // Swapchain, framebuffers and depth buffer replaced by a resize
+    struct RetiredTargets
+    {
+        uint64_t serial; // last frame serial that may use them
+        Swapchain::Retired swapchain;
+        std::vector<VkFramebuffer> frame_buffers;
+        VulkanImage depth_image;
+        VkImageView depth_image_view = VK_NULL_HANDLE;
+    };
+
     void invalidate();
 
     bool create_instance();
     bool create_device();
-    bool create_semaphores();
+    bool create_frames(uint32_t count);
+    void destroy_frames();
     bool create_frame_buffers();
-    bool create_command_buffers(uint32_t count);
-    bool create_fences(uint32_t count);
+    bool reserve_frame_draws(FrameDraws& frame_draws, uint32_t count);
     bool create_graphics_pipeline();
     bool create_descriptor_set_layout();
-    bool create_descriptor_set();
-    bool create_ubo();
+    bool create_descriptor_sets();
+    bool upload_mesh(const struct Mesh& mesh, uint32_t& mesh_id);
+    void release_retired();
+    void apply_section_updates();
+    void destroy_targets(RetiredTargets& targets);
+    void apply_mesh_replacements();
+    uint32_t gather_section_draws(bool cull);
+    bool find_reachable_sections();
+    void draw_occluders();
+    RenderMesh* find_column_mesh(int chunk_x, int chunk_z);
+    bool write_gpu_candidates(uint32_t frame, glm::vec4* origins, uint32_t draw_count);
 
     ShaderCache _shader_cache;
     VulkanDevice _device;
@@ -57,27 +196,53 @@ private:
     RenderPass _render_pass;
     GraphicsPipelineFactory _graphics_pipeline_factory;
     GraphicsPipeline _graphics_pipeline;
-    VulkanBuffer _ubo_buffer;
     std::vector<VkFramebuffer> _frame_buffers;
-    std::vector<VkCommandBuffer> _command_buffers;
-    std::vector<VkFence> _frame_fences;
+    std::vector<FrameData> _frames;
+    uint32_t _frame_index = 0; // next frame in flight to record
     GLFWwindow* _window = nullptr;
     VkInstance _vulkan_instance = VK_NULL_HANDLE;
     VkDebugReportCallbackEXT _debug_report = VK_NULL_HANDLE;
     VkSurfaceKHR _surface = VK_NULL_HANDLE;
-    VkCommandPool _command_pool = VK_NULL_HANDLE;
-    VkSemaphore _drawing_complete_semaphore = VK_NULL_HANDLE;
     VkShaderModule _vertex_shader = VK_NULL_HANDLE;
     VkShaderModule _fragment_shader = VK_NULL_HANDLE;
+    VkShaderModule _cull_shader = VK_NULL_HANDLE;
 
     UBO _ubo_data;
     VkDescriptorSetLayout _descriptor_set_layout = VK_NULL_HANDLE;
     VkDescriptorPool _descriptor_pool = VK_NULL_HANDLE;
-    VkDescriptorSet _descriptor_set = VK_NULL_HANDLE;
 
     TextureArray _textures;
+    VulkanBuffer _layer_map; // TextureArray::get_layer_map for the vertex shader
+    UploadQueue _upload_queue;
+    MeshCache _mesh_cache;
+    DrawMode _draw_mode = DrawMode::Direct;
+    std::vector<std::vector<SectionDraw>> _pool_draws; // visible sections of the frame being recorded, per mesh cache pool
+    GpuCuller _gpu_culler;
+    bool _gpu_culling_supported = false;
+    bool _gpu_culling = false;
 
-    std::vector<RenderMesh> _meshes;
+    std::unordered_map<uint32_t, RenderMesh> _meshes;
+    ChunkQuadtree _mesh_tree; // mesh bounds by chunk column, culled before testing the visible meshes' sections
+    std::vector<uint32_t> _visible_meshes; // meshes intersecting the frustum
+    std::vector<uint32_t> _inside_meshes; // meshes wholly inside the frustum
+    std::unordered_map<uint64_t, uint32_t> _column_meshes; // mesh id by world::ChunkMap::key of its chunk
+    std::vector<SectionVisit> _section_queue;
+    glm::vec3 _camera_position;
+    uint64_t _visit_serial = 0;
+    bool _occlusion_culling = true;
+    OcclusionBuffer _occlusion_buffer;
+    OcclusionStats _occlusion_stats = {};
+    std::vector<std::pair<float, const geometry::aabb*>> _occluders; // nearby occluders by distance from the camera
+    bool _occlusion_buffer_enabled = true;
+    FaceStats _face_stats = {};
+    bool _face_culling = true;
+    std::deque<std::pair<uint64_t, RenderMesh>> _retired_meshes; // removed meshes and the last frame serial that may draw them
+    std::vector<std::pair<uint32_t, uint32_t>> _replaced_meshes; // old mesh id and the id replacing it, until its upload completes
+    std::deque<RetiredTargets> _retired_targets;
+    std::deque<SectionUpdate> _section_updates;
+    uint32_t _next_mesh_id = 1;
+    uint64_t _frame_serial = 0;
+    uint64_t _completed_frame_serial = 0;
 
     bool _valid_state = false;
 };
\ No newline at end of file
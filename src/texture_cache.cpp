@@ -2,11 +2,17 @@
 
 #include <Windows.h>
 
+#include <chrono>
+#include <sstream>
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #include <stb_image.h>
 
+#include "compressed_texture.h"
 #include "file.h"
+#include "job_system.h"
+#include "texture_mips.h"
 #include "vulkan.h"
 #include "vulkan_device.h"
 
@@ -119,71 +125,475 @@ void Texture::destroy()
     _staging_buffer.destroy();
 }
 
-bool TextureArray::create(VulkanDevice& device, const std::vector<std::wstring>& paths)
+// Header of the cooked texture array blob, followed by every mip level in turn with all the layers of a level contiguous
+struct CookedTextureHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_stamp; // hash of the source file names, sizes and write times
+    uint32_t width;
+    uint32_t height;
+    uint32_t layer_count;
+    uint32_t mip_levels;
+    uint64_t data_size;
+};
+
+static const uint32_t cooked_texture_magic = 0x58544356; // "VCTX"
+static const uint32_t cooked_texture_version = 1;
+
+// Bytes of one mip level of layer_count layers as laid out in the staging buffer
+static VkDeviceSize get_level_size(VkFormat format, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t level)
+{
+    switch (format)
+    {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+            return compressed_texture::level_size(width, height, layer_count, level, compressed_texture::bc1_block_size);
+
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+            return compressed_texture::level_size(width, height, layer_count, level, compressed_texture::bc7_block_size);
+
+        default:
+            return (VkDeviceSize)texture_mips::level_extent(width, level) * texture_mips::level_extent(height, level) * texture_mips::texel_size *
+                   layer_count;
+    }
+}
+
+// Decodes one layer and writes it and its mip chain into the layer's slice of each level, and of the same levels in blob if given.
+// The smaller levels are filtered in scratch memory so the staging memory, which may be write-combined, is only ever written.
+static bool cook_layer(const std::wstring& path, const CookedTextureHeader& header, uint32_t layer, uint8_t* data, uint8_t* blob,
+                       double& decode_ms, double& copy_ms)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    PngLoader loader;
+
+    if (!loader.load(path) || (uint32_t)loader.width != header.width || (uint32_t)loader.height != header.height)
+    {
+        return false;
+    }
+
+    std::chrono::high_resolution_clock::time_point decoded = std::chrono::high_resolution_clock::now();
+    decode_ms = std::chrono::duration<double, std::milli>(decoded - start).count();
+
+    std::vector<uint8_t> scratch[2];
+    const uint8_t* src = loader.pixels;
+    VkDeviceSize level_offset = 0;
+
+    for (uint32_t level = 0; level < header.mip_levels; ++level)
+    {
+        VkDeviceSize layer_size = get_level_size(VK_FORMAT_R8G8B8A8_UNORM, header.width, header.height, 1, level);
+
+        if (level > 0)
+        {
+            std::vector<uint8_t>& dest = scratch[level & 1];
+            dest.resize(layer_size);
+            texture_mips::box_filter(src, texture_mips::level_extent(header.width, level - 1), texture_mips::level_extent(header.height, level - 1),
+                                     dest.data());
+            src = dest.data();
+        }
+
+        // Pixels were decoded as RGBA whatever the file's own component count
+        memcpy(data + level_offset + layer * layer_size, src, layer_size);
+
+        if (blob)
+        {
+            memcpy(blob + level_offset + layer * layer_size, src, layer_size);
+        }
+
+        level_offset += layer_size * header.layer_count;
+    }
+
+    copy_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - decoded).count();
+
+    return true;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    // FNV-1a
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+bool TextureArray::create(VulkanDevice& device, const std::vector<std::wstring>& paths, JobSystem* jobs)
+{
+    _device = &device;
+
+    CookedTextureHeader header;
+    uint8_t* staging;
+
+    if (!cook(paths, jobs, header, &staging))
+    {
+        return false;
+    }
+
+    _staging_buffer.unmap();
+
+    set_layer_names(paths);
+
+    return create_rgba_images(header.width, header.height, header.layer_count, header.mip_levels);
+}
+
+bool TextureArray::create(VulkanDevice& device, const std::wstring& directory, JobSystem* jobs)
 {
     _device = &device;
 
-    _layer_count = (uint32_t)paths.size();
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::wstring> paths;
+    std::wstring search_path = directory + L"/*.png";
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = ::FindFirstFile(search_path.c_str(), &fd);
+    uint64_t source_stamp = 0xcbf29ce484222325ull;
+    uint64_t compressed_hash = compressed_texture::source_hash_seed;
+
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            // read all (real) files in current folder
+            // , delete '!' read other 2 default folder . and ..
+            if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                paths.push_back(directory + L"/" + fd.cFileName);
+
+                // Touching, adding, removing or renaming a source invalidates the cooked blob
+                source_stamp = hash_bytes(source_stamp, fd.cFileName, wcslen(fd.cFileName) * sizeof(wchar_t));
+                source_stamp = hash_bytes(source_stamp, &fd.ftLastWriteTime, sizeof(fd.ftLastWriteTime));
+                source_stamp = hash_bytes(source_stamp, &fd.nFileSizeLow, sizeof(fd.nFileSizeLow));
+
+                // Names are ASCII, narrowed to match the encoder's hash
+                std::string name(fd.cFileName, fd.cFileName + wcslen(fd.cFileName));
+                compressed_hash = compressed_texture::hash_source(compressed_hash, name.c_str(), name.size(),
+                                                                  ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow);
+            }
+        } while (::FindNextFile(hFind, &fd));
+
+        ::FindClose(hFind);
+    }
+
+    if (paths.empty())
+    {
+        return false;
+    }
 
-    std::vector<PngLoader> loaders;
-    loaders.resize(_layer_count);
+    // Block compressed layers from the offline encoder, see tools/bc_encoder, are a quarter to an eighth of the size
+    const VkPhysicalDeviceFeatures& features = _device->get_features();
 
-    for (uint32_t layer = 0; layer < _layer_count; ++layer)
+    if (features.textureCompressionBC && _device->supports_format(VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) &&
+        _device->supports_format(VK_FORMAT_BC7_UNORM_BLOCK, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) &&
+        load_compressed(directory + L".bc", paths, compressed_hash))
     {
-        if (!loaders[layer].load(paths[layer].c_str()))
+        return true;
+    }
+
+    std::wstring cooked_path = directory + L".cooked";
+    CookedTextureHeader header = {};
+    File file;
+
+    // The blob is read straight into the staging buffer in one go
+    if (file.open(cooked_path) && file.read(&header, sizeof(header)) == sizeof(header) && header.magic == cooked_texture_magic &&
+        header.version == cooked_texture_version && header.source_stamp == source_stamp && header.layer_count == paths.size() &&
+        file.get_length() == sizeof(header) + header.data_size)
+    {
+        uint8_t* staging;
+
+        if (!create_staging_buffer(header.data_size, &staging))
         {
             return false;
         }
+
+        bool loaded = file.read(staging, (uint32_t)header.data_size) == header.data_size;
+        _staging_buffer.unmap();
+
+        if (loaded)
+        {
+            set_layer_names(paths);
+
+            _load_stats = {};
+            _load_stats.threads = 1;
+            _load_stats.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            _load_stats.copy_ms = _load_stats.wall_ms;
+
+            std::stringstream ss;
+            ss << "textures: loaded " << header.layer_count << " cooked layers with " << header.mip_levels << " mips in "
+               << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+            OutputDebugStringA(ss.str().c_str());
+
+            return create_rgba_images(header.width, header.height, header.layer_count, header.mip_levels);
+        }
+
+        _staging_buffer.destroy();
     }
 
-    for (uint32_t layer = 1; layer < _layer_count; ++layer)
+    file.close();
+
+    uint8_t* staging;
+    std::vector<uint8_t> blob;
+
+    if (!cook(paths, jobs, header, &staging, &blob))
+    {
+        return false;
+    }
+
+    _staging_buffer.unmap();
+    header.source_stamp = source_stamp;
+
+    FILE* fp = nullptr;
+    _wfopen_s(&fp, cooked_path.c_str(), L"wb");
+
+    if (fp)
     {
-        if (loaders[layer].width != loaders[0].width || loaders[layer].height != loaders[0].height ||
-            loaders[layer].components != loaders[0].components)
+        bool written = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(blob.data(), 1, blob.size(), fp) == blob.size();
+        written = (fclose(fp) == 0) && written;
+
+        // A truncated blob would only be rejected by the size check on the next run, so don't leave one behind
+        if (!written)
         {
-            return false;
+            _wremove(cooked_path.c_str());
+            OutputDebugStringA("textures: failed to write the cooked blob\n");
         }
     }
 
-    VkDeviceSize buffer_size = 0;
+    set_layer_names(paths);
+
+    std::stringstream ss;
+    ss << "textures: cooked " << header.layer_count << " layers with " << header.mip_levels << " mips in "
+       << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+
+    return create_rgba_images(header.width, header.height, header.layer_count, header.mip_levels);
+}
+
+bool TextureArray::cook(const std::vector<std::wstring>& paths, JobSystem* jobs, CookedTextureHeader& header, uint8_t** data,
+                        std::vector<uint8_t>* blob)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    int width, height, components;
+    File file;
 
-    for (uint32_t layer = 0; layer < _layer_count; ++layer)
+    // Only the first layer's size is read up front, so the staging buffer can be laid out before any layer is decoded
+    if (!file.open(paths[0]) || !stbi_info_from_file(file, &width, &height, &components))
     {
-        buffer_size += loaders[layer].get_size();
+        return false;
     }
 
-    if (!_staging_buffer.create(*_device, buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    file.close();
+
+    header = {};
+    header.magic = cooked_texture_magic;
+    header.version = cooked_texture_version;
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.layer_count = (uint32_t)paths.size();
+    header.mip_levels = texture_mips::level_count(header.width, header.height);
+
+    for (uint32_t level = 0; level < header.mip_levels; ++level)
+    {
+        header.data_size += get_level_size(VK_FORMAT_R8G8B8A8_UNORM, header.width, header.height, header.layer_count, level);
+    }
+
+    if (!create_staging_buffer(header.data_size, data))
+    {
+        return false;
+    }
+
+    if (blob)
+    {
+        blob->resize((size_t)header.data_size);
+    }
+
+    // Each layer is written to its own slices, so the layers can be decoded in any order on any thread
+    std::vector<double> decode_ms(header.layer_count, 0.0);
+    std::vector<double> copy_ms(header.layer_count, 0.0);
+    std::vector<uint8_t> cooked(header.layer_count, 0);
+    uint8_t* staging = *data;
+    uint8_t* blob_data = blob ? blob->data() : nullptr;
+
+    for (uint32_t layer = 0; layer < header.layer_count; ++layer)
+    {
+        JobSystem::Job job = [&, layer]() {
+            cooked[layer] = cook_layer(paths[layer], header, layer, staging, blob_data, decode_ms[layer], copy_ms[layer]);
+        };
+
+        if (jobs)
+        {
+            jobs->submit(job);
+        }
+        else
+        {
+            job();
+        }
+    }
+
+    if (jobs)
+    {
+        jobs->wait_idle();
+    }
+
+    _load_stats = {};
+    _load_stats.threads = jobs ? jobs->get_thread_count() + 1 : 1;
+
+    for (uint32_t layer = 0; layer < header.layer_count; ++layer)
+    {
+        if (!cooked[layer])
+        {
+            _staging_buffer.unmap();
+            _staging_buffer.destroy();
+            return false;
+        }
+
+        _load_stats.decode_ms += decode_ms[layer];
+        _load_stats.copy_ms += copy_ms[layer];
+    }
+
+    _load_stats.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    return true;
+}
+
+bool TextureArray::create_staging_buffer(VkDeviceSize size, uint8_t** data)
+{
+    if (!_staging_buffer.create(*_device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
     {
         return false;
     }
 
-    uint8_t* data;
+    return _staging_buffer.map((void**)data);
+}
 
-    if (!_staging_buffer.map((void**)&data))
+bool TextureArray::load_compressed(const std::wstring& path, const std::vector<std::wstring>& paths, uint64_t source_hash)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    compressed_texture::Header header = {};
+    File file;
+
+    // A stale blob is ignored rather than failing, the PNGs still load uncompressed
+    if (!file.open(path) || file.read(&header, sizeof(header)) != sizeof(header) || header.magic != compressed_texture::magic ||
+        header.version != compressed_texture::version || header.source_hash != source_hash || header.layer_count != paths.size() ||
+        header.layer_count > compressed_texture::max_layers || header.array_layers[0] + header.array_layers[1] != header.layer_count)
     {
         return false;
     }
 
-    for (uint32_t layer = 0; layer < _layer_count; ++layer)
+    VkDeviceSize data_size = header.array_sizes[0] + header.array_sizes[1];
+    uint32_t map_size = header.layer_count * sizeof(uint32_t);
+
+    if (file.get_length() != sizeof(header) + map_size + data_size)
     {
-        memcpy(data, loaders[layer].pixels, loaders[layer].get_size());
-        data += loaders[layer].get_size();
+        return false;
     }
 
+    _layer_map.resize(header.layer_count);
+    uint8_t* staging;
+
+    if (file.read(_layer_map.data(), map_size) != map_size || !create_staging_buffer(data_size, &staging))
+    {
+        return false;
+    }
+
+    bool loaded = file.read(staging, (uint32_t)data_size) == data_size;
     _staging_buffer.unmap();
 
-    if (!_image.create(*_device, VK_IMAGE_TYPE_2D, VK_FORMAT_R8G8B8A8_UNORM, loaders[0].width, loaders[0].height, 1, _layer_count,
-                       VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT))
+    if (!loaded)
     {
+        _staging_buffer.destroy();
         return false;
     }
 
-    if (!_image.create_view(VK_IMAGE_VIEW_TYPE_2D_ARRAY, VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, _layer_count, _image_view))
+    set_layer_names(paths);
+
+    _load_stats = {};
+    _load_stats.threads = 1;
+    _load_stats.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    _load_stats.copy_ms = _load_stats.wall_ms;
+
+    std::stringstream ss;
+    ss << "textures: loaded " << header.array_layers[compressed_texture::bc1_array] << " BC1 and " << header.array_layers[compressed_texture::bc7_array]
+       << " BC7 layers with " << header.mip_levels << " mips, " << data_size << " bytes in " << _load_stats.wall_ms << " ms" << std::endl;
+    OutputDebugStringA(ss.str().c_str());
+
+    static const VkFormat formats[compressed_texture::array_count] = { VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC7_UNORM_BLOCK };
+    VkDeviceSize offset = 0;
+    _layer_count = header.layer_count;
+
+    for (uint32_t index = 0; index < compressed_texture::array_count; ++index)
+    {
+        if (header.array_layers[index] &&
+            !create_image(index, formats[index], header.width, header.height, header.array_layers[index], header.mip_levels, offset))
+        {
+            return false;
+        }
+
+        offset += header.array_sizes[index];
+    }
+
+    return create_sampler(header.mip_levels);
+}
+
+bool TextureArray::create_rgba_images(uint32_t width, uint32_t height, uint32_t layer_count, uint32_t mip_levels)
+{
+    _layer_count = layer_count;
+    _layer_map.resize(layer_count);
+
+    for (uint32_t layer = 0; layer < layer_count; ++layer)
+    {
+        _layer_map[layer] = layer;
+    }
+
+    if (!create_image(0, VK_FORMAT_R8G8B8A8_UNORM, width, height, layer_count, mip_levels, 0))
     {
         return false;
     }
 
+    return create_sampler(mip_levels);
+}
+
+bool TextureArray::create_image(uint32_t index, VkFormat format, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t mip_levels,
+                                VkDeviceSize offset)
+{
+    ArrayImage& image = _images[index];
+    image.layer_count = layer_count;
+
+    if (!image.image.create(*_device, VK_IMAGE_TYPE_2D, format, width, height, 1, layer_count, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                            mip_levels))
+    {
+        return false;
+    }
+
+    if (!image.image.create_view(VK_IMAGE_VIEW_TYPE_2D_ARRAY, VK_IMAGE_ASPECT_COLOR_BIT, 0, mip_levels, 0, layer_count, image.view))
+    {
+        return false;
+    }
+
+    // The staging data holds each mip level in turn with all the image's layers of a level tightly packed
+    image.regions.resize(mip_levels);
+
+    for (uint32_t level = 0; level < mip_levels; ++level)
+    {
+        VkBufferImageCopy& region = image.regions[level];
+        region = {};
+        region.bufferOffset = offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = layer_count;
+        region.imageExtent = { texture_mips::level_extent(width, level), texture_mips::level_extent(height, level), 1 };
+        offset += get_level_size(format, width, height, layer_count, level);
+    }
+
+    return true;
+}
+
+bool TextureArray::create_sampler(uint32_t mip_levels)
+{
+    // Nearest texels up close, blended mips in the distance
     VkSamplerCreateInfo sampler_info = {};
     sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
     sampler_info.magFilter = VK_FILTER_NEAREST;
@@ -193,46 +603,28 @@ bool TextureArray::create(VulkanDevice& device, const std::vector<std::wstring>&
     sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
     sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
     sampler_info.maxAnisotropy = 1.0f;
+    sampler_info.minLod = 0.0f;
+    sampler_info.maxLod = (float)mip_levels;
     VK_CHECK_RESULT(vkCreateSampler((VkDevice)*_device, &sampler_info, nullptr, &_sampler));
 
-    for (const std::wstring& path : paths)
-    {
-        wchar_t name[_MAX_FNAME];
-        _wsplitpath(path.c_str(), nullptr, nullptr, name, nullptr);
-        _layer_names.push_back(name);
-    }
-
     return true;
 }
 
-bool TextureArray::create(VulkanDevice& device, const std::wstring& directory)
+VkImageView TextureArray::get_image_view(uint32_t index) const
 {
-    std::vector<std::wstring> paths;
-    std::wstring search_path = directory + L"/*.png";
-    WIN32_FIND_DATA fd;
-    HANDLE hFind = ::FindFirstFile(search_path.c_str(), &fd);
-
-    if (hFind != INVALID_HANDLE_VALUE)
-    {
-        do
-        {
-            // read all (real) files in current folder
-            // , delete '!' read other 2 default folder . and ..
-            if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-            {
-                paths.push_back(directory + L"/" + fd.cFileName);
-            }
-        } while (::FindNextFile(hFind, &fd));
+    return _images[index].view ? _images[index].view : _images[1 - index].view;
+}
 
-        ::FindClose(hFind);
-    }
+void TextureArray::set_layer_names(const std::vector<std::wstring>& paths)
+{
+    _layer_names.clear();
 
-    if (paths.empty())
+    for (const std::wstring& path : paths)
     {
-        return false;
+        wchar_t name[_MAX_FNAME];
+        _wsplitpath(path.c_str(), nullptr, nullptr, name, nullptr);
+        _layer_names.push_back(name);
     }
-
-    return create(device, paths);
 }
 
 void TextureArray::destroy()
@@ -243,12 +635,18 @@ void TextureArray::destroy()
         _sampler = VK_NULL_HANDLE;
     }
 
-    if (_image_view)
+    for (ArrayImage& image : _images)
     {
-        vkDestroyImageView((VkDevice)*_device, _image_view, nullptr);
-        _image_view = VK_NULL_HANDLE;
+        if (image.view)
+        {
+            vkDestroyImageView((VkDevice)*_device, image.view, nullptr);
+            image.view = VK_NULL_HANDLE;
+        }
+
+        image.image.destroy();
+        image.layer_count = 0;
+        image.regions.clear();
     }
 
-    _image.destroy();
     _staging_buffer.destroy();
 }
@@ -7,10 +7,13 @@
 
 #include <vulkan/vulkan.h>
 
+#include "compressed_texture.h"
 #include "vulkan_buffer.h"
 #include "vulkan_image.h"
 
+class JobSystem;
 class VulkanDevice;
+struct CookedTextureHeader;
 
 class Texture
 {
@@ -29,18 +32,58 @@ public:
 class TextureArray
 {
 public:
-    bool create(VulkanDevice& device, const std::vector<std::wstring>& paths);
-    bool create(VulkanDevice& device, const std::wstring& directory);
+    // Time spent getting the layers into the staging buffer, decode and copy are summed over the layers
+    struct LoadStats
+    {
+        double decode_ms;
+        double copy_ms; // copying and filtering mips into the staging buffer, or reading the cooked blob
+        double wall_ms;
+        uint32_t threads;
+    };
+
+    // Layers are decoded on the job system's workers when one is given
+    bool create(VulkanDevice& device, const std::vector<std::wstring>& paths, JobSystem* jobs = nullptr);
+    // Loads the directory's PNGs from the cooked blob next to it, cooking it first if the sources have changed
+    bool create(VulkanDevice& device, const std::wstring& directory, JobSystem* jobs = nullptr);
     void destroy();
 
     int layer_index(const std::wstring& name);
+    const LoadStats& get_load_stats() const { return _load_stats; }
+    // Either image's view, an empty image takes the other's so that both can always be bound
+    VkImageView get_image_view(uint32_t index) const;
+    // Indexed by block layer, see compressed_texture::array_shift
+    const std::vector<uint32_t>& get_layer_map() const { return _layer_map; }
+
+private:
+    // Decodes the layers straight into a mapped staging buffer and fills in their mip chains, data is left mapped. blob, if given,
+    // gets a CPU copy of the same bytes to write to disk, as reading the staging memory back may be very slow.
+    bool cook(const std::vector<std::wstring>& paths, JobSystem* jobs, CookedTextureHeader& header, uint8_t** data,
+              std::vector<uint8_t>* blob = nullptr);
+    bool create_staging_buffer(VkDeviceSize size, uint8_t** data);
+    bool load_compressed(const std::wstring& path, const std::vector<std::wstring>& paths, uint64_t source_hash);
+    bool create_rgba_images(uint32_t width, uint32_t height, uint32_t layer_count, uint32_t mip_levels);
+    bool create_image(uint32_t index, VkFormat format, uint32_t width, uint32_t height, uint32_t layer_count, uint32_t mip_levels,
+                      VkDeviceSize offset);
+    bool create_sampler(uint32_t mip_levels);
+    void set_layer_names(const std::vector<std::wstring>& paths);
 
 public:
+    // Some of the layers and the copies from the staging buffer that fill them. Uncompressed layers are all in the first image,
+    // block compressed ones are split into opaque BC1 layers in the first and BC7 layers with alpha in the second.
+    struct ArrayImage
+    {
+        VulkanImage image;
+        VkImageView view = VK_NULL_HANDLE;
+        uint32_t layer_count = 0;
+        std::vector<VkBufferImageCopy> regions;
+    };
+
     VulkanBuffer _staging_buffer;
-    VulkanImage _image;
+    ArrayImage _images[compressed_texture::array_count];
     VulkanDevice* _device = nullptr;
-    VkImageView _image_view = VK_NULL_HANDLE;
     VkSampler _sampler = VK_NULL_HANDLE;
     uint32_t _layer_count = 0;
+    std::vector<uint32_t> _layer_map; // layer -> image << compressed_texture::array_shift | layer within the image
     std::vector<std::wstring> _layer_names;
+    LoadStats _load_stats = {};
 };
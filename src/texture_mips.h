@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Mip chain helpers for tightly packed RGBA8 texture layers, shared by the texture loader and the offline encoder
+namespace texture_mips
+{
+
+static const uint32_t texel_size = 4;
+
+inline uint32_t level_extent(uint32_t extent, uint32_t level)
+{
+    extent >>= level;
+    return extent ? extent : 1;
+}
+
+// Full chain down to 1x1
+inline uint32_t level_count(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+
+    while (((width > height ? width : height) >> levels) > 0)
+    {
+        ++levels;
+    }
+
+    return levels;
+}
+
+// Averages each 2x2 block of the level above, an odd edge repeats its last texel
+inline void box_filter(const uint8_t* src, uint32_t src_width, uint32_t src_height, uint8_t* dest)
+{
+    uint32_t width = level_extent(src_width, 1);
+    uint32_t height = level_extent(src_height, 1);
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        uint32_t y0 = y * 2 < src_height ? y * 2 : src_height - 1;
+        uint32_t y1 = y * 2 + 1 < src_height ? y * 2 + 1 : src_height - 1;
+        const uint8_t* row0 = src + y0 * src_width * texel_size;
+        const uint8_t* row1 = src + y1 * src_width * texel_size;
+
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            uint32_t x0 = (x * 2 < src_width ? x * 2 : src_width - 1) * texel_size;
+            uint32_t x1 = (x * 2 + 1 < src_width ? x * 2 + 1 : src_width - 1) * texel_size;
+
+            for (uint32_t c = 0; c < texel_size; ++c)
+            {
+                *dest++ = (uint8_t)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+            }
+        }
+    }
+}
+
+} // namespace texture_mips
@@ -0,0 +1,325 @@
+#include "upload_queue.h"
+
+#include <Windows.h>
+
+#include <sstream>
+
+#include "vulkan.h"
+#include "vulkan_device.h"
+
+static const VkDeviceSize staging_alignment = 16;
+
+bool UploadQueue::create(VulkanDevice& device, VkDeviceSize staging_size)
+{
+    _device = &device;
+    _ring_size = staging_size;
+    _ring_head = 0;
+    _ring_tail = 0;
+    _ring_used = 0;
+    _pending_bytes = 0;
+    _queue_family_indices[0] = device.get_transfer_queue_index();
+    _queue_family_indices[1] = device.get_graphics_queue_index();
+
+    if (!_staging_buffer.create(device, staging_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+    {
+        return false;
+    }
+
+    if (!_staging_buffer.map((void**)&_staging_memory))
+    {
+        return false;
+    }
+
+    if (!device.create_command_pool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, _command_pool, device.get_transfer_queue_index()))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+void UploadQueue::destroy()
+{
+    if (!_device)
+    {
+        return;
+    }
+
+    VkDevice device = (VkDevice)*_device;
+
+    for (Batch& batch : _in_flight)
+    {
+        vkWaitForFences(device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+        _free_batches.push_back(batch);
+    }
+
+    _in_flight.clear();
+    _pending.clear();
+
+    for (Batch& batch : _free_batches)
+    {
+        vkDestroyFence(device, batch.fence, nullptr);
+    }
+
+    _free_batches.clear();
+
+    if (_command_pool)
+    {
+        vkDestroyCommandPool(device, _command_pool, nullptr);
+        _command_pool = VK_NULL_HANDLE;
+    }
+
+    if (_staging_memory)
+    {
+        _staging_buffer.unmap();
+        _staging_memory = nullptr;
+    }
+
+    _staging_buffer.destroy();
+    _device = nullptr;
+}
+
+bool UploadQueue::copy_to_buffer(VkBuffer dest, VkDeviceSize dest_offset, const void* data, VkDeviceSize size)
+{
+    if (size > _ring_size)
+    {
+        return false;
+    }
+
+    VkDeviceSize offset;
+
+    while (!allocate(size, offset))
+    {
+        // Ring is full, submit what is queued and wait for the oldest batch to free some space
+        if (!_pending.empty() && !flush())
+        {
+            return false;
+        }
+
+        if (_in_flight.empty())
+        {
+            return false;
+        }
+
+        std::stringstream ss;
+        ss << "upload queue: staging ring full, waiting on batch " << _in_flight.front().id << std::endl;
+        OutputDebugStringA(ss.str().c_str());
+
+        if (!retire(true))
+        {
+            return false;
+        }
+    }
+
+    memcpy(_staging_memory + offset, data, (size_t)size);
+
+    PendingCopy copy;
+    copy.dest = dest;
+    copy.region.srcOffset = offset;
+    copy.region.dstOffset = dest_offset;
+    copy.region.size = size;
+    _pending.push_back(copy);
+
+    return true;
+}
+
+bool UploadQueue::flush()
+{
+    if (_pending.empty())
+    {
+        return true;
+    }
+
+    Batch batch;
+
+    if (!acquire_batch(batch))
+    {
+        return false;
+    }
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK_RESULT(vkBeginCommandBuffer(batch.command_buffer, &begin_info));
+
+    // Consecutive copies to the same buffer go out as one command
+    size_t first = 0;
+    std::vector<VkBufferCopy> regions;
+
+    while (first < _pending.size())
+    {
+        regions.clear();
+        size_t last = first;
+
+        while (last < _pending.size() && _pending[last].dest == _pending[first].dest)
+        {
+            regions.push_back(_pending[last].region);
+            ++last;
+        }
+
+        vkCmdCopyBuffer(batch.command_buffer, (VkBuffer)_staging_buffer, _pending[first].dest, (uint32_t)regions.size(), regions.data());
+        first = last;
+    }
+
+    VK_CHECK_RESULT(vkEndCommandBuffer(batch.command_buffer));
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &batch.command_buffer;
+    VK_CHECK_RESULT(vkQueueSubmit(_device->get_transfer_queue(), 1, &submit_info, batch.fence));
+
+    batch.id = _next_batch++;
+    batch.ring_end = _ring_head;
+    batch.ring_bytes = _pending_bytes;
+    _in_flight.push_back(batch);
+
+    _pending.clear();
+    _pending_bytes = 0;
+
+    return true;
+}
+
+bool UploadQueue::update()
+{
+    return retire(false);
+}
+
+bool UploadQueue::wait_idle()
+{
+    if (!flush())
+    {
+        return false;
+    }
+
+    while (!_in_flight.empty())
+    {
+        if (!retire(true))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void UploadQueue::set_sharing_mode(VkBufferCreateInfo& create_info) const
+{
+    if (_queue_family_indices[0] != _queue_family_indices[1])
+    {
+        // Saves queue family ownership transfers, the buffers are written once and then only read by the graphics queue
+        create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        create_info.queueFamilyIndexCount = 2;
+        create_info.pQueueFamilyIndices = _queue_family_indices;
+    }
+    else
+    {
+        create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        create_info.queueFamilyIndexCount = 0;
+        create_info.pQueueFamilyIndices = nullptr;
+    }
+}
+
+bool UploadQueue::allocate(VkDeviceSize size, VkDeviceSize& offset)
+{
+    if (_ring_used == 0)
+    {
+        _ring_head = 0;
+        _ring_tail = 0;
+    }
+    else if (_ring_head == _ring_tail)
+    {
+        return false;
+    }
+
+    VkDeviceSize aligned_head = (_ring_head + staging_alignment - 1) & ~(staging_alignment - 1);
+    VkDeviceSize padding = aligned_head - _ring_head;
+
+    if (_ring_head >= _ring_tail)
+    {
+        if (aligned_head + size <= _ring_size)
+        {
+            offset = aligned_head;
+        }
+        else if (size <= _ring_tail)
+        {
+            // Wrap, the unused space at the end of the ring is released along with this allocation
+            padding = _ring_size - _ring_head;
+            offset = 0;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else if (aligned_head + size <= _ring_tail)
+    {
+        offset = aligned_head;
+    }
+    else
+    {
+        return false;
+    }
+
+    _ring_head = offset + size;
+    _ring_used += padding + size;
+    _pending_bytes += padding + size;
+
+    return true;
+}
+
+bool UploadQueue::retire(bool wait)
+{
+    VkDevice device = (VkDevice)*_device;
+    bool waited = false;
+
+    while (!_in_flight.empty())
+    {
+        Batch& batch = _in_flight.front();
+
+        if (wait && !waited)
+        {
+            VK_CHECK_RESULT(vkWaitForFences(device, 1, &batch.fence, VK_TRUE, UINT64_MAX));
+            waited = true;
+        }
+        else if (vkGetFenceStatus(device, batch.fence) != VK_SUCCESS)
+        {
+            break;
+        }
+
+        _ring_tail = batch.ring_end;
+        _ring_used -= batch.ring_bytes;
+        _completed_batch = batch.id;
+
+        VK_CHECK_RESULT(vkResetFences(device, 1, &batch.fence));
+        _free_batches.push_back(batch);
+        _in_flight.pop_front();
+    }
+
+    return true;
+}
+
+bool UploadQueue::acquire_batch(Batch& batch)
+{
+    if (!_free_batches.empty())
+    {
+        batch = _free_batches.back();
+        _free_batches.pop_back();
+        VK_CHECK_RESULT(vkResetCommandBuffer(batch.command_buffer, 0));
+        return true;
+    }
+
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = _command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+    VK_CHECK_RESULT(vkAllocateCommandBuffers((VkDevice)*_device, &alloc_info, &batch.command_buffer));
+
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK_RESULT(vkCreateFence((VkDevice)*_device, &fence_create_info, nullptr, &batch.fence));
+
+    return true;
+}
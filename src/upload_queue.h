@@ -0,0 +1,78 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "vulkan_buffer.h"
+
+class VulkanDevice;
+
+// Streams data into device local buffers through a persistently mapped staging ring. Copies are queued on the CPU and recorded
+// into a single command buffer per flush, which is submitted to the transfer queue; batches are retired by polling their fences,
+// which releases their part of the ring. Batch ids increase monotonically so callers can check whether their data has landed.
+class UploadQueue
+{
+public:
+    ~UploadQueue() { destroy(); }
+
+    bool create(VulkanDevice& device, VkDeviceSize staging_size);
+    void destroy();
+
+    // Copies data into the staging ring and queues a copy to dest for the next flush. Blocks on in-flight batches if the ring is
+    // full, fails only if size is larger than the ring.
+    bool copy_to_buffer(VkBuffer dest, VkDeviceSize dest_offset, const void* data, VkDeviceSize size);
+
+    // Submits all queued copies, returns false on submission failure
+    bool flush();
+
+    // Retires batches whose fences have signalled
+    bool update();
+
+    // Flushes and waits for every batch to complete
+    bool wait_idle();
+
+    // Batch that copies queued now will be part of
+    uint64_t get_pending_batch() const { return _next_batch; }
+    bool is_complete(uint64_t batch) const { return batch <= _completed_batch; }
+
+    // Sharing mode for buffers written by this queue and read by the graphics queue
+    void set_sharing_mode(VkBufferCreateInfo& create_info) const;
+
+private:
+    struct PendingCopy
+    {
+        VkBuffer dest;
+        VkBufferCopy region;
+    };
+
+    struct Batch
+    {
+        VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        uint64_t id = 0;
+        VkDeviceSize ring_end = 0;  // ring head after this batch's allocations
+        VkDeviceSize ring_bytes = 0; // bytes (including padding) released when it completes
+    };
+
+    bool allocate(VkDeviceSize size, VkDeviceSize& offset);
+    bool retire(bool wait);
+    bool acquire_batch(Batch& batch);
+
+    VulkanDevice* _device = nullptr;
+    VulkanBuffer _staging_buffer;
+    uint8_t* _staging_memory = nullptr;
+    VkDeviceSize _ring_size = 0;
+    VkDeviceSize _ring_head = 0;
+    VkDeviceSize _ring_tail = 0;
+    VkDeviceSize _ring_used = 0;
+    VkDeviceSize _pending_bytes = 0;
+
+    VkCommandPool _command_pool = VK_NULL_HANDLE;
+    std::vector<PendingCopy> _pending;
+    std::deque<Batch> _in_flight;
+    std::vector<Batch> _free_batches;
+    uint64_t _next_batch = 1;
+    uint64_t _completed_batch = 0;
+    uint32_t _queue_family_indices[2] = {};
+};
@@ -24,7 +24,7 @@ bool VertexBuffer::create(VulkanDevice& device, const VertexDecl& decl, uint32_t
 
     if (!device.create_buffer(_memory_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                              _vertex_buffer, _device_memory))
+                              _vertex_buffer, _device_memory, _memory_offset))
     {
         return false;
     }
@@ -42,20 +42,18 @@ void VertexBuffer::destroy()
 
     if (_device_memory)
     {
-        vkFreeMemory((VkDevice)*_device, _device_memory, nullptr);
+        _device->free_memory(_device_memory, _memory_offset);
         _device_memory = VK_NULL_HANDLE;
     }
 }
 
 bool VertexBuffer::map(void** mem)
 {
-    VK_CHECK_RESULT(vkMapMemory((VkDevice)*_device, _device_memory, 0, _memory_size, 0, mem));
-    return true;
+    return _device->map_memory(_device_memory, _memory_offset, mem);
 }
 
 void VertexBuffer::unmap()
 {
-    vkUnmapMemory((VkDevice)*_device, _device_memory);
 }
 
 bool VertexBuffer::bind(std::vector<VkVertexInputBindingDescription>& bindings, std::vector<VkVertexInputAttributeDescription>& attributes)
@@ -34,5 +34,6 @@ private:
     uint32_t _memory_size = 0;
     VkBuffer _vertex_buffer = VK_NULL_HANDLE;
     VkDeviceMemory _device_memory = VK_NULL_HANDLE;
+    VkDeviceSize _memory_offset = 0;
     VulkanDevice* _device = nullptr;
 };
\ No newline at end of file
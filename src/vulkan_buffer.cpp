@@ -7,7 +7,7 @@ bool VulkanBuffer::create(VulkanDevice& device, VkDeviceSize size, VkBufferUsage
 {
     _device = &device;
     _size = size;
-    return device.create_buffer(size, usage, memory_properties, _buffer, _memory);
+    return device.create_buffer(size, usage, memory_properties, _buffer, _memory, _memory_offset);
 }
 
 void VulkanBuffer::destroy()
@@ -20,20 +20,19 @@ void VulkanBuffer::destroy()
 
     if (_memory)
     {
-        vkFreeMemory((VkDevice)*_device, _memory, nullptr);
+        _device->free_memory(_memory, _memory_offset);
         _memory = VK_NULL_HANDLE;
     }
 }
 
 bool VulkanBuffer::map(void** mem)
 {
-    VK_CHECK_RESULT(vkMapMemory((VkDevice)*_device, _memory, 0, _size, 0, mem));
-    return true;
+    // Host visible blocks are persistently mapped by the device's allocator
+    return _device->map_memory(_memory, _memory_offset, mem);
 }
 
 void VulkanBuffer::unmap()
 {
-    vkUnmapMemory((VkDevice)*_device, _memory);
 }
 
 VkDescriptorBufferInfo VulkanBuffer::get_descriptor_info() const
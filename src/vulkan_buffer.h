@@ -24,5 +24,6 @@ private:
     VulkanDevice* _device = nullptr;
     VkBuffer _buffer = VK_NULL_HANDLE;
     VkDeviceMemory _memory = VK_NULL_HANDLE;
+    VkDeviceSize _memory_offset = 0;
     VkDeviceSize _size = 0;
 };
\ No newline at end of file
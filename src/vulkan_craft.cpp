@@ -1,5 +1,6 @@
 #include <Windows.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <GLFW/glfw3.h>
 #include <glm/gtc/matrix_transform.hpp>
@@ -7,9 +8,10 @@
 
 #include "camera.h"
 #include "geometry.h"
+#include "job_system.h"
 #include "renderer.h"
 
-void run_game(GLFWwindow* window);
+void run_game(GLFWwindow* window, uint32_t thread_count, uint32_t frames_in_flight);
 void set_window_size(GLFWwindow* window, int width, int height);
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
@@ -17,6 +19,24 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     wchar_t cwd[MAX_PATH];
     GetCurrentDirectory(MAX_PATH, cwd);
 
+    // "-threads N" overrides the worker count, which defaults to one per hardware thread
+    uint32_t thread_count = 0;
+    const char* threads_arg = lpCmdLine ? strstr(lpCmdLine, "-threads ") : nullptr;
+
+    if (threads_arg)
+    {
+        thread_count = (uint32_t)atoi(threads_arg + strlen("-threads "));
+    }
+
+    // "-frames N" sets the number of frames in flight
+    uint32_t frames_in_flight = 2;
+    const char* frames_arg = lpCmdLine ? strstr(lpCmdLine, "-frames ") : nullptr;
+
+    if (frames_arg)
+    {
+        frames_in_flight = (uint32_t)atoi(frames_arg + strlen("-frames "));
+    }
+
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -24,7 +44,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     GLFWwindow* window = glfwCreateWindow(1024, 576, "VulkanCraft", nullptr, nullptr);
     glfwSetWindowSizeCallback(window, set_window_size);
 
-    run_game(window);
+    run_game(window, thread_count, frames_in_flight);
 
     glfwDestroyWindow(window);
     glfwTerminate();
@@ -36,7 +56,11 @@ Renderer _renderer;
 Camera _camera;
 float _mouse_x;
 float _mouse_y;
-WorldGen _world_gen(_renderer);
+JobSystem _jobs;
+WorldGen _world_gen(_renderer, _jobs);
+
+// Far plane distance. Chunks beyond the first few rings are drawn with downsampled meshes, see WorldGen::set_lod_radius.
+static const float view_distance = 640.0f;
 
 void poll_mouse(GLFWwindow* window, float& x, float& y)
 {
@@ -88,15 +112,22 @@ void update_input(GLFWwindow* window, float delta)
 
 extern bool UpdateClipFrustum;
 
-void run_game(GLFWwindow* window)
+void run_game(GLFWwindow* window, uint32_t thread_count, uint32_t frames_in_flight)
 {
     if (!window)
     {
         return;
     }
 
-    if (!_renderer.initialise(window))
+    // Started first so the renderer can decode textures on the workers
+    if (!_jobs.initialise(thread_count))
+    {
+        return;
+    }
+
+    if (!_renderer.initialise(window, frames_in_flight, &_jobs))
     {
+        _jobs.shutdown();
         return;
     }
 
@@ -106,11 +137,25 @@ void run_game(GLFWwindow* window)
 
     float prev_time = (float)glfwGetTime();
 
-    int gen_radius = (200 + Chunk::chunk_size) / Chunk::chunk_size;
-    _world_gen.generate_around(0.0, 0.0, gen_radius);
+    // Render out to the far plane, load one ring further so neighbouring chunks are resident and keep two more rings as hysteresis
+    int render_radius = ((int)view_distance + Chunk::chunk_size) / Chunk::chunk_size;
+    _world_gen.set_zones(render_radius, render_radius + 1, render_radius + 3);
+    _world_gen.set_lod_radius(3);
+    _world_gen.update(0.0, 0.0);
+    _world_gen.wait();
     poll_mouse(window, _mouse_x, _mouse_y);
 
     int p_state = glfwGetKey(window, GLFW_KEY_P);
+    int m_state = glfwGetKey(window, GLFW_KEY_M);
+    int i_state = glfwGetKey(window, GLFW_KEY_I);
+    int g_state = glfwGetKey(window, GLFW_KEY_G);
+    int v_state = glfwGetKey(window, GLFW_KEY_V);
+    int b_state = glfwGetKey(window, GLFW_KEY_B);
+    int o_state = glfwGetKey(window, GLFW_KEY_O);
+    int k_state = glfwGetKey(window, GLFW_KEY_K);
+    int l_state = glfwGetKey(window, GLFW_KEY_L);
+    int f_state = glfwGetKey(window, GLFW_KEY_F);
+    int x_state = glfwGetKey(window, GLFW_KEY_X);
 
     while (!glfwWindowShouldClose(window))
     {
@@ -131,7 +176,105 @@ void run_game(GLFWwindow* window)
             }
         }
 
-        _world_gen.generate_around(_camera.position.x, _camera.position.z, gen_radius);
+        if (glfwGetKey(window, GLFW_KEY_M) != m_state)
+        {
+            m_state = glfwGetKey(window, GLFW_KEY_M);
+            if (m_state == GLFW_PRESS)
+            {
+                MeshMode mode = _world_gen.get_mesh_mode() == MeshMode::Greedy ? MeshMode::Naive : MeshMode::Greedy;
+                _world_gen.set_mesh_mode(mode);
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_I) != i_state)
+        {
+            i_state = glfwGetKey(window, GLFW_KEY_I);
+            if (i_state == GLFW_PRESS)
+            {
+                _renderer.log_memory_stats();
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_G) != g_state)
+        {
+            g_state = glfwGetKey(window, GLFW_KEY_G);
+            if (g_state == GLFW_PRESS)
+            {
+                _renderer.set_gpu_culling(!_renderer.get_gpu_culling());
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_V) != v_state)
+        {
+            v_state = glfwGetKey(window, GLFW_KEY_V);
+            if (v_state == GLFW_PRESS)
+            {
+                _renderer.verify_gpu_culling();
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_B) != b_state)
+        {
+            b_state = glfwGetKey(window, GLFW_KEY_B);
+            if (b_state == GLFW_PRESS)
+            {
+                _renderer.benchmark_culling();
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_O) != o_state)
+        {
+            o_state = glfwGetKey(window, GLFW_KEY_O);
+            if (o_state == GLFW_PRESS)
+            {
+                _renderer.set_occlusion_culling(!_renderer.get_occlusion_culling());
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_K) != k_state)
+        {
+            k_state = glfwGetKey(window, GLFW_KEY_K);
+            if (k_state == GLFW_PRESS)
+            {
+                _renderer.set_occlusion_buffer(!_renderer.get_occlusion_buffer());
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_L) != l_state)
+        {
+            l_state = glfwGetKey(window, GLFW_KEY_L);
+            if (l_state == GLFW_PRESS)
+            {
+                _renderer.dump_occlusion_buffer();
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_F) != f_state)
+        {
+            f_state = glfwGetKey(window, GLFW_KEY_F);
+            if (f_state == GLFW_PRESS)
+            {
+                _renderer.log_face_culling_stats();
+                _renderer.set_face_culling(!_renderer.get_face_culling());
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_X) != x_state)
+        {
+            x_state = glfwGetKey(window, GLFW_KEY_X);
+            if (x_state == GLFW_PRESS)
+            {
+                // Digs out the block underfoot, down to the bedrock
+                int y = (int)_world_gen.get_height(_camera.position.x, _camera.position.z) - 1;
+
+                if (y > 0)
+                {
+                    _world_gen.set_block((int)floor(_camera.position.x), y, (int)floor(_camera.position.z), BlockType::Air);
+                }
+            }
+        }
+
+        _world_gen.update(_camera.position.x, _camera.position.z);
         float height = _world_gen.get_height(_camera.position.x, _camera.position.z) + 1.8f;
 
         if (_camera.position.y < height || glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS)
@@ -140,6 +283,7 @@ void run_game(GLFWwindow* window)
         }
 
         _renderer.set_view_matrix(_camera.get_view_matrix());
+        _renderer.set_camera_position(_camera.position);
 
         glm::mat4x4 model;
         _renderer.set_model_matrix(model);
@@ -150,6 +294,9 @@ void run_game(GLFWwindow* window)
         }
     }
 
+    // Flushes modified chunks to the region files before the workers go away
+    _world_gen.shutdown();
+    _jobs.shutdown();
     _renderer.shutdown();
 }
 
@@ -157,7 +304,7 @@ void set_window_size(GLFWwindow* window, int width, int height)
 {
     if (width && height)
     {
-        glm::mat4x4 proj = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.25f, 200.0f);
+        glm::mat4x4 proj = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.25f, view_distance);
         proj[1] *= -1.0f;
         _renderer.set_proj_matrix(proj);
         poll_mouse(window, _mouse_x, _mouse_y);
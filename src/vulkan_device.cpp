@@ -1,5 +1,7 @@
 #include "vulkan_device.h"
 
+#include <string.h>
+
 #include "texture_cache.h"
 #include "vulkan.h"
 #include "vulkan_buffer.h"
@@ -24,6 +26,10 @@ VulkanDevice& VulkanDevice::operator=(VulkanDevice&& rhs)
     _device = rhs._device;
     _graphics_queue = rhs._graphics_queue;
     _graphics_queue_index = rhs._graphics_queue_index;
+    _transfer_queue = rhs._transfer_queue;
+    _transfer_queue_index = rhs._transfer_queue_index;
+    _draw_indirect_count = rhs._draw_indirect_count;
+    _allocator = std::move(rhs._allocator);
 
     rhs._memory_properties = {};
     rhs._properties = {};
@@ -34,6 +40,8 @@ VulkanDevice& VulkanDevice::operator=(VulkanDevice&& rhs)
     rhs._device = VK_NULL_HANDLE;
     rhs._graphics_queue = VK_NULL_HANDLE;
     rhs._graphics_queue_index = VK_NULL_HANDLE;
+    rhs._transfer_queue = VK_NULL_HANDLE;
+    rhs._transfer_queue_index = UINT32_MAX;
 
     return *this;
 }
@@ -68,25 +76,74 @@ bool VulkanDevice::create()
 {
     _graphics_queue_index = find_queue_family_index(VK_QUEUE_GRAPHICS_BIT);
 
-    VkDeviceQueueCreateInfo queue_create_info = {};
-    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = _graphics_queue_index;
-    queue_create_info.queueCount = 1;
+    // Prefer a family without graphics or compute (usually the DMA engine, which also tends to report sparse binding so
+    // find_queue_family_index's exact match misses it), otherwise share the graphics family
+    _transfer_queue_index = find_queue_family_index(VK_QUEUE_TRANSFER_BIT);
+
+    for (uint32_t i = 0; i < _queue_family_properties.size(); ++i)
+    {
+        VkQueueFlags flags = _queue_family_properties[i].queueFlags;
+
+        if (_queue_family_properties[i].queueCount && (flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+        {
+            _transfer_queue_index = i;
+            break;
+        }
+    }
+
+    if (_transfer_queue_index == UINT32_MAX)
+    {
+        _transfer_queue_index = _graphics_queue_index;
+    }
+
     float queue_priorities = 0.0f;
-    queue_create_info.pQueuePriorities = &queue_priorities;
+    VkDeviceQueueCreateInfo queue_create_infos[2] = {};
+    queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_create_infos[0].queueFamilyIndex = _graphics_queue_index;
+    queue_create_infos[0].queueCount = 1;
+    queue_create_infos[0].pQueuePriorities = &queue_priorities;
+    queue_create_infos[1] = queue_create_infos[0];
+    queue_create_infos[1].queueFamilyIndex = _transfer_queue_index;
+    uint32_t queue_create_info_count = (_transfer_queue_index != _graphics_queue_index) ? 2 : 1;
 
     std::vector<const char*> device_extensions;
     device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
+    uint32_t extension_count = 0;
+    VK_CHECK_RESULT(vkEnumerateDeviceExtensionProperties(_physical_device, nullptr, &extension_count, nullptr));
+    std::vector<VkExtensionProperties> extensions(extension_count);
+    VK_CHECK_RESULT(vkEnumerateDeviceExtensionProperties(_physical_device, nullptr, &extension_count, extensions.data()));
+    _draw_indirect_count = false;
+
+    for (const VkExtensionProperties& extension : extensions)
+    {
+        if (strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0)
+        {
+            // Lets GPU culling compact its draws and supply the count
+            device_extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+            _draw_indirect_count = true;
+        }
+    }
+
+    // Chunk rendering batches its draws through indirect buffers when these are available
+    VkPhysicalDeviceFeatures enabled_features = {};
+    enabled_features.multiDrawIndirect = _features.multiDrawIndirect;
+    enabled_features.drawIndirectFirstInstance = _features.drawIndirectFirstInstance;
+    enabled_features.textureCompressionBC = _features.textureCompressionBC;
+
     VkDeviceCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    create_info.queueCreateInfoCount = 1;
-    create_info.pQueueCreateInfos = &queue_create_info;
+    create_info.pEnabledFeatures = &enabled_features;
+    create_info.queueCreateInfoCount = queue_create_info_count;
+    create_info.pQueueCreateInfos = queue_create_infos;
     create_info.enabledExtensionCount = (uint32_t)device_extensions.size();
     create_info.ppEnabledExtensionNames = device_extensions.data();
     VK_CHECK_RESULT(vkCreateDevice(_physical_device, &create_info, nullptr, &_device));
 
-    vkGetDeviceQueue(_device, queue_create_info.queueFamilyIndex, 0, &_graphics_queue);
+    vkGetDeviceQueue(_device, _graphics_queue_index, 0, &_graphics_queue);
+    vkGetDeviceQueue(_device, _transfer_queue_index, 0, &_transfer_queue);
+
+    _allocator.initialise(_device, _memory_properties, 64 * 1024 * 1024);
 
     if (!create_command_pool(VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, _copy_command_pool))
     {
@@ -104,6 +161,8 @@ void VulkanDevice::destroy()
         _copy_command_pool = VK_NULL_HANDLE;
     }
 
+    _allocator.destroy();
+
     if (_device)
     {
         vkDestroyDevice(_device, nullptr);
@@ -116,6 +175,14 @@ VkResult VulkanDevice::get_surface_capabilities(VkSurfaceCapabilitiesKHR& surfac
     return vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_physical_device, _surface, &surface_capabilities);
 }
 
+bool VulkanDevice::supports_format(VkFormat format, VkFormatFeatureFlags features) const
+{
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(_physical_device, format, &properties);
+
+    return (properties.optimalTilingFeatures & features) == features;
+}
+
 uint32_t VulkanDevice::find_queue_family_index(VkQueueFlags flags) const
 {
     uint32_t valid = UINT32_MAX;
@@ -161,18 +228,18 @@ uint32_t VulkanDevice::find_queue_family_index(VkQueueFlags flags) const
     return valid;
 }
 
-bool VulkanDevice::create_command_pool(VkCommandPoolCreateFlags flags, VkCommandPool& command_pool)
+bool VulkanDevice::create_command_pool(VkCommandPoolCreateFlags flags, VkCommandPool& command_pool, uint32_t queue_family_index)
 {
     VkCommandPoolCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     create_info.flags = flags;
-    create_info.queueFamilyIndex = _graphics_queue_index;
+    create_info.queueFamilyIndex = (queue_family_index != UINT32_MAX) ? queue_family_index : _graphics_queue_index;
     VK_CHECK_RESULT(vkCreateCommandPool(_device, &create_info, nullptr, &command_pool));
     return true;
 }
 
 bool VulkanDevice::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                                 VkDeviceMemory& memory)
+                                 VkDeviceMemory& memory, VkDeviceSize& offset)
 {
     VkBufferCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -184,8 +251,6 @@ bool VulkanDevice::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, Vk
     VkMemoryRequirements memory_requirements;
     vkGetBufferMemoryRequirements(_device, buffer, &memory_requirements);
 
-    VkDeviceSize offset;
-
     if (!allocate_memory(properties, memory_requirements, memory, offset))
     {
         return false;
@@ -196,7 +261,8 @@ bool VulkanDevice::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, Vk
     return true;
 }
 
-bool VulkanDevice::allocate_memory(VkMemoryPropertyFlags properties, VkMemoryRequirements requirements, VkDeviceMemory& memory, VkDeviceSize& offset)
+bool VulkanDevice::allocate_memory(VkMemoryPropertyFlags properties, VkMemoryRequirements requirements, VkDeviceMemory& memory, VkDeviceSize& offset,
+                                   bool linear)
 {
     uint32_t memory_type_index;
     for (memory_type_index = 0; memory_type_index < _memory_properties.memoryTypeCount; ++memory_type_index)
@@ -217,15 +283,18 @@ bool VulkanDevice::allocate_memory(VkMemoryPropertyFlags properties, VkMemoryReq
         return false;
     }
 
-    VkMemoryAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = requirements.size;
-    alloc_info.memoryTypeIndex = memory_type_index;
-    VK_CHECK_RESULT(vkAllocateMemory(_device, &alloc_info, nullptr, &memory));
+    return _allocator.allocate(memory_type_index, requirements, linear, memory, offset);
+}
 
-    offset = 0;
+void VulkanDevice::free_memory(VkDeviceMemory memory, VkDeviceSize offset)
+{
+    _allocator.free(memory, offset);
+}
 
-    return true;
+bool VulkanDevice::map_memory(VkDeviceMemory memory, VkDeviceSize offset, void** mem) const
+{
+    *mem = _allocator.get_mapped_pointer(memory, offset);
+    return *mem != nullptr;
 }
 
 void VulkanDevice::submit(VkCommandBuffer buffer, uint32_t wait_semaphore_count, VkSemaphore* wait_semaphores,
@@ -339,51 +408,41 @@ bool VulkanDevice::upload_texture(TextureArray& texture_array)
         return false;
     }
 
-    VkImageMemoryBarrier to_transition_dst = {};
-    to_transition_dst.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    to_transition_dst.srcAccessMask = 0;
-    to_transition_dst.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    to_transition_dst.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    to_transition_dst.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    to_transition_dst.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    to_transition_dst.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    to_transition_dst.image = texture_array._image;
-    to_transition_dst.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    to_transition_dst.subresourceRange.baseMipLevel = 0;
-    to_transition_dst.subresourceRange.levelCount = 1;
-    to_transition_dst.subresourceRange.baseArrayLayer = 0;
-    to_transition_dst.subresourceRange.layerCount = texture_array._layer_count;
-    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                         &to_transition_dst);
-
-    VkBufferImageCopy region = {};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = texture_array._layer_count;
-    region.imageExtent = texture_array._image.get_extent();
-    vkCmdCopyBufferToImage(command_buffer, (VkBuffer)texture_array._staging_buffer, (VkImage)texture_array._image,
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    // Each image's regions were laid out against the staging buffer when it was created
+    for (const TextureArray::ArrayImage& image : texture_array._images)
+    {
+        if (!image.layer_count)
+        {
+            continue;
+        }
 
-    VkImageMemoryBarrier to_shader = {};
-    to_transition_dst.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    to_transition_dst.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    to_transition_dst.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    to_transition_dst.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    to_transition_dst.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    to_transition_dst.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    to_transition_dst.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    to_transition_dst.image = texture_array._image;
-    to_transition_dst.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    to_transition_dst.subresourceRange.baseMipLevel = 0;
-    to_transition_dst.subresourceRange.levelCount = 1;
-    to_transition_dst.subresourceRange.baseArrayLayer = 0;
-    to_transition_dst.subresourceRange.layerCount = texture_array._layer_count;
-    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                         &to_transition_dst);
+        VkImageMemoryBarrier to_transition_dst = {};
+        to_transition_dst.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        to_transition_dst.srcAccessMask = 0;
+        to_transition_dst.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        to_transition_dst.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        to_transition_dst.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        to_transition_dst.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        to_transition_dst.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        to_transition_dst.image = image.image;
+        to_transition_dst.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        to_transition_dst.subresourceRange.baseMipLevel = 0;
+        to_transition_dst.subresourceRange.levelCount = image.image.get_mip_levels();
+        to_transition_dst.subresourceRange.baseArrayLayer = 0;
+        to_transition_dst.subresourceRange.layerCount = image.layer_count;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                             &to_transition_dst);
+
+        vkCmdCopyBufferToImage(command_buffer, (VkBuffer)texture_array._staging_buffer, (VkImage)image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               (uint32_t)image.regions.size(), image.regions.data());
+
+        to_transition_dst.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        to_transition_dst.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        to_transition_dst.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        to_transition_dst.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                             &to_transition_dst);
+    }
 
     VK_CHECK_RESULT(vkEndCommandBuffer(command_buffer));
 
@@ -3,6 +3,8 @@
 #include <vector>
 #include <vulkan/vulkan.h>
 
+#include "memory_allocator.h"
+
 class VulkanBuffer;
 class Texture;
 class TextureArray;
@@ -30,16 +32,34 @@ public:
     VkResult get_surface_capabilities(VkSurfaceCapabilitiesKHR& surface_capabilities) const;
     const VkQueue& get_graphics_queue() const { return _graphics_queue; }
     uint32_t get_graphics_queue_index() const { return _graphics_queue_index; }
+    const VkQueue& get_transfer_queue() const { return _transfer_queue; }
+    uint32_t get_transfer_queue_index() const { return _transfer_queue_index; }
+    VkQueueFlags get_graphics_queue_flags() const { return _queue_family_properties[_graphics_queue_index].queueFlags; }
+
+    // VK_KHR_draw_indirect_count, enabled by create() when the device has it
+    bool supports_draw_indirect_count() const { return _draw_indirect_count; }
 
     const std::vector<VkSurfaceFormatKHR>& get_surface_formats() const { return _surface_formats; }
     const std::vector<VkPresentModeKHR>& get_present_modes() const { return _present_modes; }
 
     uint32_t find_queue_family_index(VkQueueFlags flags) const;
+    // Whether optimally tiled images of the format have all the features
+    bool supports_format(VkFormat format, VkFormatFeatureFlags features) const;
+
+    bool create_command_pool(VkCommandPoolCreateFlags flags, VkCommandPool& command_pool, uint32_t queue_family_index = UINT32_MAX);
+    bool create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& memory,
+                       VkDeviceSize& offset);
+
+    // Memory is sub-allocated from shared blocks, so always bind at the returned offset and release with free_memory. Pass
+    // linear = false for optimally tiled images.
+    bool allocate_memory(VkMemoryPropertyFlags properties, VkMemoryRequirements requirements, VkDeviceMemory& memory, VkDeviceSize& offset,
+                         bool linear = true);
+    void free_memory(VkDeviceMemory memory, VkDeviceSize offset);
 
-    bool create_command_pool(VkCommandPoolCreateFlags flags, VkCommandPool& command_pool);
-    bool create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& memory);
+    // Host visible memory stays mapped for its lifetime, this just returns the address of the allocation
+    bool map_memory(VkDeviceMemory memory, VkDeviceSize offset, void** mem) const;
 
-    bool allocate_memory(VkMemoryPropertyFlags properties, VkMemoryRequirements requirements, VkDeviceMemory& memory, VkDeviceSize& offset);
+    const MemoryAllocator& get_allocator() const { return _allocator; }
 
     void submit(VkCommandBuffer buffer, uint32_t wait_semaphore_count, VkSemaphore* wait_semaphores, const VkPipelineStageFlags* wait_stage_mask,
                 uint32_t signal_semaphore_count, VkSemaphore* signal_semaphores, VkFence fence);
@@ -61,5 +81,9 @@ private:
     VkDevice _device = VK_NULL_HANDLE;
     VkQueue _graphics_queue = VK_NULL_HANDLE;
     uint32_t _graphics_queue_index = UINT32_MAX;
+    VkQueue _transfer_queue = VK_NULL_HANDLE;        // same as the graphics queue if there is no dedicated transfer family
+    uint32_t _transfer_queue_index = UINT32_MAX;
+    bool _draw_indirect_count = false;
     VkCommandPool _copy_command_pool = VK_NULL_HANDLE;
+    MemoryAllocator _allocator;
 };
@@ -4,7 +4,7 @@
 #include "vulkan_device.h"
 
 bool VulkanImage::create(VulkanDevice& device, VkImageType image_type, VkFormat format, uint32_t width, uint32_t height, uint32_t depth,
-                         uint32_t array_layers, VkImageUsageFlags usage)
+                         uint32_t array_layers, VkImageUsageFlags usage, uint32_t mip_levels)
 {
     _device = &device;
 
@@ -13,8 +13,7 @@ bool VulkanImage::create(VulkanDevice& device, VkImageType image_type, VkFormat
     create_info.imageType = image_type;
     create_info.format = format;
     create_info.extent = { width, height, depth };
-    create_info.mipLevels = 1;
-    ;
+    create_info.mipLevels = mip_levels;
     create_info.arrayLayers = array_layers;
     create_info.samples = VK_SAMPLE_COUNT_1_BIT;
     create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
@@ -25,17 +24,17 @@ bool VulkanImage::create(VulkanDevice& device, VkImageType image_type, VkFormat
 
     VkMemoryRequirements memory_requirements = {};
     vkGetImageMemoryRequirements((VkDevice)*_device, _image, &memory_requirements);
-    VkDeviceSize offset;
 
-    if (!_device->allocate_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_requirements, _memory, offset))
+    if (!_device->allocate_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory_requirements, _memory, _memory_offset, false))
     {
         return false;
     }
 
-    VK_CHECK_RESULT(vkBindImageMemory((VkDevice)*_device, _image, _memory, offset));
+    VK_CHECK_RESULT(vkBindImageMemory((VkDevice)*_device, _image, _memory, _memory_offset));
 
     _extent = create_info.extent;
     _format = create_info.format;
+    _mip_levels = mip_levels;
 
     return true;
 }
@@ -50,7 +49,7 @@ void VulkanImage::destroy()
 
     if (_memory)
     {
-        vkFreeMemory((VkDevice)*_device, _memory, nullptr);
+        _device->free_memory(_memory, _memory_offset);
         _memory = VK_NULL_HANDLE;
     }
 }
@@ -8,12 +8,13 @@ class VulkanImage
 {
 public:
     bool create(VulkanDevice& device, VkImageType image_type, VkFormat format, uint32_t width, uint32_t height, uint32_t depth, uint32_t array_layers,
-                VkImageUsageFlags usage);
+                VkImageUsageFlags usage, uint32_t mip_levels = 1);
     void destroy();
 
     operator VkImage() const { return _image; }
 
     VkExtent3D get_extent() const { return _extent; }
+    uint32_t get_mip_levels() const { return _mip_levels; }
 
     bool create_view(VkImageViewType viewType, VkImageAspectFlags aspect_mask, uint32_t base_mip_level, uint32_t level_count,
                      uint32_t base_array_layer, uint32_t layer_count, VkImageView& view);
@@ -22,6 +23,8 @@ private:
     VulkanDevice* _device = nullptr;
     VkImage _image = VK_NULL_HANDLE;
     VkDeviceMemory _memory = VK_NULL_HANDLE;
+    VkDeviceSize _memory_offset = 0;
     VkExtent3D _extent = {};
     VkFormat _format = VK_FORMAT_UNDEFINED;
+    uint32_t _mip_levels = 1;
 };
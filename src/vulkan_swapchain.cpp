@@ -6,9 +6,6 @@
 bool Swapchain::initialise(VulkanDevice& device)
 {
     _device = &device;
-    VkSemaphoreCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK_RESULT(vkCreateSemaphore((VkDevice)device, &create_info, nullptr, &_image_acquired_semaphore));
     return true;
 }
 
@@ -41,7 +38,7 @@ void choose_surface_format(const std::vector<VkSurfaceFormatKHR>& surface_format
     }
 }
 
-bool Swapchain::create(uint32_t* width, uint32_t* height, bool vsync)
+bool Swapchain::create(uint32_t* width, uint32_t* height, bool vsync, Retired* retired)
 {
     VkSwapchainKHR old_swapchain = _swapchain;
 
@@ -132,9 +129,15 @@ bool Swapchain::create(uint32_t* width, uint32_t* height, bool vsync)
 
     VK_CHECK_RESULT(vkCreateSwapchainKHR((VkDevice)*_device, &create_info, nullptr, &_swapchain));
 
-    if (old_swapchain)
+    if (old_swapchain && retired)
     {
-        cleanup_swapchain(old_swapchain);
+        retired->swapchain = old_swapchain;
+        retired->image_views = std::move(_image_views);
+        _image_views.clear();
+    }
+    else if (old_swapchain)
+    {
+        cleanup_swapchain(old_swapchain, _image_views);
     }
 
     if (!get_images())
@@ -149,19 +152,22 @@ void Swapchain::destroy()
 {
     if (_swapchain)
     {
-        cleanup_swapchain(_swapchain);
+        cleanup_swapchain(_swapchain, _image_views);
     }
+}
 
-    if (_image_acquired_semaphore)
+void Swapchain::destroy(Retired& retired)
+{
+    if (retired.swapchain)
     {
-        vkDestroySemaphore((VkDevice)*_device, _image_acquired_semaphore, nullptr);
+        cleanup_swapchain(retired.swapchain, retired.image_views);
+        retired.swapchain = VK_NULL_HANDLE;
     }
 }
 
-bool Swapchain::begin_frame()
+bool Swapchain::begin_frame(VkSemaphore image_acquired)
 {
-    VK_CHECK_RESULT(
-            vkAcquireNextImageKHR((VkDevice)*_device, _swapchain, UINT64_MAX, _image_acquired_semaphore, nullptr, &_acquired_image_index));
+    VK_CHECK_RESULT(vkAcquireNextImageKHR((VkDevice)*_device, _swapchain, UINT64_MAX, image_acquired, nullptr, &_acquired_image_index));
     return true;
 }
 
@@ -209,12 +215,14 @@ bool Swapchain::get_images()
     return true;
 }
 
-void Swapchain::cleanup_swapchain(VkSwapchainKHR swapchain)
+void Swapchain::cleanup_swapchain(VkSwapchainKHR swapchain, std::vector<VkImageView>& image_views)
 {
-    for (VkImageView& image_view : _image_views)
+    for (VkImageView& image_view : image_views)
     {
         vkDestroyImageView((VkDevice)*_device, image_view, nullptr);
     }
 
+    image_views.clear();
+
     vkDestroySwapchainKHR((VkDevice)*_device, swapchain, nullptr);
 }
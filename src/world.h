@@ -45,7 +45,7 @@ struct Chunk
 struct ChunkMap
 {
     typedef uint64_t Key;
-    Key key(int32_t x, int32_t z) { return ((((uint64_t)x) << 32) & 0xffffffff00000000) | (((uint32_t)z) & 0xffffffff); }
+    static Key key(int32_t x, int32_t z) { return ((((uint64_t)x) << 32) & 0xffffffff00000000) | (((uint32_t)z) & 0xffffffff); }
     std::map<uint64_t, Chunk> chunks;
 };
 }
@@ -0,0 +1,814 @@
+#include "bc_codec.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace bc_codec
+{
+
+// How much a texel counts when fitting colour, transparent texels not at all when alpha_weighted
+static float texel_weight(const uint8_t* pixels, uint32_t i, bool alpha_weighted)
+{
+    return alpha_weighted ? pixels[i * 4 + 3] / 255.0f : 1.0f;
+}
+
+// Direction of greatest variance of the block's texels, over the first channel_count channels, by power iteration
+static void principal_axis(const uint8_t* pixels, uint32_t channel_count, bool alpha_weighted, float* mean, float* axis)
+{
+    float covariance[4][4] = {};
+    float total_weight = 0.0f;
+
+    for (uint32_t c = 0; c < channel_count; ++c)
+    {
+        mean[c] = 0.0f;
+    }
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        float weight = texel_weight(pixels, i, alpha_weighted);
+        total_weight += weight;
+
+        for (uint32_t c = 0; c < channel_count; ++c)
+        {
+            mean[c] += pixels[i * 4 + c] * weight;
+        }
+    }
+
+    // A wholly transparent block still needs endpoints
+    if (total_weight <= 0.0f)
+    {
+        principal_axis(pixels, channel_count, false, mean, axis);
+        return;
+    }
+
+    for (uint32_t c = 0; c < channel_count; ++c)
+    {
+        mean[c] /= total_weight;
+    }
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        float weight = texel_weight(pixels, i, alpha_weighted);
+
+        for (uint32_t a = 0; a < channel_count; ++a)
+        {
+            for (uint32_t b = 0; b < channel_count; ++b)
+            {
+                covariance[a][b] += (pixels[i * 4 + a] - mean[a]) * (pixels[i * 4 + b] - mean[b]) * weight;
+            }
+        }
+    }
+
+    for (uint32_t c = 0; c < channel_count; ++c)
+    {
+        axis[c] = 1.0f;
+    }
+
+    for (uint32_t iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4] = {};
+        float length = 0.0f;
+
+        for (uint32_t a = 0; a < channel_count; ++a)
+        {
+            for (uint32_t b = 0; b < channel_count; ++b)
+            {
+                next[a] += covariance[a][b] * axis[b];
+            }
+
+            length += next[a] * next[a];
+        }
+
+        // A flat block has no variance, any axis will do
+        if (length < 1e-6f)
+        {
+            break;
+        }
+
+        length = sqrtf(length);
+
+        for (uint32_t c = 0; c < channel_count; ++c)
+        {
+            axis[c] = next[c] / length;
+        }
+    }
+}
+
+// Extremes of the block projected onto the axis
+static void project_extremes(const uint8_t* pixels, uint32_t channel_count, bool alpha_weighted, const float* mean, const float* axis,
+                             float* low, float* high)
+{
+    float min_t = 0.0f;
+    float max_t = 0.0f;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        if (texel_weight(pixels, i, alpha_weighted) <= 0.0f)
+        {
+            continue;
+        }
+
+        float t = 0.0f;
+
+        for (uint32_t c = 0; c < channel_count; ++c)
+        {
+            t += (pixels[i * 4 + c] - mean[c]) * axis[c];
+        }
+
+        min_t = t < min_t ? t : min_t;
+        max_t = t > max_t ? t : max_t;
+    }
+
+    for (uint32_t c = 0; c < channel_count; ++c)
+    {
+        low[c] = mean[c] + axis[c] * min_t;
+        high[c] = mean[c] + axis[c] * max_t;
+    }
+}
+
+static int clamp_int(int value, int low, int high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+// With alpha the colour error is scaled by the source texel's alpha, the colour of a transparent texel is never seen
+static uint32_t colour_error(const uint8_t* source, const uint8_t* b, uint32_t channel_count)
+{
+    uint32_t error = 0;
+
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        int d = (int)source[c] - (int)b[c];
+        error += (uint32_t)(d * d);
+    }
+
+    if (channel_count == 4)
+    {
+        int d = (int)source[3] - (int)b[3];
+        error = (error * source[3] + 127) / 255 + (uint32_t)(d * d);
+    }
+
+    return error;
+}
+
+// Picks the nearest palette entry for each texel, returns the total squared error
+static uint32_t assign_indices(const uint8_t* pixels, const uint8_t (*palette)[4], uint32_t palette_size, uint32_t channel_count,
+                               uint8_t* indices)
+{
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        uint32_t best = UINT32_MAX;
+
+        for (uint32_t p = 0; p < palette_size; ++p)
+        {
+            uint32_t error = colour_error(pixels + i * 4, palette[p], channel_count);
+
+            if (error < best)
+            {
+                best = error;
+                indices[i] = (uint8_t)p;
+            }
+        }
+
+        total += best;
+    }
+
+    return total;
+}
+
+// Least squares endpoints for fixed indices, weights[i] is how much of endpoint 1 texel i takes
+static bool fit_endpoints(const uint8_t* pixels, const float* weights, uint32_t channel_count, float* e0, float* e1)
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = {}, bx[4] = {};
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        float b = weights[i];
+        float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+
+        for (uint32_t c = 0; c < channel_count; ++c)
+        {
+            ax[c] += a * pixels[i * 4 + c];
+            bx[c] += b * pixels[i * 4 + c];
+        }
+    }
+
+    float determinant = aa * bb - ab * ab;
+
+    if (fabsf(determinant) < 1e-6f)
+    {
+        return false;
+    }
+
+    for (uint32_t c = 0; c < channel_count; ++c)
+    {
+        e0[c] = (bb * ax[c] - ab * bx[c]) / determinant;
+        e1[c] = (aa * bx[c] - ab * ax[c]) / determinant;
+    }
+
+    return true;
+}
+
+static uint16_t pack_565(const float* colour)
+{
+    int r = clamp_int((int)(colour[0] * 31.0f / 255.0f + 0.5f), 0, 31);
+    int g = clamp_int((int)(colour[1] * 63.0f / 255.0f + 0.5f), 0, 63);
+    int b = clamp_int((int)(colour[2] * 31.0f / 255.0f + 0.5f), 0, 31);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpack_565(uint16_t packed, uint8_t* colour)
+{
+    uint32_t r = (packed >> 11) & 31;
+    uint32_t g = (packed >> 5) & 63;
+    uint32_t b = packed & 31;
+    colour[0] = (uint8_t)((r << 3) | (r >> 2));
+    colour[1] = (uint8_t)((g << 2) | (g >> 4));
+    colour[2] = (uint8_t)((b << 3) | (b >> 2));
+    colour[3] = 255;
+}
+
+// Four colour palette, valid when c0 > c1
+static void bc1_palette(uint16_t c0, uint16_t c1, uint8_t (*palette)[4])
+{
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (uint8_t)((2 * palette[0][c] + palette[1][c]) / 3);
+        palette[3][c] = (uint8_t)((palette[0][c] + 2 * palette[1][c]) / 3);
+    }
+
+    palette[2][3] = 255;
+    palette[3][3] = 255;
+}
+
+// Encodes the endpoints in four colour order, returns the block's error
+static uint32_t bc1_try(const uint8_t* pixels, const float* e0, const float* e1, uint16_t& c0, uint16_t& c1, uint8_t* indices)
+{
+    c0 = pack_565(e0);
+    c1 = pack_565(e1);
+
+    if (c0 < c1)
+    {
+        uint16_t swap = c0;
+        c0 = c1;
+        c1 = swap;
+    }
+
+    // Equal endpoints would select the three colour mode, whose last entry is black
+    if (c0 == c1)
+    {
+        memset(indices, 0, 16);
+        uint8_t colour[4];
+        unpack_565(c0, colour);
+        uint32_t error = 0;
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            error += colour_error(pixels + i * 4, colour, 3);
+        }
+
+        return error;
+    }
+
+    uint8_t palette[4][4];
+    bc1_palette(c0, c1, palette);
+    return assign_indices(pixels, palette, 4, 3, indices);
+}
+
+void encode_bc1(const uint8_t* pixels, uint8_t* block)
+{
+    float mean[4], axis[4], low[4], high[4];
+    principal_axis(pixels, 3, false, mean, axis);
+    project_extremes(pixels, 3, false, mean, axis, low, high);
+
+    uint16_t c0, c1;
+    uint8_t indices[16];
+    uint32_t error = bc1_try(pixels, high, low, c0, c1, indices);
+
+    // Refit the endpoints to the chosen indices while that lowers the error
+    static const float weights_by_index[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+    for (uint32_t iteration = 0; iteration < 2 && error > 0 && c0 != c1; ++iteration)
+    {
+        float weights[16];
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            weights[i] = weights_by_index[indices[i]];
+        }
+
+        float e0[4], e1[4];
+
+        if (!fit_endpoints(pixels, weights, 3, e0, e1))
+        {
+            break;
+        }
+
+        uint16_t refit_c0, refit_c1;
+        uint8_t refit_indices[16];
+        uint32_t refit_error = bc1_try(pixels, e0, e1, refit_c0, refit_c1, refit_indices);
+
+        if (refit_error >= error)
+        {
+            break;
+        }
+
+        error = refit_error;
+        c0 = refit_c0;
+        c1 = refit_c1;
+        memcpy(indices, refit_indices, 16);
+    }
+
+    uint32_t packed_indices = 0;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        packed_indices |= (uint32_t)indices[i] << (i * 2);
+    }
+
+    block[0] = (uint8_t)c0;
+    block[1] = (uint8_t)(c0 >> 8);
+    block[2] = (uint8_t)c1;
+    block[3] = (uint8_t)(c1 >> 8);
+    memcpy(block + 4, &packed_indices, 4);
+}
+
+void decode_bc1(const uint8_t* block, uint8_t* pixels)
+{
+    uint16_t c0 = (uint16_t)(block[0] | (block[1] << 8));
+    uint16_t c1 = (uint16_t)(block[2] | (block[3] << 8));
+    uint32_t packed_indices;
+    memcpy(&packed_indices, block + 4, 4);
+
+    uint8_t palette[4][4];
+
+    if (c0 > c1)
+    {
+        bc1_palette(c0, c1, palette);
+    }
+    else
+    {
+        unpack_565(c0, palette[0]);
+        unpack_565(c1, palette[1]);
+
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (uint8_t)((palette[0][c] + palette[1][c]) / 2);
+            palette[3][c] = 0;
+        }
+
+        palette[2][3] = 255;
+        palette[3][3] = 0;
+    }
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        memcpy(pixels + i * 4, palette[(packed_indices >> (i * 2)) & 3], 4);
+    }
+}
+
+static const uint32_t bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+struct Bc7Endpoints
+{
+    uint8_t colour[2][4]; // 7 bits per channel
+    uint8_t p[2];
+};
+
+static void bc7_palette(const Bc7Endpoints& endpoints, uint8_t (*palette)[4])
+{
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+        uint32_t e0 = ((uint32_t)endpoints.colour[0][c] << 1) | endpoints.p[0];
+        uint32_t e1 = ((uint32_t)endpoints.colour[1][c] << 1) | endpoints.p[1];
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            palette[i][c] = (uint8_t)(((64 - bc7_weights[i]) * e0 + bc7_weights[i] * e1 + 32) >> 6);
+        }
+    }
+}
+
+// Quantises the endpoints with each combination of p bits and keeps the best, returns the block's error
+static uint32_t bc7_try(const uint8_t* pixels, const float* e0, const float* e1, Bc7Endpoints& endpoints, uint8_t* indices)
+{
+    uint32_t best = UINT32_MAX;
+
+    for (uint32_t p = 0; p < 4; ++p)
+    {
+        Bc7Endpoints candidate;
+        candidate.p[0] = (uint8_t)(p & 1);
+        candidate.p[1] = (uint8_t)(p >> 1);
+
+        for (uint32_t c = 0; c < 4; ++c)
+        {
+            candidate.colour[0][c] = (uint8_t)clamp_int((int)floorf((e0[c] - candidate.p[0]) / 2.0f + 0.5f), 0, 127);
+            candidate.colour[1][c] = (uint8_t)clamp_int((int)floorf((e1[c] - candidate.p[1]) / 2.0f + 0.5f), 0, 127);
+        }
+
+        uint8_t palette[16][4];
+        uint8_t candidate_indices[16];
+        bc7_palette(candidate, palette);
+        uint32_t error = assign_indices(pixels, palette, 16, 4, candidate_indices);
+
+        if (error < best)
+        {
+            best = error;
+            endpoints = candidate;
+            memcpy(indices, candidate_indices, 16);
+        }
+    }
+
+    return best;
+}
+
+// Writes value's low bit_count bits at bit offset within the little endian 128 bit block
+static void write_bits(uint8_t* block, uint32_t& offset, uint32_t value, uint32_t bit_count)
+{
+    for (uint32_t i = 0; i < bit_count; ++i, ++offset)
+    {
+        block[offset >> 3] |= (uint8_t)(((value >> i) & 1) << (offset & 7));
+    }
+}
+
+static uint32_t read_bits(const uint8_t* block, uint32_t& offset, uint32_t bit_count)
+{
+    uint32_t value = 0;
+
+    for (uint32_t i = 0; i < bit_count; ++i, ++offset)
+    {
+        value |= (uint32_t)((block[offset >> 3] >> (offset & 7)) & 1) << i;
+    }
+
+    return value;
+}
+
+// Mode 6: one RGBA line with 7777.1 endpoints and 4 bit indices, returns the block's error
+static uint32_t encode_bc7_mode6(const uint8_t* pixels, uint8_t* block)
+{
+    float mean[4], axis[4], low[4], high[4];
+    principal_axis(pixels, 4, false, mean, axis);
+    project_extremes(pixels, 4, false, mean, axis, low, high);
+
+    Bc7Endpoints endpoints;
+    uint8_t indices[16];
+    uint32_t error = bc7_try(pixels, low, high, endpoints, indices);
+
+    for (uint32_t iteration = 0; iteration < 2 && error > 0; ++iteration)
+    {
+        float weights[16];
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            weights[i] = bc7_weights[indices[i]] / 64.0f;
+        }
+
+        float e0[4], e1[4];
+
+        if (!fit_endpoints(pixels, weights, 4, e0, e1))
+        {
+            break;
+        }
+
+        Bc7Endpoints refit;
+        uint8_t refit_indices[16];
+        uint32_t refit_error = bc7_try(pixels, e0, e1, refit, refit_indices);
+
+        if (refit_error >= error)
+        {
+            break;
+        }
+
+        error = refit_error;
+        endpoints = refit;
+        memcpy(indices, refit_indices, 16);
+    }
+
+    // The first texel's index is stored without its top bit, so it must be below 8
+    if (indices[0] >= 8)
+    {
+        Bc7Endpoints swapped;
+
+        for (uint32_t e = 0; e < 2; ++e)
+        {
+            memcpy(swapped.colour[e], endpoints.colour[1 - e], 4);
+            swapped.p[e] = endpoints.p[1 - e];
+        }
+
+        endpoints = swapped;
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            indices[i] = (uint8_t)(15 - indices[i]);
+        }
+    }
+
+    memset(block, 0, 16);
+    uint32_t offset = 0;
+    write_bits(block, offset, 1 << 6, 7);
+
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+        write_bits(block, offset, endpoints.colour[0][c], 7);
+        write_bits(block, offset, endpoints.colour[1][c], 7);
+    }
+
+    write_bits(block, offset, endpoints.p[0], 1);
+    write_bits(block, offset, endpoints.p[1], 1);
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        write_bits(block, offset, indices[i], i == 0 ? 3 : 4);
+    }
+
+    return error;
+}
+
+// Expands a 7 bit mode 5 colour endpoint to 8 bits
+static uint8_t expand_7(uint32_t value)
+{
+    return (uint8_t)((value << 1) | (value >> 6));
+}
+
+static const uint32_t bc7_weights_2[4] = { 0, 21, 43, 64 };
+
+static uint8_t interpolate_2(uint32_t e0, uint32_t e1, uint32_t index)
+{
+    return (uint8_t)(((64 - bc7_weights_2[index]) * e0 + bc7_weights_2[index] * e1 + 32) >> 6);
+}
+
+// Mode 5: an RGB line with 7 bit endpoints and an alpha line with 8 bit endpoints, each with their own 2 bit indices. Alpha is
+// fitted separately, which suits cutout textures where alpha is unrelated to colour. Returns the block's error.
+static uint32_t encode_bc7_mode5(const uint8_t* pixels, uint8_t* block)
+{
+    float mean[4], axis[4], low[4], high[4];
+    principal_axis(pixels, 3, true, mean, axis);
+    project_extremes(pixels, 3, true, mean, axis, low, high);
+
+    uint32_t colour[2][3];
+    uint8_t colour_indices[16];
+    uint32_t colour_error_total = UINT32_MAX;
+
+    for (uint32_t iteration = 0; iteration < 3; ++iteration)
+    {
+        uint32_t candidate[2][3];
+        uint8_t palette[4][4] = {};
+
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            candidate[0][c] = (uint32_t)clamp_int((int)(low[c] * 127.0f / 255.0f + 0.5f), 0, 127);
+            candidate[1][c] = (uint32_t)clamp_int((int)(high[c] * 127.0f / 255.0f + 0.5f), 0, 127);
+
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                palette[i][c] = interpolate_2(expand_7(candidate[0][c]), expand_7(candidate[1][c]), i);
+            }
+        }
+
+        // Only the colour is compared here, weighted by the texel's alpha
+        uint8_t candidate_indices[16];
+        uint32_t error = 0;
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            uint32_t best = UINT32_MAX;
+
+            for (uint32_t p = 0; p < 4; ++p)
+            {
+                uint32_t e = 0;
+
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    int d = (int)pixels[i * 4 + c] - (int)palette[p][c];
+                    e += (uint32_t)(d * d);
+                }
+
+                e = (e * pixels[i * 4 + 3] + 127) / 255;
+
+                if (e < best)
+                {
+                    best = e;
+                    candidate_indices[i] = (uint8_t)p;
+                }
+            }
+
+            error += best;
+        }
+
+        if (error >= colour_error_total)
+        {
+            break;
+        }
+
+        colour_error_total = error;
+        memcpy(colour, candidate, sizeof(colour));
+        memcpy(colour_indices, candidate_indices, 16);
+
+        float weights[16];
+        uint8_t weighted[64];
+
+        // The least squares fit is unweighted, so transparent texels take the colour they were assigned
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            weights[i] = bc7_weights_2[colour_indices[i]] / 64.0f;
+
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                weighted[i * 4 + c] = pixels[i * 4 + 3] ? pixels[i * 4 + c] : palette[colour_indices[i]][c];
+            }
+        }
+
+        if (!fit_endpoints(weighted, weights, 3, low, high))
+        {
+            break;
+        }
+    }
+
+    // Alpha endpoints are the extremes, nearest index per texel
+    uint32_t alpha[2] = { 255, 0 };
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        alpha[0] = pixels[i * 4 + 3] < alpha[0] ? pixels[i * 4 + 3] : alpha[0];
+        alpha[1] = pixels[i * 4 + 3] > alpha[1] ? pixels[i * 4 + 3] : alpha[1];
+    }
+
+    uint8_t alpha_indices[16];
+    uint32_t alpha_error = 0;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        uint32_t best = UINT32_MAX;
+
+        for (uint32_t p = 0; p < 4; ++p)
+        {
+            int d = (int)pixels[i * 4 + 3] - (int)interpolate_2(alpha[0], alpha[1], p);
+
+            if ((uint32_t)(d * d) < best)
+            {
+                best = (uint32_t)(d * d);
+                alpha_indices[i] = (uint8_t)p;
+            }
+        }
+
+        alpha_error += best;
+    }
+
+    // The first texel's indices are stored without their top bit
+    if (colour_indices[0] >= 2)
+    {
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            uint32_t swap = colour[0][c];
+            colour[0][c] = colour[1][c];
+            colour[1][c] = swap;
+        }
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            colour_indices[i] = (uint8_t)(3 - colour_indices[i]);
+        }
+    }
+
+    if (alpha_indices[0] >= 2)
+    {
+        uint32_t swap = alpha[0];
+        alpha[0] = alpha[1];
+        alpha[1] = swap;
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            alpha_indices[i] = (uint8_t)(3 - alpha_indices[i]);
+        }
+    }
+
+    memset(block, 0, 16);
+    uint32_t offset = 0;
+    write_bits(block, offset, 1 << 5, 6);
+    write_bits(block, offset, 0, 2); // no channel rotation
+
+    for (uint32_t c = 0; c < 3; ++c)
+    {
+        write_bits(block, offset, colour[0][c], 7);
+        write_bits(block, offset, colour[1][c], 7);
+    }
+
+    write_bits(block, offset, alpha[0], 8);
+    write_bits(block, offset, alpha[1], 8);
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        write_bits(block, offset, colour_indices[i], i == 0 ? 1 : 2);
+    }
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        write_bits(block, offset, alpha_indices[i], i == 0 ? 1 : 2);
+    }
+
+    return colour_error_total + alpha_error;
+}
+
+void encode_bc7(const uint8_t* pixels, uint8_t* block)
+{
+    uint8_t mode5_block[16];
+    uint32_t mode6_error = encode_bc7_mode6(pixels, block);
+
+    if (mode6_error > 0 && encode_bc7_mode5(pixels, mode5_block) < mode6_error)
+    {
+        memcpy(block, mode5_block, 16);
+    }
+}
+
+bool decode_bc7(const uint8_t* block, uint8_t* pixels)
+{
+    uint32_t offset = 0;
+    uint32_t mode = 0;
+
+    while (mode < 8 && !read_bits(block, offset, 1))
+    {
+        ++mode;
+    }
+
+    if (mode == 5)
+    {
+        uint32_t rotation = read_bits(block, offset, 2);
+        uint32_t colour[2][3];
+
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            colour[0][c] = expand_7(read_bits(block, offset, 7));
+            colour[1][c] = expand_7(read_bits(block, offset, 7));
+        }
+
+        uint32_t alpha[2];
+        alpha[0] = read_bits(block, offset, 8);
+        alpha[1] = read_bits(block, offset, 8);
+
+        uint32_t colour_indices[16];
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            colour_indices[i] = read_bits(block, offset, i == 0 ? 1 : 2);
+        }
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            uint32_t alpha_index = read_bits(block, offset, i == 0 ? 1 : 2);
+            uint8_t* texel = pixels + i * 4;
+
+            for (uint32_t c = 0; c < 3; ++c)
+            {
+                texel[c] = interpolate_2(colour[0][c], colour[1][c], colour_indices[i]);
+            }
+
+            texel[3] = interpolate_2(alpha[0], alpha[1], alpha_index);
+
+            if (rotation)
+            {
+                uint8_t swap = texel[3];
+                texel[3] = texel[rotation - 1];
+                texel[rotation - 1] = swap;
+            }
+        }
+
+        return true;
+    }
+
+    if (mode != 6)
+    {
+        return false;
+    }
+
+    Bc7Endpoints endpoints;
+
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+        endpoints.colour[0][c] = (uint8_t)read_bits(block, offset, 7);
+        endpoints.colour[1][c] = (uint8_t)read_bits(block, offset, 7);
+    }
+
+    endpoints.p[0] = (uint8_t)read_bits(block, offset, 1);
+    endpoints.p[1] = (uint8_t)read_bits(block, offset, 1);
+
+    uint8_t palette[16][4];
+    bc7_palette(endpoints, palette);
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        memcpy(pixels + i * 4, palette[read_bits(block, offset, i == 0 ? 3 : 4)], 4);
+    }
+
+    return true;
+}
+
+} // namespace bc_codec
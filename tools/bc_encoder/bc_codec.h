@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// Block compression of 4x4 RGBA8 blocks. Pixels are 16 RGBA texels in row order.
+namespace bc_codec
+{
+
+// 8 bytes, four colour mode only so the block is opaque
+void encode_bc1(const uint8_t* pixels, uint8_t* block);
+void decode_bc1(const uint8_t* block, uint8_t* pixels);
+
+// 16 bytes, whichever of mode 6 (one RGBA line) and mode 5 (separate RGB and alpha lines) fits the block better
+void encode_bc7(const uint8_t* pixels, uint8_t* block);
+// Returns false for the modes encode_bc7 doesn't write
+bool decode_bc7(const uint8_t* block, uint8_t* pixels);
+
+} // namespace bc_codec
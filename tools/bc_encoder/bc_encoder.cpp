@@ -0,0 +1,377 @@
+// Offline BC1/BC7 encoder for the block texture array. Opaque layers are encoded as BC1 and layers with alpha as BC7, mips
+// included, into the blob described in compressed_texture.h. Every block is decoded again to report the PSNR of each layer.
+//
+//   bc_encoder <texture directory> [output file] [-min-psnr dB]
+//
+// The output defaults to the directory name with ".bc" appended, next to the cooked RGBA blob TextureArray writes.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include <stb_image.h>
+
+#include "bc_codec.h"
+#include "compressed_texture.h"
+#include "texture_mips.h"
+
+namespace fs = std::filesystem;
+
+struct Layer
+{
+    std::string name;
+    uint64_t file_size = 0;
+    std::vector<std::vector<uint8_t>> levels; // RGBA8, level 0 first
+    uint32_t array = compressed_texture::bc1_array;
+    double squared_error[2] = {}; // level 0, all levels
+    uint64_t samples[2] = {};
+};
+
+// TextureArray lists the sources with FindFirstFile, which returns NTFS directory order: names compared case insensitively as
+// upper case
+static bool ntfs_order(const Layer& a, const Layer& b)
+{
+    size_t length = std::min(a.name.size(), b.name.size());
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        int ca = toupper((unsigned char)a.name[i]);
+        int cb = toupper((unsigned char)b.name[i]);
+
+        if (ca != cb)
+        {
+            return ca < cb;
+        }
+    }
+
+    return a.name.size() < b.name.size();
+}
+
+static double psnr(double squared_error, uint64_t samples)
+{
+    if (squared_error == 0.0)
+    {
+        return INFINITY;
+    }
+
+    return 10.0 * log10(255.0 * 255.0 * samples / squared_error);
+}
+
+// Encodes one level of a layer, then decodes it to accumulate the error over the channels the format keeps
+static bool encode_level(Layer& layer, uint32_t level, uint32_t width, uint32_t height, uint8_t* out)
+{
+    const uint8_t* pixels = layer.levels[level].data();
+    uint32_t channel_count = layer.array == compressed_texture::bc1_array ? 3 : 4;
+    uint32_t block_size = compressed_texture::block_size(layer.array);
+
+    for (uint32_t by = 0; by < height; by += 4)
+    {
+        for (uint32_t bx = 0; bx < width; bx += 4)
+        {
+            // Levels smaller than a block repeat their edge texels
+            uint8_t source[64];
+
+            for (uint32_t i = 0; i < 16; ++i)
+            {
+                uint32_t x = std::min(bx + (i & 3), width - 1);
+                uint32_t y = std::min(by + (i >> 2), height - 1);
+                memcpy(source + i * 4, pixels + (y * width + x) * 4, 4);
+            }
+
+            uint8_t decoded[64];
+
+            if (layer.array == compressed_texture::bc1_array)
+            {
+                bc_codec::encode_bc1(source, out);
+                bc_codec::decode_bc1(out, decoded);
+            }
+            else
+            {
+                bc_codec::encode_bc7(source, out);
+
+                if (!bc_codec::decode_bc7(out, decoded))
+                {
+                    return false;
+                }
+            }
+
+            out += block_size;
+
+            for (uint32_t i = 0; i < 16; ++i)
+            {
+                if (bx + (i & 3) >= width || by + (i >> 2) >= height)
+                {
+                    continue;
+                }
+
+                // Colour error is scaled by alpha for BC7 layers, a transparent texel's colour is never seen
+                double colour_weight = channel_count == 4 ? source[i * 4 + 3] / 255.0 : 1.0;
+
+                for (uint32_t c = 0; c < channel_count; ++c)
+                {
+                    double d = (double)source[i * 4 + c] - (double)decoded[i * 4 + c];
+
+                    for (uint32_t total = (level == 0 ? 0 : 1); total < 2; ++total)
+                    {
+                        layer.squared_error[total] += d * d * (c < 3 ? colour_weight : 1.0);
+                        layer.samples[total] += 1;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory;
+    std::string output;
+    double min_psnr = 0.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-min-psnr") == 0 && i + 1 < argc)
+        {
+            min_psnr = atof(argv[++i]);
+        }
+        else if (directory.empty())
+        {
+            directory = argv[i];
+        }
+        else if (output.empty())
+        {
+            output = argv[i];
+        }
+    }
+
+    if (directory.empty())
+    {
+        fprintf(stderr, "usage: bc_encoder <texture directory> [output file] [-min-psnr dB]\n");
+        return EXIT_FAILURE;
+    }
+
+    while (directory.size() > 1 && (directory.back() == '/' || directory.back() == '\\'))
+    {
+        directory.pop_back();
+    }
+
+    if (output.empty())
+    {
+        output = directory + ".bc";
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<Layer> layers;
+    std::error_code error;
+
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory, error))
+    {
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+
+        if (entry.is_regular_file() && extension == ".png")
+        {
+            Layer layer;
+            layer.name = entry.path().filename().string();
+            layer.file_size = (uint64_t)entry.file_size();
+            layers.push_back(std::move(layer));
+        }
+    }
+
+    if (error || layers.empty())
+    {
+        fprintf(stderr, "bc_encoder: no PNG files in %s\n", directory.c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (layers.size() > compressed_texture::max_layers)
+    {
+        fprintf(stderr, "bc_encoder: %zu layers, at most %u fit the vertex format\n", layers.size(), compressed_texture::max_layers);
+        return EXIT_FAILURE;
+    }
+
+    std::sort(layers.begin(), layers.end(), ntfs_order);
+
+    compressed_texture::Header header = {};
+    header.magic = compressed_texture::magic;
+    header.version = compressed_texture::version;
+    header.source_hash = compressed_texture::source_hash_seed;
+    header.layer_count = (uint32_t)layers.size();
+
+    for (Layer& layer : layers)
+    {
+        std::string path = directory + "/" + layer.name;
+        int width, height, components;
+        stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &components, STBI_rgb_alpha);
+
+        if (!pixels)
+        {
+            fprintf(stderr, "bc_encoder: can't decode %s: %s\n", path.c_str(), stbi_failure_reason());
+            return EXIT_FAILURE;
+        }
+
+        if (header.width == 0)
+        {
+            header.width = (uint32_t)width;
+            header.height = (uint32_t)height;
+            header.mip_levels = texture_mips::level_count(header.width, header.height);
+        }
+
+        if ((uint32_t)width != header.width || (uint32_t)height != header.height)
+        {
+            fprintf(stderr, "bc_encoder: %s is %dx%d, expected %ux%u\n", path.c_str(), width, height, header.width, header.height);
+            stbi_image_free(pixels);
+            return EXIT_FAILURE;
+        }
+
+        layer.levels.resize(header.mip_levels);
+        layer.levels[0].assign(pixels, pixels + (size_t)width * height * texture_mips::texel_size);
+        stbi_image_free(pixels);
+
+        for (uint32_t level = 1; level < header.mip_levels; ++level)
+        {
+            uint32_t src_width = texture_mips::level_extent(header.width, level - 1);
+            uint32_t src_height = texture_mips::level_extent(header.height, level - 1);
+            layer.levels[level].resize((size_t)texture_mips::level_extent(header.width, level) * texture_mips::level_extent(header.height, level) *
+                                       texture_mips::texel_size);
+            texture_mips::box_filter(layer.levels[level - 1].data(), src_width, src_height, layer.levels[level].data());
+        }
+
+        // Any translucent texel needs BC7, the mips of a fully opaque layer stay opaque
+        for (size_t i = 3; i < layer.levels[0].size(); i += texture_mips::texel_size)
+        {
+            if (layer.levels[0][i] != 255)
+            {
+                layer.array = compressed_texture::bc7_array;
+                break;
+            }
+        }
+
+        header.source_hash = compressed_texture::hash_source(header.source_hash, layer.name.c_str(), layer.name.size(), layer.file_size);
+    }
+
+    std::vector<uint32_t> layer_map(header.layer_count);
+
+    for (uint32_t i = 0; i < header.layer_count; ++i)
+    {
+        uint32_t array = layers[i].array;
+        layer_map[i] = (array << compressed_texture::array_shift) | header.array_layers[array]++;
+    }
+
+    std::vector<uint8_t> data[compressed_texture::array_count];
+
+    for (uint32_t array = 0; array < compressed_texture::array_count; ++array)
+    {
+        uint32_t block_size = compressed_texture::block_size(array);
+
+        for (uint32_t level = 0; level < header.mip_levels; ++level)
+        {
+            header.array_sizes[array] += compressed_texture::level_size(header.width, header.height, header.array_layers[array], level, block_size);
+        }
+
+        data[array].resize(header.array_sizes[array]);
+        uint8_t* out = data[array].data();
+
+        for (uint32_t level = 0; level < header.mip_levels; ++level)
+        {
+            uint32_t width = texture_mips::level_extent(header.width, level);
+            uint32_t height = texture_mips::level_extent(header.height, level);
+            uint64_t layer_size = compressed_texture::level_size(header.width, header.height, 1, level, block_size);
+
+            for (Layer& layer : layers)
+            {
+                if (layer.array != array)
+                {
+                    continue;
+                }
+
+                if (!encode_level(layer, level, width, height, out))
+                {
+                    fprintf(stderr, "bc_encoder: %s level %u failed to decode\n", layer.name.c_str(), level);
+                    return EXIT_FAILURE;
+                }
+
+                out += layer_size;
+            }
+        }
+    }
+
+    FILE* fp = fopen(output.c_str(), "wb");
+
+    if (!fp)
+    {
+        fprintf(stderr, "bc_encoder: can't write %s\n", output.c_str());
+        return EXIT_FAILURE;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                   fwrite(layer_map.data(), sizeof(uint32_t), layer_map.size(), fp) == layer_map.size();
+
+    for (uint32_t array = 0; array < compressed_texture::array_count; ++array)
+    {
+        written = written && fwrite(data[array].data(), 1, data[array].size(), fp) == data[array].size();
+    }
+
+    written = fclose(fp) == 0 && written;
+
+    if (!written)
+    {
+        fprintf(stderr, "bc_encoder: can't write %s\n", output.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // PSNR is over RGB for BC1 layers, which are opaque, and RGBA with colour weighted by alpha for BC7 layers
+    printf("%-32s %-6s %10s %10s\n", "layer", "format", "mip 0 dB", "all dB");
+    double worst = INFINITY;
+    double squared_error[2] = {};
+    uint64_t samples[2] = {};
+
+    for (const Layer& layer : layers)
+    {
+        double level0 = psnr(layer.squared_error[0], layer.samples[0]);
+        printf("%-32s %-6s %10.2f %10.2f\n", layer.name.c_str(), layer.array == compressed_texture::bc1_array ? "BC1" : "BC7", level0,
+               psnr(layer.squared_error[1], layer.samples[1]));
+        worst = std::min(worst, level0);
+
+        for (uint32_t total = 0; total < 2; ++total)
+        {
+            squared_error[total] += layer.squared_error[total];
+            samples[total] += layer.samples[total];
+        }
+    }
+
+    uint64_t rgba_size = 0;
+
+    for (uint32_t level = 0; level < header.mip_levels; ++level)
+    {
+        rgba_size += (uint64_t)texture_mips::level_extent(header.width, level) * texture_mips::level_extent(header.height, level) *
+                     texture_mips::texel_size * header.layer_count;
+    }
+
+    uint64_t compressed_size = header.array_sizes[0] + header.array_sizes[1];
+    printf("%-32s %-6s %10.2f %10.2f\n", "total", "", psnr(squared_error[0], samples[0]), psnr(squared_error[1], samples[1]));
+    printf("%u layers (%u BC1, %u BC7) %ux%u with %u mips: %llu bytes RGBA -> %llu bytes (%.1fx) in %.1f ms, written to %s\n",
+           header.layer_count, header.array_layers[0], header.array_layers[1], header.width, header.height, header.mip_levels,
+           (unsigned long long)rgba_size, (unsigned long long)compressed_size, (double)rgba_size / compressed_size,
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), output.c_str());
+
+    if (worst < min_psnr)
+    {
+        fprintf(stderr, "bc_encoder: worst layer %.2f dB is below -min-psnr %.2f\n", worst, min_psnr);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}